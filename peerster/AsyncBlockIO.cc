@@ -0,0 +1,235 @@
+#include "AsyncBlockIO.hh"
+
+#include <QDebug>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_LIBURING
+#include <sys/eventfd.h>
+
+#define ASYNC_IO_INDEX_BITS (20)            // low bits of an op's user data: index of its block in the request
+#endif
+
+AsyncBlockIO::AsyncBlockIO() {
+    nextRequestId = 1;
+    pendingRequests = new QHash<quint64, PendingRequest>();
+    threadPool = new QThreadPool(this);
+    threadPool->setMaxThreadCount(ASYNC_IO_THREADS);
+
+#ifdef HAVE_LIBURING
+    unsubmittedOps = new QQueue<QPair<quint64, int> >();
+    opsInFlight = 0;
+    eventNotifier = NULL;
+    eventFd = -1;
+
+    // Completions wake up the event loop through an eventfd
+    ringReady = io_uring_queue_init(ASYNC_IO_QUEUE_DEPTH, &ring, 0) == 0;
+    if (ringReady) {
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0 || io_uring_register_eventfd(&ring, eventFd) != 0) {
+            if (eventFd >= 0) close(eventFd);
+            io_uring_queue_exit(&ring);
+            ringReady = false;
+        }
+    }
+
+    if (ringReady) {
+        eventNotifier = new QSocketNotifier(eventFd, QSocketNotifier::Read, this);
+        connect(eventNotifier, SIGNAL(activated(int)), this, SLOT(reapCompletions()));
+    } else {
+        qDebug() << "io_uring is not available .. disk I/O goes through a thread pool";
+    }
+#endif
+}
+
+AsyncBlockIO::~AsyncBlockIO() {
+
+    threadPool->waitForDone();
+
+#ifdef HAVE_LIBURING
+    if (ringReady) {
+        // The kernel may still be using the buffers of ops in flight
+        struct io_uring_cqe *cqe;
+        while (opsInFlight > 0 && io_uring_wait_cqe(&ring, &cqe) == 0) {
+            io_uring_cqe_seen(&ring, cqe);
+            opsInFlight--;
+        }
+        io_uring_queue_exit(&ring);
+        close(eventFd);
+    }
+#endif
+
+    QHash<quint64, PendingRequest>::const_iterator it;
+    for (it = pendingRequests->constBegin(); it != pendingRequests->constEnd(); ++it) {
+        if (it.value().fd >= 0) close(it.value().fd);
+    }
+    delete pendingRequests;
+}
+
+/* Reads length bytes at offset .. completes with readFinished */
+quint64 AsyncBlockIO::read(int fd, qint64 offset, int length) {
+
+    QList<QPair<qint64, QByteArray> > blocks;
+    blocks.append(qMakePair(offset, QByteArray(length, 0)));
+    return startRequest(fd, false, blocks);
+}
+
+/* Writes each block at its offset .. completes with writeFinished once all of them are written */
+quint64 AsyncBlockIO::write(int fd, QList<QPair<qint64, QByteArray> > blocks) {
+
+    return startRequest(fd, true, blocks);
+}
+
+int AsyncBlockIO::getNumberOfPendingRequests() {
+    return pendingRequests->size();
+}
+
+quint64 AsyncBlockIO::startRequest(int fd, bool isWrite, QList<QPair<qint64, QByteArray> > blocks) {
+
+    quint64 requestId = nextRequestId++;
+
+    // Our own descriptor: the file may be closed before the request completes
+    PendingRequest request;
+    request.fd = dup(fd);
+    request.isWrite = isWrite;
+    request.blocks = blocks;
+    request.remainingOps = blocks.size();
+    request.ok = request.fd >= 0;
+    pendingRequests->insert(requestId, request);
+
+#ifdef HAVE_LIBURING
+    if (ringReady && !blocks.isEmpty() && request.ok) {
+        for (int i = 0; i < blocks.size(); i++) {
+            unsubmittedOps->enqueue(qMakePair(requestId, i));
+        }
+        submitOps();
+        return requestId;
+    }
+#endif
+
+    BlockIOTask *task = new BlockIOTask(requestId, request.fd, isWrite, blocks);
+    task->setAutoDelete(false);
+    connect(task, SIGNAL(finished(quint64,QByteArray,bool)), this, SLOT(taskFinished(quint64,QByteArray,bool)));
+    connect(task, SIGNAL(finished(quint64,QByteArray,bool)), task, SLOT(deleteLater()));
+    threadPool->start(task);
+    return requestId;
+}
+
+void AsyncBlockIO::finishRequest(quint64 requestId) {
+
+    PendingRequest request = pendingRequests->take(requestId);
+    if (request.fd >= 0) close(request.fd);
+
+    if (request.isWrite) {
+        emit writeFinished(requestId, request.ok);
+    } else {
+        emit readFinished(requestId, request.ok ? request.blocks.first().second : QByteArray());
+    }
+}
+
+void AsyncBlockIO::taskFinished(quint64 requestId, QByteArray data, bool ok) {
+
+    if (!pendingRequests->contains(requestId)) return;
+
+    PendingRequest &request = (*pendingRequests)[requestId];
+    request.ok = request.ok && ok;
+    if (!request.isWrite) request.blocks[0].second = data;
+    finishRequest(requestId);
+}
+
+/* Picks up the ops the kernel completed and submits those that were waiting for room in the ring */
+void AsyncBlockIO::reapCompletions() {
+
+#ifdef HAVE_LIBURING
+    eventfd_t count;
+    eventfd_read(eventFd, &count);
+
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+        quint64 userData = cqe->user_data;
+        int result = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        opsInFlight--;
+
+        opCompleted(userData >> ASYNC_IO_INDEX_BITS, userData & ((1 << ASYNC_IO_INDEX_BITS) - 1), result);
+    }
+
+    submitOps();
+#endif
+}
+
+#ifdef HAVE_LIBURING
+void AsyncBlockIO::submitOps() {
+
+    int numSubmitted = 0;
+    while (!unsubmittedOps->isEmpty()) {
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (sqe == NULL) break;     // ring full .. the rest go once ops complete
+
+        QPair<quint64, int> op = unsubmittedOps->dequeue();
+        PendingRequest &request = (*pendingRequests)[op.first];
+        QPair<qint64, QByteArray> &block = request.blocks[op.second];
+
+        // Buffers stay put until the request completes: they are only copied, never resized
+        if (request.isWrite) {
+            io_uring_prep_write(sqe, request.fd, block.second.constData(), block.second.size(), block.first);
+        } else {
+            io_uring_prep_read(sqe, request.fd, block.second.data(), block.second.size(), block.first);
+        }
+        sqe->user_data = (op.first << ASYNC_IO_INDEX_BITS) | op.second;
+        numSubmitted++;
+    }
+
+    if (numSubmitted == 0) return;
+    opsInFlight += numSubmitted;
+    io_uring_submit(&ring);
+}
+
+/* Blocks are within the file (or extend it) so anything short of the whole block is an error */
+void AsyncBlockIO::opCompleted(quint64 requestId, int blockIdx, int result) {
+
+    QHash<quint64, PendingRequest>::iterator it = pendingRequests->find(requestId);
+    if (it == pendingRequests->end()) return;
+
+    if (result != it.value().blocks.at(blockIdx).second.size()) {
+        qDebug() << "Disk I/O error:" << (result < 0 ? strerror(-result) : "short transfer");
+        it.value().ok = false;
+    }
+    if (--it.value().remainingOps == 0) finishRequest(requestId);
+}
+#endif
+
+BlockIOTask::BlockIOTask(quint64 requestId, int fd, bool isWrite, QList<QPair<qint64, QByteArray> > blocks) {
+    this->requestId = requestId;
+    this->fd = fd;
+    this->isWrite = isWrite;
+    this->blocks = blocks;
+}
+
+void BlockIOTask::run() {
+
+    bool ok = fd >= 0;
+    QByteArray readData;
+
+    for (int i = 0; ok && i < blocks.size(); i++) {
+
+        qint64 offset = blocks.at(i).first;
+        int length = blocks.at(i).second.size();
+        if (!isWrite) readData.resize(length);
+
+        // Calls may transfer less than asked or be interrupted
+        int done = 0;
+        while (done < length) {
+            ssize_t result = isWrite ? pwrite(fd, blocks.at(i).second.constData() + done, length - done, offset + done)
+                                     : pread(fd, readData.data() + done, length - done, offset + done);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+            done += result;
+        }
+        ok = done == length;
+    }
+
+    emit finished(requestId, readData, ok);
+}
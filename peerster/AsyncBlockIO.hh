@@ -0,0 +1,98 @@
+#ifndef ASYNCBLOCKIO_HH
+#define ASYNCBLOCKIO_HH
+
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QQueue>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <QSocketNotifier>
+#endif
+
+#define ASYNC_IO_QUEUE_DEPTH (128)          // io_uring submission queue entries
+#define ASYNC_IO_THREADS (8)                // I/Os in flight at once without io_uring
+
+/* Block reads and writes off the event loop thread, so that a slow disk doesn't hold up the network.
+ * Requests are given a file descriptor (duplicated, so closing the file meanwhile is harmless) and
+ * complete with readFinished / writeFinished on the event loop thread. A write request is a batch
+ * of blocks at their offsets and completes once all of them are written.
+ * Built with HAVE_LIBURING, the blocks go to io_uring (many I/Os in flight from one thread, which
+ * keeps NVMe drives busy) and completions are picked up through an eventfd. Otherwise each request
+ * runs as a task on a small thread pool with pread / pwrite.
+ */
+
+class AsyncBlockIO : public QObject
+{
+    Q_OBJECT
+
+public:
+    AsyncBlockIO();
+    ~AsyncBlockIO();
+
+    quint64 read(int fd, qint64 offset, int length);
+    quint64 write(int fd, QList<QPair<qint64, QByteArray> > blocks);
+    int getNumberOfPendingRequests();
+
+private:
+    struct PendingRequest {
+        int fd;
+        bool isWrite;
+        QList<QPair<qint64, QByteArray> > blocks;   // < offset, data > .. a single buffer to fill for a read
+        int remainingOps;                   // blocks not completed yet
+        bool ok;
+    };
+
+    quint64 nextRequestId;
+    QHash<quint64, PendingRequest> *pendingRequests;  // < request id, request in flight >
+    QThreadPool *threadPool;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool ringReady;
+    int eventFd;
+    QSocketNotifier *eventNotifier;
+    QQueue<QPair<quint64, int> > *unsubmittedOps;    // < request id, block index > waiting for room in the ring
+    int opsInFlight;
+
+    void submitOps();
+    void opCompleted(quint64 requestId, int blockIdx, int result);
+#endif
+
+    quint64 startRequest(int fd, bool isWrite, QList<QPair<qint64, QByteArray> > blocks);
+    void finishRequest(quint64 requestId);
+
+private slots:
+    void reapCompletions();
+    void taskFinished(quint64 requestId, QByteArray data, bool ok);
+
+signals:
+    void readFinished(quint64 requestId, QByteArray data);   // empty on error
+    void writeFinished(quint64 requestId, bool ok);
+};
+
+/* Fallback: one request done with blocking calls on a pool thread */
+class BlockIOTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    BlockIOTask(quint64 requestId, int fd, bool isWrite, QList<QPair<qint64, QByteArray> > blocks);
+    void run();
+
+private:
+    quint64 requestId;
+    int fd;
+    bool isWrite;
+    QList<QPair<qint64, QByteArray> > blocks;
+
+signals:
+    void finished(quint64 requestId, QByteArray data, bool ok);
+};
+
+#endif // ASYNCBLOCKIO_HH
@@ -0,0 +1,120 @@
+#include "BlockCache.hh"
+#include "FileShareManager.hh"
+
+BlockCache::BlockCache(qint64 maxBytes) {
+
+    this->maxBytes = maxBytes;
+    recentBytes = 0;
+    entries = new QHash<QByteArray, CacheEntry>();
+    recentQueue = new QLinkedList<QByteArray>();
+    frequentQueue = new QLinkedList<QByteArray>();
+    ghostQueue = new QLinkedList<QByteArray>();
+    ghostEntries = new QHash<QByteArray, QLinkedList<QByteArray>::iterator>();
+    maxGhostEntries = (int) (maxBytes / BLOCK_CACHE_GHOST_SHARE / BLOCK_SIZE);
+
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+    stats.bytes = 0;
+    stats.blocks = 0;
+}
+
+/* Returns the cached block, or an empty array on a miss */
+QByteArray BlockCache::lookup(QByteArray blockHash) {
+
+    QHash<QByteArray, CacheEntry>::iterator it = entries->find(blockHash);
+    if (it == entries->end()) {
+        stats.misses++;
+        return QByteArray();
+    }
+
+    // Hits in the recent FIFO don't reorder it .. one busy burst doesn't make a block popular
+    CacheEntry &entry = it.value();
+    if (entry.queue == FrequentQueue) {
+        frequentQueue->erase(entry.position);
+        entry.position = frequentQueue->insert(frequentQueue->end(), blockHash);
+    }
+
+    stats.hits++;
+    return entry.data;
+}
+
+/* Caches a block after a miss. Data is copied, so views into larger buffers can be passed in. */
+void BlockCache::insert(QByteArray blockHash, QByteArray data) {
+
+    if (data.isEmpty() || data.size() > maxBytes || entries->contains(blockHash)) return;
+
+    CacheEntry entry;
+    entry.data = QByteArray(data.constData(), data.size());
+
+    // Seen before it fell out of the recent FIFO .. it is popular
+    QHash<QByteArray, QLinkedList<QByteArray>::iterator>::iterator ghostIt = ghostEntries->find(blockHash);
+    if (ghostIt != ghostEntries->end()) {
+        ghostQueue->erase(ghostIt.value());
+        ghostEntries->erase(ghostIt);
+        entry.queue = FrequentQueue;
+        entry.position = frequentQueue->insert(frequentQueue->end(), blockHash);
+    } else {
+        entry.queue = RecentQueue;
+        entry.position = recentQueue->insert(recentQueue->end(), blockHash);
+        recentBytes += data.size();
+    }
+
+    entries->insert(blockHash, entry);
+    stats.bytes += data.size();
+    stats.blocks++;
+
+    while (stats.bytes > maxBytes) evict();
+}
+
+void BlockCache::remove(QByteArray blockHash) {
+
+    QHash<QByteArray, CacheEntry>::iterator it = entries->find(blockHash);
+    if (it == entries->end()) return;
+
+    const CacheEntry &entry = it.value();
+    if (entry.queue == RecentQueue) {
+        recentQueue->erase(entry.position);
+        recentBytes -= entry.data.size();
+    } else {
+        frequentQueue->erase(entry.position);
+    }
+    stats.bytes -= entry.data.size();
+    stats.blocks--;
+    entries->erase(it);
+}
+
+BlockCache::Stats BlockCache::getStats() {
+    return stats;
+}
+
+/* Drops one block: the oldest of the recent FIFO while it holds more than its share,
+   otherwise the least recently used of the main queue
+*/
+void BlockCache::evict() {
+
+    QByteArray blockHash;
+    bool fromRecent = !recentQueue->isEmpty() &&
+            (recentBytes > maxBytes / BLOCK_CACHE_RECENT_SHARE || frequentQueue->isEmpty());
+    if (fromRecent) {
+        blockHash = recentQueue->first();
+    } else {
+        blockHash = frequentQueue->first();
+    }
+
+    remove(blockHash);
+    stats.evictions++;
+
+    // Remember blocks pushed out of the recent FIFO .. a second request promotes them
+    if (fromRecent) addGhost(blockHash);
+}
+
+void BlockCache::addGhost(QByteArray blockHash) {
+
+    if (maxGhostEntries <= 0) return;
+
+    ghostEntries->insert(blockHash, ghostQueue->insert(ghostQueue->end(), blockHash));
+    while (ghostQueue->size() > maxGhostEntries) {
+        ghostEntries->remove(ghostQueue->takeFirst());
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef BLOCKCACHE_HH
+#define BLOCKCACHE_HH
+
+#include <QByteArray>
+#include <QHash>
+#include <QLinkedList>
+
+#define BLOCK_CACHE_SIZE (32 * 1024 * 1024)     // bytes of served blocks kept in memory
+#define BLOCK_CACHE_RECENT_SHARE (4)            // 1/4 of the cache holds blocks seen once
+#define BLOCK_CACHE_GHOST_SHARE (2)             // remember the hashes of 1/2 a cache of evicted blocks
+
+/* Size bounded in-memory cache of the blocks we serve, with 2Q eviction.
+ * A block requested for the first time goes to a small FIFO of recent blocks. If it is
+ * requested again after falling out of that FIFO (its hash is still in the ghost list),
+ * it is promoted to the main LRU queue. A one-off scan through a big file therefore only
+ * churns the FIFO and doesn't push the popular blocks out of the main queue.
+ */
+
+class BlockCache
+{
+
+public:
+    struct Stats {
+        qint64 hits;
+        qint64 misses;
+        qint64 evictions;
+        qint64 bytes;                           // cached data
+        int blocks;
+    };
+
+    BlockCache(qint64 maxBytes);
+
+    QByteArray lookup(QByteArray blockHash);
+    void insert(QByteArray blockHash, QByteArray data);
+    void remove(QByteArray blockHash);
+    Stats getStats();
+
+private:
+    enum Queue { RecentQueue, FrequentQueue };
+
+    struct CacheEntry {
+        QByteArray data;
+        Queue queue;
+        QLinkedList<QByteArray>::iterator position;
+    };
+
+    qint64 maxBytes;
+    qint64 recentBytes;                         // data in the recent FIFO
+    QHash<QByteArray, CacheEntry> *entries;     // < block hash, cached block >
+    QLinkedList<QByteArray> *recentQueue;       // A1in: blocks seen once, oldest first
+    QLinkedList<QByteArray> *frequentQueue;     // Am: blocks seen again, least recently used first
+    QLinkedList<QByteArray> *ghostQueue;        // A1out: hashes evicted from the recent FIFO, oldest first
+    QHash<QByteArray, QLinkedList<QByteArray>::iterator> *ghostEntries;
+    int maxGhostEntries;
+    Stats stats;
+
+    void evict();
+    void addGhost(QByteArray blockHash);
+};
+
+#endif // BLOCKCACHE_HH
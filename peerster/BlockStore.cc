@@ -0,0 +1,246 @@
+#include "BlockStore.hh"
+
+#include "HashTree.hh"
+#include "FileShareManager.hh"
+
+#include <QDebug>
+#include <QSet>
+#include <unistd.h>
+#include <errno.h>
+
+BlockStore::BlockStore() {
+    blockLocations = new QHash<QByteArray, BlockLocation>();
+    metaBlocks = new QHash<QByteArray, MetaBlock>();
+    files = new QVector<SharedFile>();
+    openFileIds = new QList<int>();
+}
+
+/* Registers a shared file and each of its blocks, and returns the id used to refer to the file.
+   Blocks we already have from another file keep their first location.
+*/
+int BlockStore::addFile(QString filePath, qint64 fileSize, bool contentDefined, QByteArray blockListMeta) {
+
+    SharedFile sharedFile;
+    sharedFile.file = new QFile(filePath);
+    sharedFile.size = fileSize;
+    sharedFile.contentDefined = contentDefined;
+    sharedFile.blockListMeta = blockListMeta;
+
+    files->append(sharedFile);
+    int fileId = files->size() - 1;
+
+    QList<QByteArray> blockHashes;
+    QList<BlockLocation> locations = getFileBlocks(fileId, &blockHashes);
+    for (int i = 0; i < locations.size(); i++) {
+
+        QHash<QByteArray, BlockLocation>::iterator it = blockLocations->find(blockHashes.at(i));
+        if (it != blockLocations->end()) {
+            it.value().refCount++;
+        } else {
+            blockLocations->insert(blockHashes.at(i), locations.at(i));
+        }
+    }
+
+    return fileId;
+}
+
+/* Stores a metafile or hash tree node of the given file */
+void BlockStore::addMetaBlock(int fileId, QByteArray blockHash, QByteArray data) {
+
+    QHash<QByteArray, MetaBlock>::iterator it = metaBlocks->find(blockHash);
+    if (it != metaBlocks->end()) {
+        it.value().refCount++;
+    } else {
+        MetaBlock metaBlock;
+        metaBlock.data = data;
+        metaBlock.refCount = 1;
+        metaBlocks->insert(blockHash, metaBlock);
+    }
+
+    (*files)[fileId].metaBlockHashes.append(blockHash);
+}
+
+/* Stops serving a file. Blocks that other files also hold are moved over to one of them. */
+QList<QByteArray> BlockStore::removeFile(int fileId) {
+
+    QList<QByteArray> droppedHashes;
+    SharedFile &sharedFile = (*files)[fileId];
+    if (sharedFile.file == NULL) return droppedHashes;
+
+    QList<QByteArray> blockHashes;
+    QList<BlockLocation> locations = getFileBlocks(fileId, &blockHashes);
+    QSet<QByteArray> blocksToMove;
+    for (int i = 0; i < locations.size(); i++) {
+
+        QHash<QByteArray, BlockLocation>::iterator it = blockLocations->find(blockHashes.at(i));
+        if (it == blockLocations->end()) continue;
+
+        if (--it.value().refCount == 0) {
+            blockLocations->erase(it);
+            blocksToMove.remove(blockHashes.at(i));
+            droppedHashes.append(blockHashes.at(i));
+        } else if (it.value().fileId == fileId) {
+            blocksToMove.insert(blockHashes.at(i));
+        }
+    }
+
+    for (int i = 0; i < sharedFile.metaBlockHashes.size(); i++) {
+        QHash<QByteArray, MetaBlock>::iterator it = metaBlocks->find(sharedFile.metaBlockHashes.at(i));
+        if (it != metaBlocks->end() && --it.value().refCount == 0) {
+            metaBlocks->erase(it);
+            droppedHashes.append(sharedFile.metaBlockHashes.at(i));
+        }
+    }
+
+    delete sharedFile.file;
+    sharedFile.file = NULL;
+    openFileIds->removeOne(fileId);
+    sharedFile.blockListMeta.clear();
+    sharedFile.metaBlockHashes.clear();
+
+    // Point the blocks still held by other files at one of those files
+    for (int otherId = 0; otherId < files->size() && !blocksToMove.isEmpty(); otherId++) {
+
+        if (files->at(otherId).file == NULL) continue;
+
+        QList<QByteArray> otherHashes;
+        QList<BlockLocation> otherLocations = getFileBlocks(otherId, &otherHashes);
+        for (int i = 0; i < otherLocations.size(); i++) {
+
+            if (!blocksToMove.remove(otherHashes.at(i))) continue;
+            BlockLocation &location = (*blockLocations)[otherHashes.at(i)];
+            location.fileId = otherId;
+            location.offset = otherLocations.at(i).offset;
+            location.length = otherLocations.at(i).length;
+        }
+    }
+
+    return droppedHashes;
+}
+
+/* Locations (with a reference count of 1) and hashes of the blocks of a file, from its block list */
+QList<BlockStore::BlockLocation> BlockStore::getFileBlocks(int fileId, QList<QByteArray> *blockHashes) {
+
+    const SharedFile &sharedFile = files->at(fileId);
+    int entrySize = HashTree::getBlockEntrySize(sharedFile.contentDefined);
+    const QByteArray &blockListMeta = sharedFile.blockListMeta;
+
+    QList<BlockLocation> locations;
+    qint64 offset = 0;
+    for (int idx = 0; idx + entrySize <= blockListMeta.size(); idx += entrySize) {
+
+        BlockLocation location;
+        location.fileId = fileId;
+        location.offset = offset;
+        location.refCount = 1;
+        if (sharedFile.contentDefined) {
+            location.length = ((uchar) blockListMeta.at(idx + HASH_NUM_BYTES) << 8) |
+                    (uchar) blockListMeta.at(idx + HASH_NUM_BYTES + 1);
+        } else {
+            location.length = (int) qMin((qint64) BLOCK_SIZE, sharedFile.size - offset);
+        }
+        offset += location.length;
+
+        locations.append(location);
+        blockHashes->append(blockListMeta.mid(idx, HASH_NUM_BYTES));
+    }
+
+    return locations;
+}
+
+bool BlockStore::containsBlock(QByteArray blockHash) {
+
+    return blockLocations->contains(blockHash) || metaBlocks->contains(blockHash);
+}
+
+/* Length of a block we hold, without reading it .. -1 if we don't have it */
+int BlockStore::getBlockLength(QByteArray blockHash) {
+
+    QHash<QByteArray, BlockLocation>::const_iterator it = blockLocations->constFind(blockHash);
+    if (it != blockLocations->constEnd()) return it.value().length;
+
+    QHash<QByteArray, MetaBlock>::const_iterator metaIt = metaBlocks->constFind(blockHash);
+    if (metaIt != metaBlocks->constEnd()) return metaIt.value().data.size();
+    return -1;
+}
+
+int BlockStore::getNumberOfBlocks() {
+
+    return blockLocations->size() + metaBlocks->size();
+}
+
+/* Returns the content of the block with the given hash, or an empty array if we don't have it
+   (or the file no longer holds it).
+*/
+QByteArray BlockStore::fetchBlock(QByteArray blockHash) {
+
+    QHash<QByteArray, BlockLocation>::const_iterator it = blockLocations->constFind(blockHash);
+    if (it != blockLocations->constEnd()) {
+        BlockLocation location = it.value();
+        return readFileRange(location.fileId, location.offset, location.length);
+    }
+
+    return metaBlocks->value(blockHash).data;
+}
+
+/* Where a file block is on disk, for reading it in the background. The descriptor may be closed
+   by the next call, so it must be duplicated right away (as AsyncBlockIO does).
+   Returns false for metafile blocks and blocks we don't have.
+*/
+bool BlockStore::getBlockFile(QByteArray blockHash, int *fd, qint64 *offset, int *length) {
+
+    QHash<QByteArray, BlockLocation>::const_iterator it = blockLocations->constFind(blockHash);
+    if (it == blockLocations->constEnd() || !openFile(it.value().fileId)) return false;
+
+    *fd = files->at(it.value().fileId).file->handle();
+    *offset = it.value().offset;
+    *length = it.value().length;
+    return true;
+}
+
+/* Reads length bytes at offset in the given file, or returns an empty array if the file
+   is shorter than that
+*/
+QByteArray BlockStore::readFileRange(int fileId, qint64 offset, int length) {
+
+    if (length <= 0 || offset + length > files->at(fileId).size || !openFile(fileId)) return QByteArray();
+
+    int fd = files->at(fileId).file->handle();
+    QByteArray data(length, 0);
+    int done = 0;
+    while (done < length) {
+        ssize_t result = pread(fd, data.data() + done, length - done, offset + done);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) break;
+        done += result;
+    }
+
+    if (done < length) {
+        qDebug() << "Shared file" << files->at(fileId).file->fileName() << "is shorter than when it was shared";
+        return QByteArray();
+    }
+    return data;
+}
+
+/* Opens a shared file for reading, closing the least recently read one if too many are open */
+bool BlockStore::openFile(int fileId) {
+
+    QFile *file = files->at(fileId).file;
+    if (file == NULL) return false;
+
+    if (file->isOpen()) {
+        openFileIds->removeOne(fileId);
+        openFileIds->append(fileId);
+        return true;
+    }
+
+    if (openFileIds->size() >= BLOCK_STORE_MAX_OPEN_FILES) {
+        files->at(openFileIds->takeFirst()).file->close();
+    }
+    if (!file->open(QIODevice::ReadOnly)) {
+        qDebug() << "Cannot open shared file" << file->fileName();
+        return false;
+    }
+    openFileIds->append(fileId);
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef BLOCKSTORE_HH
+#define BLOCKSTORE_HH
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include <QFile>
+
+#define BLOCK_STORE_MAX_OPEN_FILES (64)     // shared files kept open at once, least recently read closed first
+
+/* Index of the blocks we serve, keyed by their SHA-256 hash.
+ * File blocks are not kept in memory: only the (file, offset, length) of each block
+ * is stored and the block is read from the file when it is needed,
+ * so the memory used grows with the number of blocks rather than with the shared data.
+ * Only the most recently read files are kept open, so sharing many files doesn't run out of descriptors.
+ * Metafile blocks (lists of block hashes) are small and kept in memory.
+ * A block found in several files (or twice in one) is stored once and reference counted,
+ * so that it is only dropped when the last file holding it is removed.
+ */
+
+class BlockStore
+{
+
+public:
+    BlockStore();
+
+    int addFile(QString filePath, qint64 fileSize, bool contentDefined, QByteArray blockListMeta);
+    void addMetaBlock(int fileId, QByteArray blockHash, QByteArray data);
+    QList<QByteArray> removeFile(int fileId);
+    bool containsBlock(QByteArray blockHash);
+    int getBlockLength(QByteArray blockHash);
+    QByteArray fetchBlock(QByteArray blockHash);
+    bool getBlockFile(QByteArray blockHash, int *fd, qint64 *offset, int *length);
+    QByteArray readFileRange(int fileId, qint64 offset, int length);
+    int getNumberOfBlocks();
+
+private:
+    struct BlockLocation {
+        int fileId;
+        qint64 offset;
+        int length;
+        int refCount;       // number of file blocks with this hash
+    };
+
+    struct MetaBlock {
+        QByteArray data;
+        int refCount;
+    };
+
+    struct SharedFile {
+        QFile *file;        // NULL once removed
+        qint64 size;
+        bool contentDefined;
+        QByteArray blockListMeta;
+        QList<QByteArray> metaBlockHashes;
+    };
+
+    QHash<QByteArray, BlockLocation> *blockLocations;   // < block hash, location of the block in a shared file >
+    QHash<QByteArray, MetaBlock> *metaBlocks;           // < metafile hash, metafile >
+    QVector<SharedFile> *files;                         // shared files indexed by file id
+    QList<int> *openFileIds;                            // ids of the open files, least recently read first
+
+    QList<BlockLocation> getFileBlocks(int fileId, QList<QByteArray> *blockHashes);
+    bool openFile(int fileId);
+};
+
+#endif // BLOCKSTORE_HH
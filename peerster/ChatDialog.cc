@@ -155,9 +155,11 @@ ChatDialog::ChatDialog(NetSocket *socket)
     connect(addPeerTextLine, SIGNAL(returnPressed()),
             this, SLOT(addNewPeer()));
 
-    // Register callback on originsListChanged to update origins available
-    connect(netSocket->router, SIGNAL(originsListChanged(QList<QString>)),
-            this, SLOT(updateOriginsList(QList<QString>)));
+    // Register callbacks on router to update origins available as routes come and go
+    connect(netSocket->router, SIGNAL(originAdded(QString)),
+            this, SLOT(addOrigin(QString)));
+    connect(netSocket->router, SIGNAL(originRemoved(QString)),
+            this, SLOT(removeOrigin(QString)));
 
     // Register onClick listener for QPushButton to start sharing local files
     connect(shareLocalFile, SIGNAL(clicked()),
@@ -176,8 +178,8 @@ ChatDialog::ChatDialog(NetSocket *socket)
             this,SLOT(startPrivateMessageSession(QListWidgetItem*)));
 
     // Catches signal from netsocket to display received search result files
-    connect(netSocket, SIGNAL(receivedSearchResults(QStringList)),
-            this, SLOT(displaySearchResults(QStringList)));
+    connect(netSocket, SIGNAL(receivedSearchResults(QMap<QByteArray,QString>,QString)),
+            this, SLOT(displaySearchResults(QMap<QByteArray,QString>,QString)));
 
     // Register onDoubleClick listener on searched files list items for starting file download
     connect(searchedFilesList, SIGNAL(itemDoubleClicked(QListWidgetItem*)),
@@ -248,14 +250,21 @@ void QPrivateTextEdit::keyPressEvent(QKeyEvent *e) {
     }
 }
 
-void ChatDialog::updateOriginsList(QList<QString> origins) {
+void ChatDialog::addOrigin(QString origin) {
 
-    //qDebug() << "Updating origins list";
+    //qDebug() << "Adding origin" << origin;
 
-    originsList->clear();
-    QStringList *originsStringList = new QStringList(origins);
-    originsList->addItems(*originsStringList);
+    originsList->addItem(origin);
+}
+
+void ChatDialog::removeOrigin(QString origin) {
+
+    //qDebug() << "Removing origin" << origin;
 
+    QList<QListWidgetItem *> items = originsList->findItems(origin, Qt::MatchExactly);
+    for (int i = 0; i < items.size(); i++) {
+        delete items.at(i);
+    }
 }
 
 void ChatDialog::startPrivateMessageSession(QListWidgetItem* selectedItem) {
@@ -318,16 +327,36 @@ void ChatDialog::startSearchingForFile() {
     searchKeywordsLine->clear();
 }
 
-void ChatDialog::displaySearchResults(QStringList searchResultFiles) {
-
-    searchedFilesList->clear();
-    searchedFilesList->addItems(searchResultFiles);
+/* Adds newly found files .. results of every search started are listed together, each file once.
+   Items keep the file hash (and an origin that has it), as different files may have the same name.
+*/
+void ChatDialog::displaySearchResults(QMap<QByteArray, QString> searchResultFiles, QString origin) {
+
+    QMap<QByteArray, QString>::const_iterator it;
+    for (it = searchResultFiles.constBegin(); it != searchResultFiles.constEnd(); ++it) {
+
+        bool listed = false;
+        bool sameName = false;
+        for (int i = 0; i < searchedFilesList->count() && !listed; i++) {
+            listed = searchedFilesList->item(i)->data(SEARCH_RESULT_HASH_ROLE).toByteArray() == it.key();
+            sameName = sameName || searchedFilesList->item(i)->data(SEARCH_RESULT_NAME_ROLE).toString() == it.value();
+        }
+        if (listed) continue;
+
+        // Tell files with the same name apart by the start of their hash
+        QString text = sameName ? it.value() + " [" + it.key().toHex().left(8) + "]" : it.value();
+        QListWidgetItem *item = new QListWidgetItem(text, searchedFilesList);
+        item->setData(SEARCH_RESULT_HASH_ROLE, it.key());
+        item->setData(SEARCH_RESULT_NAME_ROLE, it.value());
+        item->setData(SEARCH_RESULT_ORIGIN_ROLE, origin);
+    }
 }
 
 void ChatDialog::startSearchedFileDownload(QListWidgetItem *selectedItem) {
 
-    QString selectedFile = selectedItem->text();
-    netSocket->startFileDownload(selectedFile);
+    netSocket->startFileDownload(selectedItem->data(SEARCH_RESULT_NAME_ROLE).toString(),
+                                 selectedItem->data(SEARCH_RESULT_HASH_ROLE).toByteArray(),
+                                 selectedItem->data(SEARCH_RESULT_ORIGIN_ROLE).toString());
 }
 
 void ChatDialog::selectImage1() {
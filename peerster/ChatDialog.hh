@@ -10,6 +10,10 @@
 #include <QFileDialog>
 #include "NetSocket.hh"
 
+#define SEARCH_RESULT_HASH_ROLE (Qt::UserRole)          // item data of a search result
+#define SEARCH_RESULT_NAME_ROLE (Qt::UserRole + 1)
+#define SEARCH_RESULT_ORIGIN_ROLE (Qt::UserRole + 2)
+
 
 /* Custom QTextEdit that emits a signal when return is pressed */
 class QTextEditSingleLine : public QTextEdit {
@@ -56,13 +60,14 @@ public slots:
 	void gotReturnPressed();
 	void displayReceivedMessage(QString message);
 	void addNewPeer();
-    void updateOriginsList(QList<QString> origins);
+    void addOrigin(QString origin);
+    void removeOrigin(QString origin);
     void startPrivateMessageSession(QListWidgetItem* selectedItem);
     void sendPrivateMessage(QString destination, QString message);
     void startSharingFiles();
     void startDownloadingFile();
     void startSearchingForFile();
-    void displaySearchResults(QStringList searchResultFiles);
+    void displaySearchResults(QMap<QByteArray, QString> searchResultFiles, QString origin);
     void startSearchedFileDownload(QListWidgetItem* selectedItem);
     void selectImage1();
     void selectImage2();
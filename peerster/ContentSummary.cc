@@ -0,0 +1,160 @@
+#include "ContentSummary.hh"
+#include "SearchIndex.hh"
+
+ContentSummary::ContentSummary() {
+    localNgrams = new QSet<quint64>();
+    localFilter = new QByteArray(SUMMARY_MIN_FILTER_BITS / 8, 0);
+    neighborSummaries = new QHash<Peer *, QByteArray>();
+    version = 0;
+}
+
+/* Adds the trigrams of a newly shared file name to our level 0 .. doubling its size
+   once it holds more trigrams than it was sized for
+*/
+void ContentSummary::addFileName(QString fileName) {
+
+    QList<quint64> ngrams = SearchIndex::getNgrams(fileName.toCaseFolded());
+    QList<quint64> newNgrams;
+    for (int i = 0; i < ngrams.size(); i++) {
+        if (localNgrams->contains(ngrams.at(i))) continue;
+        localNgrams->insert(ngrams.at(i));
+        newNgrams.append(ngrams.at(i));
+    }
+    if (newNgrams.isEmpty()) return;
+
+    int filterBits = localFilter->size() * 8;
+    if ((qint64) localNgrams->size() * SUMMARY_BITS_PER_NGRAM > filterBits && filterBits < SUMMARY_MAX_FILTER_BITS) {
+        while ((qint64) localNgrams->size() * SUMMARY_BITS_PER_NGRAM > filterBits && filterBits < SUMMARY_MAX_FILTER_BITS) {
+            filterBits *= 2;
+        }
+        rebuildLocalFilter(filterBits);
+    } else {
+        for (int i = 0; i < newNgrams.size(); i++) {
+            setBits(localFilter->data(), filterBits, newNgrams.at(i));
+        }
+    }
+
+    version++;
+}
+
+void ContentSummary::rebuildLocalFilter(int filterBits) {
+
+    *localFilter = QByteArray(filterBits / 8, 0);
+    QSet<quint64>::const_iterator it;
+    for (it = localNgrams->constBegin(); it != localNgrams->constEnd(); ++it) {
+        setBits(localFilter->data(), filterBits, *it);
+    }
+}
+
+void ContentSummary::receivedSummary(Peer *neighbor, QByteArray summary) {
+
+    if (!isValidSummary(summary) || neighborSummaries->value(neighbor) == summary) return;
+
+    neighborSummaries->insert(neighbor, summary);
+    version++;
+}
+
+/* SUMMARY_DEPTH levels of the same power of two size, within the allowed range */
+bool ContentSummary::isValidSummary(QByteArray summary) {
+
+    if (summary.size() % SUMMARY_DEPTH != 0) return false;
+    int filterBits = summary.size() / SUMMARY_DEPTH * 8;
+    return filterBits >= SUMMARY_MIN_FILTER_BITS && filterBits <= SUMMARY_MAX_FILTER_BITS &&
+            (filterBits & (filterBits - 1)) == 0;
+}
+
+/* Our attenuated filter as seen from the given neighbor .. what we heard from it is left out.
+   Its levels are as big as the biggest filter merged into them.
+*/
+QByteArray ContentSummary::getSummaryFor(Peer *neighbor) {
+
+    int levelSize = localFilter->size();
+    QHash<Peer *, QByteArray>::const_iterator it;
+    for (it = neighborSummaries->constBegin(); it != neighborSummaries->constEnd(); ++it) {
+        if (it.key() != neighbor) levelSize = qMax(levelSize, it.value().size() / SUMMARY_DEPTH);
+    }
+
+    QByteArray summary(SUMMARY_DEPTH * levelSize, 0);
+    char *levels = summary.data();
+    mergeLevel(levels, levelSize, localFilter->constData(), localFilter->size());
+
+    for (it = neighborSummaries->constBegin(); it != neighborSummaries->constEnd(); ++it) {
+
+        if (it.key() == neighbor) continue;
+
+        // Their level i is our level i + 1 .. their last level is too far away
+        int neighborLevelSize = it.value().size() / SUMMARY_DEPTH;
+        for (int level = 1; level < SUMMARY_DEPTH; level++) {
+            mergeLevel(levels + level * levelSize, levelSize,
+                       it.value().constData() + (level - 1) * neighborLevelSize, neighborLevelSize);
+        }
+    }
+
+    return summary;
+}
+
+/* ORs a filter level into one at least as big, repeating it to fill the bigger one */
+void ContentSummary::mergeLevel(char *level, int levelSize, const char *otherLevel, int otherLevelSize) {
+
+    for (int i = 0; i < levelSize; i++) {
+        level[i] |= otherLevel[i % otherLevelSize];
+    }
+}
+
+/* Lowest level of the neighbor's filter where some keyword may match, or -1 if none can */
+int ContentSummary::getMatchLevel(Peer *neighbor, QStringList foldedKeywords) {
+
+    QHash<Peer *, QByteArray>::const_iterator it = neighborSummaries->constFind(neighbor);
+    if (it == neighborSummaries->constEnd()) return -1;
+
+    int levelSize = it.value().size() / SUMMARY_DEPTH;
+    for (int level = 0; level < SUMMARY_DEPTH; level++) {
+        for (int i = 0; i < foldedKeywords.size(); i++) {
+            QList<quint64> ngrams = SearchIndex::getNgrams(foldedKeywords.at(i));
+            if (!ngrams.isEmpty() &&
+                    containsAll(it.value().constData() + level * levelSize, levelSize * 8, ngrams)) return level;
+        }
+    }
+    return -1;
+}
+
+quint32 ContentSummary::getVersion() {
+    return version;
+}
+
+bool ContentSummary::containsAll(const char *filter, int filterBits, const QList<quint64> &ngrams) {
+
+    for (int i = 0; i < ngrams.size(); i++) {
+        QList<int> positions = getBitPositions(ngrams.at(i), filterBits);
+        for (int j = 0; j < positions.size(); j++) {
+            if (!(filter[positions.at(j) / 8] & (1 << (positions.at(j) % 8)))) return false;
+        }
+    }
+    return true;
+}
+
+void ContentSummary::setBits(char *filter, int filterBits, quint64 ngram) {
+
+    QList<int> positions = getBitPositions(ngram, filterBits);
+    for (int i = 0; i < positions.size(); i++) {
+        filter[positions.at(i) / 8] |= 1 << (positions.at(i) % 8);
+    }
+}
+
+/* Bits set for a trigram: double hashing from the two halves of a 64-bit mix of it */
+QList<int> ContentSummary::getBitPositions(quint64 ngram, int filterBits) {
+
+    quint64 hash = ngram + 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    hash = hash ^ (hash >> 31);
+
+    quint32 hash1 = (quint32) hash;
+    quint32 hash2 = (quint32) (hash >> 32) | 1;
+
+    QList<int> positions;
+    for (int i = 0; i < SUMMARY_NUM_HASHES; i++) {
+        positions.append((int) ((hash1 + i * hash2) % filterBits));
+    }
+    return positions;
+}
@@ -0,0 +1,59 @@
+#ifndef CONTENTSUMMARY_HH
+#define CONTENTSUMMARY_HH
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QList>
+
+#include "Peer.hh"
+
+#define SUMMARY_DEPTH (3)                   // hops covered by a summary
+#define SUMMARY_MIN_FILTER_BITS (8192)      // per level
+#define SUMMARY_MAX_FILTER_BITS (131072)    // per level .. a whole summary (48 kB) still fits in one datagram
+#define SUMMARY_BITS_PER_NGRAM (10)         // filter bits per shared trigram, about 1% false positives
+#define SUMMARY_NUM_HASHES (4)
+#define SUMMARY_EXCHANGE_INTERVAL (10000)   // ms between checks for a changed summary to send
+#define SUMMARY_REFRESH_ROUNDS (6)          // summaries are sent every this many intervals even if unchanged
+
+/* Attenuated Bloom filters of the trigrams of shared file names, used to route searches.
+ * Level 0 of our filter holds the names we share. Each neighbor sends us its own filter,
+ * so level i of a neighbor's filter summarizes the files i hops behind that neighbor.
+ * The filter we send to a neighbor is our level 0 followed by the union of the other
+ * neighbors' levels, shifted down by one hop, leaving out what came from that neighbor.
+ * A keyword may only match a file name that has all of its trigrams, so a search is worth
+ * sending to a neighbor whose filter has every trigram of a keyword at some level.
+ * Filters are sized from the number of distinct trigrams shared, as a power of two number
+ * of bits: a bit position is the hash modulo the size, so a smaller filter repeated until
+ * it fills a bigger one answers the same, and filters of different sizes can be merged.
+ */
+
+class ContentSummary
+{
+
+public:
+    ContentSummary();
+
+    void addFileName(QString fileName);
+    void receivedSummary(Peer *neighbor, QByteArray summary);
+    QByteArray getSummaryFor(Peer *neighbor);
+    int getMatchLevel(Peer *neighbor, QStringList foldedKeywords);
+    quint32 getVersion();
+    static bool isValidSummary(QByteArray summary);
+
+private:
+    QSet<quint64> *localNgrams;                     // trigrams of the names we share
+    QByteArray *localFilter;                        // level 0: the names we share
+    QHash<Peer *, QByteArray> *neighborSummaries;   // < neighbor, attenuated filter it sent us >
+    quint32 version;                                // bumped whenever a filter we send may change
+
+    void rebuildLocalFilter(int filterBits);
+    static void setBits(char *filter, int filterBits, quint64 ngram);
+    static void mergeLevel(char *level, int levelSize, const char *otherLevel, int otherLevelSize);
+    static QList<int> getBitPositions(quint64 ngram, int filterBits);
+    static bool containsAll(const char *filter, int filterBits, const QList<quint64> &ngrams);
+};
+
+#endif // CONTENTSUMMARY_HH
@@ -0,0 +1,472 @@
+#include "Dht.hh"
+
+#include "FileHasher.hh"
+
+#include <QDebug>
+#include <QDateTime>
+#include <QSet>
+#include <QRegExp>
+
+Dht::Dht(QString origin, QList<Peer *> *neighbors) {
+
+    this->origin = origin;
+    this->neighbors = neighbors;
+    ownId = FileHasher::sha256(origin.toUtf8());
+    routingTable = new DhtRoutingTable(ownId);
+    pendingRpcs = new QHash<quint32, PendingRpc>();
+    nextRpcId = qrand();
+    lookups = new QMap<int, LookupJob>();
+    queuedLookups = new QQueue<int>();
+    nextLookupId = 0;
+    activeLookups = 0;
+    queuedPublishLookups = 0;
+    startingLookups = false;
+    storage = new QHash<QByteArray, QMap<QString, StoredRecord> >();
+    numStoredRecords = 0;
+    publishedFiles = new QMap<QByteArray, QString>();
+
+    tickTimer = new QTimer(this);
+    connect(tickTimer, SIGNAL(timeout()), this, SLOT(tick()));
+    tickTimer->start(DHT_TICK_INTERVAL);
+
+    QTimer *refreshTimer = new QTimer(this);
+    connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+    refreshTimer->start(DHT_REFRESH_INTERVAL);
+
+    QTimer *republishTimer = new QTimer(this);
+    connect(republishTimer, SIGNAL(timeout()), this, SLOT(republish()));
+    republishTimer->start(DHT_REPUBLISH_INTERVAL);
+
+    // Join as soon as the neighbors given on the command line are resolved
+    QTimer::singleShot(DHT_RPC_TIMEOUT, this, SLOT(refresh()));
+}
+
+/* Case folded words of at least DHT_MIN_KEYWORD_LENGTH letters or digits, each once */
+QStringList Dht::getKeywords(QString text) {
+
+    QStringList words = text.toCaseFolded().split(QRegExp("[^\\w]|_"), QString::SkipEmptyParts);
+    QStringList keywords;
+    for (int i = 0; i < words.size(); i++) {
+        if (words.at(i).size() >= DHT_MIN_KEYWORD_LENGTH && !keywords.contains(words.at(i))) {
+            keywords.append(words.at(i));
+        }
+    }
+    return keywords;
+}
+
+QByteArray Dht::getKeywordKey(QString keyword) {
+
+    return FileHasher::sha256(QByteArray(DHT_KEYWORD_PREFIX) + keyword.toUtf8());
+}
+
+/* Node ids are derived from the origin, so that nobody can choose where in the id space to sit */
+bool Dht::isValidNodeId(QByteArray nodeId, QString origin) {
+
+    return nodeId.size() == DHT_ID_BYTES && !origin.isEmpty() && nodeId == FileHasher::sha256(origin.toUtf8());
+}
+
+/* A holder publishes a file once under each key */
+QString Dht::getRecordId(QVariantMap record) {
+
+    return record.value("Holder").toString() + "/" + QString::fromLatin1(record.value("Hash").toByteArray().toHex());
+}
+
+/* Publishes our copy of a file under each keyword of its name and under its hash */
+void Dht::publishFile(QString fileName, QByteArray fileHash) {
+
+    publishedFiles->insert(fileHash, fileName);
+
+    QVariantMap keywordRecord;
+    keywordRecord.insert("Name", fileName);
+    keywordRecord.insert("Hash", fileHash);
+    keywordRecord.insert("Holder", origin);
+
+    QStringList keywords = getKeywords(fileName);
+    for (int i = 0; i < keywords.size(); i++) {
+        startLookup(PublishLookup, getKeywordKey(keywords.at(i)), 0, keywordRecord);
+    }
+
+    QVariantMap holderRecord;
+    holderRecord.insert("Holder", origin);
+    startLookup(PublishLookup, fileHash, 0, holderRecord);
+}
+
+/* Looks up each keyword; every file found is reported with foundFiles */
+void Dht::findFiles(quint32 searchId, QString keywords) {
+
+    QStringList keywordsList = getKeywords(keywords);
+    for (int i = 0; i < keywordsList.size(); i++) {
+        startLookup(FilesLookup, getKeywordKey(keywordsList.at(i)), searchId, QVariantMap());
+    }
+}
+
+void Dht::findHolders(QByteArray fileHash) {
+
+    startLookup(HoldersLookup, fileHash, 0, QVariantMap());
+}
+
+void Dht::startLookup(LookupPurpose purpose, QByteArray target, quint32 searchId, QVariantMap record) {
+
+    LookupJob job;
+    job.purpose = purpose;
+    job.target = target;
+    job.lookup = NULL;
+    job.searchId = searchId;
+    job.record = record;
+    lookups->insert(nextLookupId, job);
+    queuedLookups->enqueue(nextLookupId++);
+    if (purpose == PublishLookup) queuedPublishLookups++;
+
+    startQueuedLookups();
+}
+
+void Dht::startQueuedLookups() {
+
+    if (startingLookups) return;
+    startingLookups = true;
+
+    while (activeLookups < DHT_MAX_ACTIVE_LOOKUPS && !queuedLookups->isEmpty()) {
+
+        int lookupId = queuedLookups->dequeue();
+        LookupJob &job = (*lookups)[lookupId];
+        if (job.purpose == PublishLookup) queuedPublishLookups--;
+
+        bool findValue = job.purpose == FilesLookup || job.purpose == HoldersLookup;
+        job.lookup = new DhtLookup(job.target, findValue,
+                                   routingTable->findClosest(job.target, DHT_BUCKET_SIZE));
+        activeLookups++;
+        pumpLookup(lookupId);
+    }
+
+    startingLookups = false;
+}
+
+/* Sends the next requests of a lookup, or finishes it */
+void Dht::pumpLookup(int lookupId) {
+
+    if (!lookups->contains(lookupId)) return;
+    DhtLookup *lookup = lookups->value(lookupId).lookup;
+
+    QString type = lookups->value(lookupId).purpose == FilesLookup ||
+            lookups->value(lookupId).purpose == HoldersLookup ? "FindValue" : "FindNode";
+
+    QList<DhtContact> contacts = lookup->takeContactsToQuery();
+    for (int i = 0; i < contacts.size(); i++) {
+        sendRequest(type, lookup->getTarget(), lookupId, contacts.at(i).nodeId,
+                    contacts.at(i).address, contacts.at(i).port, QVariantMap());
+    }
+
+    if (lookup->isFinished()) finishLookup(lookupId);
+}
+
+void Dht::finishLookup(int lookupId) {
+
+    LookupJob job = lookups->take(lookupId);
+    activeLookups--;
+
+    if (job.purpose == PublishLookup) {
+
+        QList<DhtContact> closest = job.lookup->getClosestContacts();
+        for (int i = 0; i < closest.size(); i++) {
+            sendRequest("Store", job.target, -1, closest.at(i).nodeId,
+                        closest.at(i).address, closest.at(i).port, job.record);
+        }
+        // Keep a copy ourselves when we are among the closest nodes, or alone
+        if (isCloseTo(job.target, DHT_BUCKET_SIZE, closest)) storeRecord(job.target, job.record);
+
+    } else if (job.purpose == FilesLookup || job.purpose == HoldersLookup) {
+
+        QVariantList records = job.lookup->getRecords() + getStoredRecords(job.target);
+
+        QSet<QString> seen;
+        QVariantList files;
+        QStringList holders;
+        for (int i = 0; i < records.size(); i++) {
+
+            QVariantMap record = records.at(i).toMap();
+            QString holder = record.value("Holder").toString();
+            if (holder.isEmpty() || seen.contains(getRecordId(record))) continue;
+            seen.insert(getRecordId(record));
+
+            if (job.purpose == HoldersLookup) {
+                holders.append(holder);
+            } else if (!record.value("Name").toString().isEmpty() &&
+                       record.value("Hash").toByteArray().size() == DHT_ID_BYTES) {
+                files.append(record);
+            }
+        }
+
+        if (job.purpose == FilesLookup && !files.isEmpty()) emit foundFiles(job.searchId, files);
+        if (job.purpose == HoldersLookup && !holders.isEmpty()) emit foundHolders(job.target, holders);
+    }
+
+    delete job.lookup;
+    startQueuedLookups();
+}
+
+QVariantMap Dht::createMessage(QString type) {
+
+    QVariantMap message;
+    message.insert("Dht", type);
+    message.insert("DhtId", ownId);
+    message.insert("DhtOrigin", origin);
+    return message;
+}
+
+void Dht::sendRequest(QString type, QByteArray target, int lookupId, QByteArray nodeId,
+                      QHostAddress address, quint16 port, QVariantMap record) {
+
+    quint32 rpcId = nextRpcId++;
+    QVariantMap message = createMessage(type);
+    message.insert("Rpc", rpcId);
+    message.insert("Target", target);
+    if (!record.isEmpty()) message.insert("Record", record);
+
+    // Stores are not answered
+    if (type != "Store") {
+        PendingRpc rpc;
+        rpc.lookupId = lookupId;
+        rpc.nodeId = nodeId;
+        rpc.deadline = QDateTime::currentMSecsSinceEpoch() + DHT_RPC_TIMEOUT;
+        pendingRpcs->insert(rpcId, rpc);
+    }
+
+    emit sendMessage(message, address, port);
+}
+
+QVariantList Dht::encodeContacts(QList<DhtContact> contacts, QByteArray excludedId) {
+
+    QVariantList encoded;
+    for (int i = 0; i < contacts.size(); i++) {
+        if (contacts.at(i).nodeId == excludedId) continue;
+
+        QVariantMap contact;
+        contact.insert("Id", contacts.at(i).nodeId);
+        contact.insert("Origin", contacts.at(i).origin);
+        contact.insert("IP", contacts.at(i).address.toIPv4Address());
+        contact.insert("Port", contacts.at(i).port);
+        encoded.append(contact);
+    }
+    return encoded;
+}
+
+QList<DhtContact> Dht::decodeContacts(QVariantList contacts) {
+
+    QList<DhtContact> decoded;
+    for (int i = 0; i < contacts.size() && i < DHT_BUCKET_SIZE; i++) {
+
+        QVariantMap contactMap = contacts.at(i).toMap();
+        DhtContact contact;
+        contact.nodeId = contactMap.value("Id").toByteArray();
+        contact.origin = contactMap.value("Origin").toString();
+        contact.address = QHostAddress(contactMap.value("IP").toUInt());
+        contact.port = contactMap.value("Port").toUInt();
+        contact.failures = 0;
+
+        if (!isValidNodeId(contact.nodeId, contact.origin) || contact.nodeId == ownId ||
+                contact.port == 0 || contact.address.isNull()) continue;
+        decoded.append(contact);
+    }
+    return decoded;
+}
+
+void Dht::receivedMessage(QVariantMap message, QHostAddress address, quint16 port) {
+
+    QString type = message.value("Dht").toString();
+    QByteArray senderId = message.value("DhtId").toByteArray();
+    QByteArray target = message.value("Target").toByteArray();
+    quint32 rpcId = message.value("Rpc").toUInt();
+    QString senderOrigin = message.value("DhtOrigin").toString();
+    if (senderId == ownId || !isValidNodeId(senderId, senderOrigin)) return;
+
+    // Anyone talking to us is a contact
+    DhtContact sender;
+    sender.nodeId = senderId;
+    sender.origin = senderOrigin;
+    sender.address = address;
+    sender.port = port;
+    sender.failures = 0;
+    routingTable->addContact(sender);
+
+    if (type == "FindNode" || type == "FindValue") {
+
+        QVariantMap reply = createMessage("Reply");
+        reply.insert("Rpc", rpcId);
+        reply.insert("Target", target);
+        reply.insert("Nodes", encodeContacts(routingTable->findClosest(target, DHT_BUCKET_SIZE + 1), senderId));
+        if (type == "FindValue") {
+            QVariantList records = getStoredRecords(target);
+            if (!records.isEmpty()) reply.insert("Values", records.mid(0, DHT_MAX_RECORDS_PER_REPLY));
+        }
+        emit sendMessage(reply, address, port);
+
+    } else if (type == "Store") {
+
+        // Records belong on the nodes closest to their key .. our view may differ a bit from the sender's
+        QVariantMap record = message.value("Record").toMap();
+        if (!isValidRecord(target, record, senderOrigin)) return;
+        if (!isCloseTo(target, DHT_STORE_CLOSEST, routingTable->findClosest(target, DHT_STORE_CLOSEST))) return;
+        storeRecord(target, record);
+
+    } else if (type == "Reply") {
+
+        if (!pendingRpcs->contains(rpcId)) return;
+        PendingRpc rpc = pendingRpcs->take(rpcId);
+
+        QList<DhtContact> contacts = decodeContacts(message.value("Nodes").toList());
+        for (int i = 0; i < contacts.size(); i++) {
+            routingTable->addContact(contacts.at(i));
+        }
+
+        if (!lookups->contains(rpc.lookupId)) {
+            // Bootstrap reply: we now know of a few nodes, look for those close to us
+            if (rpc.lookupId == -1) startLookup(RefreshLookup, ownId, 0, QVariantMap());
+            return;
+        }
+
+        // A node restarted on the same address answers with a new id .. the one we asked is gone
+        DhtLookup *lookup = lookups->value(rpc.lookupId).lookup;
+        if (senderId != rpc.nodeId) {
+            routingTable->contactFailed(rpc.nodeId);
+            lookup->queryFailed(rpc.nodeId);
+        } else {
+            lookup->receivedReply(rpc.nodeId, contacts, message.value("Values").toList());
+        }
+        pumpLookup(rpc.lookupId);
+    }
+}
+
+/* Nodes only publish themselves as holders, and a file only under the keywords of its name.
+   Otherwise anyone could point downloads at a third party or fill keywords with unrelated files.
+*/
+bool Dht::isValidRecord(QByteArray key, QVariantMap record, QString senderOrigin) {
+
+    if (key.size() != DHT_ID_BYTES || record.value("Holder").toString() != senderOrigin) return false;
+    if (!record.contains("Name")) return true;
+
+    QStringList keywords = getKeywords(record.value("Name").toString());
+    for (int i = 0; i < keywords.size(); i++) {
+        if (getKeywordKey(keywords.at(i)) == key) return true;
+    }
+    return false;
+}
+
+/* True if we are closer to the key than the last of closest, the count nodes closest to it
+   that we know of .. or if we know fewer than count nodes
+*/
+bool Dht::isCloseTo(QByteArray key, int count, QList<DhtContact> closest) {
+
+    return closest.size() < count ||
+            DhtRoutingTable::distance(ownId, key).toHex() < DhtRoutingTable::distance(closest.last().nodeId, key).toHex();
+}
+
+void Dht::storeRecord(QByteArray key, QVariantMap record) {
+
+    QHash<QByteArray, QMap<QString, StoredRecord> >::iterator keyIt = storage->find(key);
+    QString recordId = getRecordId(record);
+    bool newRecord = keyIt == storage->end() || !keyIt.value().contains(recordId);
+    if (newRecord) {
+        if (numStoredRecords >= DHT_MAX_RECORDS) return;
+        if (keyIt != storage->end() && keyIt.value().size() >= DHT_MAX_RECORDS_PER_KEY) return;
+        if (keyIt == storage->end()) keyIt = storage->insert(key, QMap<QString, StoredRecord>());
+        numStoredRecords++;
+    }
+
+    StoredRecord storedRecord;
+    storedRecord.record = record;
+    storedRecord.expiry = QDateTime::currentMSecsSinceEpoch() + DHT_RECORD_TTL;
+    keyIt.value().insert(recordId, storedRecord);
+}
+
+QVariantList Dht::getStoredRecords(QByteArray key) {
+
+    QVariantList records;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMap<QString, StoredRecord> storedRecords = storage->value(key);
+    QMap<QString, StoredRecord>::const_iterator it;
+    for (it = storedRecords.constBegin(); it != storedRecords.constEnd(); ++it) {
+        if (it.value().expiry > now) records.append(it.value().record);
+    }
+    return records;
+}
+
+/* Gives up on requests that were not answered in time */
+void Dht::tick() {
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<int> lookupsToPump;
+
+    QHash<quint32, PendingRpc>::iterator it = pendingRpcs->begin();
+    while (it != pendingRpcs->end()) {
+        if (it.value().deadline > now) {
+            ++it;
+            continue;
+        }
+
+        if (!it.value().nodeId.isEmpty()) routingTable->contactFailed(it.value().nodeId);
+        if (lookups->contains(it.value().lookupId)) {
+            lookups->value(it.value().lookupId).lookup->queryFailed(it.value().nodeId);
+            lookupsToPump.append(it.value().lookupId);
+        }
+        it = pendingRpcs->erase(it);
+    }
+
+    for (int i = 0; i < lookupsToPump.size(); i++) {
+        pumpLookup(lookupsToPump.at(i));
+    }
+}
+
+/* Drops expired records and keeps the routing table filled, bootstrapping from our
+   neighbors while we know too few nodes
+*/
+void Dht::refresh() {
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QHash<QByteArray, QMap<QString, StoredRecord> >::iterator keyIt = storage->begin();
+    while (keyIt != storage->end()) {
+        QMap<QString, StoredRecord>::iterator it = keyIt.value().begin();
+        while (it != keyIt.value().end()) {
+            if (it.value().expiry <= now) {
+                it = keyIt.value().erase(it);
+                numStoredRecords--;
+            } else {
+                ++it;
+            }
+        }
+        if (keyIt.value().isEmpty()) keyIt = storage->erase(keyIt);
+        else ++keyIt;
+    }
+
+    if (routingTable->getNumberOfContacts() < DHT_BUCKET_SIZE) {
+        for (int i = 0; i < neighbors->size(); i++) {
+            Peer *neighbor = neighbors->at(i);
+            if (!neighbor->isEnabled()) continue;
+            sendRequest("FindNode", ownId, -1, QByteArray(), neighbor->getIpAddress(),
+                        neighbor->getPort(), QVariantMap());
+        }
+        return;
+    }
+
+    // Our own neighborhood, and a random part of the id space
+    QByteArray randomId;
+    for (int i = 0; i < DHT_ID_BYTES; i++) randomId.append((char) qrand());
+    startLookup(RefreshLookup, ownId, 0, QVariantMap());
+    startLookup(RefreshLookup, randomId, 0, QVariantMap());
+}
+
+/* Publishes our records again before they expire on the nodes storing them .. unless the
+   last round is still waiting for its turn, so that rounds don't pile up in the queue
+*/
+void Dht::republish() {
+
+    if (queuedPublishLookups > 0) {
+        qDebug() << "Skipping DHT republish," << queuedPublishLookups << "publications still queued";
+        return;
+    }
+
+    QMap<QByteArray, QString> files = *publishedFiles;
+    QMap<QByteArray, QString>::const_iterator it;
+    for (it = files.constBegin(); it != files.constEnd(); ++it) {
+        publishFile(it.value(), it.key());
+    }
+}
@@ -0,0 +1,133 @@
+#ifndef DHT_HH
+#define DHT_HH
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QQueue>
+#include <QVariantMap>
+#include <QVariantList>
+#include <QHostAddress>
+#include <QTimer>
+
+#include "Peer.hh"
+#include "DhtRoutingTable.hh"
+#include "DhtLookup.hh"
+
+#define DHT_TICK_INTERVAL (250)             // ms between checks for unanswered requests
+#define DHT_RPC_TIMEOUT (2000)              // ms
+#define DHT_REFRESH_INTERVAL (60000)        // ms between routing table refreshes
+#define DHT_RECORD_TTL (3600000)            // ms a stored record lives unless published again
+#define DHT_REPUBLISH_INTERVAL (1200000)    // ms between two publications of our records
+#define DHT_MAX_ACTIVE_LOOKUPS (16)         // more lookups wait for one of these to finish
+#define DHT_MAX_RECORDS_PER_KEY (256)
+#define DHT_MAX_RECORDS (65536)            // over all keys
+#define DHT_STORE_CLOSEST (2 * DHT_BUCKET_SIZE)    // stores are accepted when we are among this many nodes closest to the key
+#define DHT_MAX_RECORDS_PER_REPLY (32)      // keeps a reply within one datagram
+#define DHT_MIN_KEYWORD_LENGTH (3)
+#define DHT_KEYWORD_PREFIX "keyword:"
+
+/* Kademlia distributed hash table over the Peerster UDP socket.
+ * Nodes are identified by the SHA-256 of their origin identifier. Two kinds of records are
+ * published for every shared file, each on the DHT_BUCKET_SIZE nodes closest to its key:
+ *  - under the hash of each keyword of the file name: file name, file hash and holder
+ *  - under the file hash: holder
+ * and published again before they expire. A keyword search or a lookup of the holders of a
+ * file is then an iterative lookup of the key, instead of a flood.
+ * Messages carry "Dht" (the request type) and are answered straight to the address they came from.
+ * A node id must be the hash of the origin it comes with, so ids can't be picked next to a key,
+ * and records are only stored for keys we are close to.
+ */
+
+class Dht : public QObject
+{
+    Q_OBJECT
+
+public:
+    Dht(QString origin, QList<Peer *> *neighbors);
+
+    void receivedMessage(QVariantMap message, QHostAddress address, quint16 port);
+    void publishFile(QString fileName, QByteArray fileHash);
+    void findFiles(quint32 searchId, QString keywords);
+    void findHolders(QByteArray fileHash);
+
+    static QStringList getKeywords(QString text);
+
+private:
+    enum LookupPurpose {
+        RefreshLookup,                      // fills the routing table
+        PublishLookup,                      // stores a record on the nodes closest to its key
+        FilesLookup,                        // keyword search
+        HoldersLookup                       // sources of a file
+    };
+
+    struct LookupJob {
+        LookupPurpose purpose;
+        QByteArray target;
+        DhtLookup *lookup;                  // NULL while queued
+        quint32 searchId;
+        QVariantMap record;                 // to publish
+    };
+
+    struct PendingRpc {
+        int lookupId;                       // -1 for bootstrap requests
+        QByteArray nodeId;
+        qint64 deadline;
+    };
+
+    struct StoredRecord {
+        QVariantMap record;
+        qint64 expiry;
+    };
+
+    QString origin;
+    QByteArray ownId;
+    QList<Peer *> *neighbors;               // bootstrap contacts
+    DhtRoutingTable *routingTable;
+    QHash<quint32, PendingRpc> *pendingRpcs;    // < rpc id, request in flight >
+    quint32 nextRpcId;
+    QMap<int, LookupJob> *lookups;          // < lookup id, lookup running or queued >
+    QQueue<int> *queuedLookups;             // ids of the lookups waiting to start, oldest first
+    int nextLookupId;
+    int activeLookups;
+    int queuedPublishLookups;
+    bool startingLookups;                   // lookups that finish right away don't start the next ones recursively
+    QHash<QByteArray, QMap<QString, StoredRecord> > *storage;   // < key, < record id, record > >
+    int numStoredRecords;
+    QMap<QByteArray, QString> *publishedFiles;  // < file hash, file name > we publish
+    QTimer *tickTimer;
+
+    void startLookup(LookupPurpose purpose, QByteArray target, quint32 searchId, QVariantMap record);
+    void startQueuedLookups();
+    void pumpLookup(int lookupId);
+    void finishLookup(int lookupId);
+    void sendRequest(QString type, QByteArray target, int lookupId, QByteArray nodeId,
+                     QHostAddress address, quint16 port, QVariantMap record);
+    void storeRecord(QByteArray key, QVariantMap record);
+    bool isCloseTo(QByteArray key, int count, QList<DhtContact> closest);
+    QVariantList getStoredRecords(QByteArray key);
+    QVariantMap createMessage(QString type);
+    QVariantList encodeContacts(QList<DhtContact> contacts, QByteArray excludedId);
+    QList<DhtContact> decodeContacts(QVariantList contacts);
+
+    static QByteArray getKeywordKey(QString keyword);
+    static bool isValidNodeId(QByteArray nodeId, QString origin);
+    static bool isValidRecord(QByteArray key, QVariantMap record, QString senderOrigin);
+    static QString getRecordId(QVariantMap record);
+
+private slots:
+    void tick();
+    void refresh();
+    void republish();
+
+signals:
+    void sendMessage(QVariantMap message, QHostAddress address, quint16 port);
+    void foundFiles(quint32 searchId, QVariantList records);
+    void foundHolders(QByteArray fileHash, QStringList holders);
+};
+
+#endif // DHT_HH
@@ -0,0 +1,100 @@
+#include "DhtLookup.hh"
+
+DhtLookup::DhtLookup(QByteArray target, bool findValue, QList<DhtContact> seeds) {
+
+    this->target = target;
+    this->findValue = findValue;
+    inFlight = 0;
+
+    for (int i = 0; i < seeds.size(); i++) {
+        addContact(seeds.at(i));
+    }
+}
+
+QByteArray DhtLookup::getTarget() {
+    return target;
+}
+
+void DhtLookup::addContact(const DhtContact &contact) {
+
+    if (contact.nodeId.size() != DHT_ID_BYTES) return;
+    shortlist.insert(QString::fromLatin1(DhtRoutingTable::distance(contact.nodeId, target).toHex()), contact);
+}
+
+/* Closest contacts not asked yet, as many as the parallelism allows */
+QList<DhtContact> DhtLookup::takeContactsToQuery() {
+
+    QList<DhtContact> contactsToQuery;
+    if (isFinished()) return contactsToQuery;
+
+    // Only the closest DHT_BUCKET_SIZE contacts are worth asking .. those that failed were dropped
+    int checked = 0;
+    QMap<QString, DhtContact>::const_iterator it;
+    for (it = shortlist.constBegin(); it != shortlist.constEnd() && checked < DHT_BUCKET_SIZE; ++it, checked++) {
+
+        if (queried.contains(it.value().nodeId)) continue;
+        if (inFlight + contactsToQuery.size() >= DHT_LOOKUP_PARALLELISM) break;
+
+        queried.insert(it.value().nodeId);
+        contactsToQuery.append(it.value());
+    }
+
+    inFlight += contactsToQuery.size();
+    return contactsToQuery;
+}
+
+void DhtLookup::receivedReply(QByteArray nodeId, QList<DhtContact> closerContacts, QVariantList records) {
+
+    if (!queried.contains(nodeId) || answered.contains(nodeId)) return;
+    answered.insert(nodeId);
+    inFlight--;
+
+    for (int i = 0; i < closerContacts.size(); i++) {
+        addContact(closerContacts.at(i));
+    }
+    this->records.append(records);
+}
+
+void DhtLookup::queryFailed(QByteArray nodeId) {
+
+    if (!queried.contains(nodeId) || answered.contains(nodeId)) return;
+    inFlight--;
+
+    QMap<QString, DhtContact>::iterator it = shortlist.begin();
+    while (it != shortlist.end()) {
+        if (it.value().nodeId == nodeId) {
+            it = shortlist.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* Done when a value was found, or when the closest contacts have all answered */
+bool DhtLookup::isFinished() {
+
+    if (findValue && !records.isEmpty()) return true;
+    if (inFlight > 0) return false;
+
+    int checked = 0;
+    QMap<QString, DhtContact>::const_iterator it;
+    for (it = shortlist.constBegin(); it != shortlist.constEnd() && checked < DHT_BUCKET_SIZE; ++it, checked++) {
+        if (!answered.contains(it.value().nodeId)) return false;
+    }
+    return true;
+}
+
+/* The closest contacts that answered .. where records for the target are stored */
+QList<DhtContact> DhtLookup::getClosestContacts() {
+
+    QList<DhtContact> closest;
+    QMap<QString, DhtContact>::const_iterator it;
+    for (it = shortlist.constBegin(); it != shortlist.constEnd() && closest.size() < DHT_BUCKET_SIZE; ++it) {
+        if (answered.contains(it.value().nodeId)) closest.append(it.value());
+    }
+    return closest;
+}
+
+QVariantList DhtLookup::getRecords() {
+    return records;
+}
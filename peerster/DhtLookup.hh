@@ -0,0 +1,47 @@
+#ifndef DHTLOOKUP_HH
+#define DHTLOOKUP_HH
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QSet>
+#include <QVariantList>
+
+#include "DhtRoutingTable.hh"
+
+#define DHT_LOOKUP_PARALLELISM (3)          // alpha: requests in flight per lookup
+
+/* One iterative Kademlia lookup: the closest contacts known so far are asked, DHT_LOOKUP_PARALLELISM
+ * at a time, for contacts even closer to the target (and for the records stored under it when
+ * looking for a value). The lookup is over once the DHT_BUCKET_SIZE closest contacts heard of
+ * have all answered or failed, or as soon as records are found when looking for a value.
+ * Each round gets at least one bit closer to the target, so this takes O(log N) requests.
+ */
+
+class DhtLookup
+{
+
+public:
+    DhtLookup(QByteArray target, bool findValue, QList<DhtContact> seeds);
+
+    QByteArray getTarget();
+    QList<DhtContact> takeContactsToQuery();
+    void receivedReply(QByteArray nodeId, QList<DhtContact> closerContacts, QVariantList records);
+    void queryFailed(QByteArray nodeId);
+    bool isFinished();
+    QList<DhtContact> getClosestContacts();
+    QVariantList getRecords();
+
+private:
+    QByteArray target;
+    bool findValue;
+    QMap<QString, DhtContact> shortlist;    // < distance to the target (hex), contact >
+    QSet<QByteArray> queried;               // node ids asked already
+    QSet<QByteArray> answered;
+    int inFlight;
+    QVariantList records;
+
+    void addContact(const DhtContact &contact);
+};
+
+#endif // DHTLOOKUP_HH
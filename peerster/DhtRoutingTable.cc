@@ -0,0 +1,101 @@
+#include "DhtRoutingTable.hh"
+
+#include <QMap>
+
+DhtRoutingTable::DhtRoutingTable(QByteArray ownId) {
+    this->ownId = ownId;
+    buckets = new QVector<QList<DhtContact> >(DHT_ID_BYTES * 8);
+}
+
+/* Called for every node we hear from */
+void DhtRoutingTable::addContact(DhtContact contact) {
+
+    if (contact.nodeId.size() != DHT_ID_BYTES || contact.nodeId == ownId) return;
+
+    QList<DhtContact> &bucket = (*buckets)[getBucketIndex(contact.nodeId)];
+    for (int i = 0; i < bucket.size(); i++) {
+        if (bucket.at(i).nodeId == contact.nodeId) {
+            bucket.removeAt(i);                 // moves to the tail, with its new address
+            break;
+        }
+    }
+
+    if (bucket.size() >= DHT_BUCKET_SIZE) {
+
+        // Replace the least recently seen contact that stopped answering, if any
+        int failedIdx = -1;
+        for (int i = 0; i < bucket.size() && failedIdx < 0; i++) {
+            if (bucket.at(i).failures >= DHT_MAX_FAILURES) failedIdx = i;
+        }
+        if (failedIdx < 0) return;
+        bucket.removeAt(failedIdx);
+    }
+
+    contact.failures = 0;
+    bucket.append(contact);
+}
+
+void DhtRoutingTable::contactFailed(QByteArray nodeId) {
+
+    if (nodeId.size() != DHT_ID_BYTES || nodeId == ownId) return;
+
+    QList<DhtContact> &bucket = (*buckets)[getBucketIndex(nodeId)];
+    for (int i = 0; i < bucket.size(); i++) {
+        if (bucket.at(i).nodeId == nodeId) bucket[i].failures++;
+    }
+}
+
+/* The count known contacts closest to target, closest first .. contacts that stopped answering last */
+QList<DhtContact> DhtRoutingTable::findClosest(QByteArray target, int count) {
+
+    // Hex of a fixed length distance sorts like the distance itself
+    QMap<QString, DhtContact> byDistance;
+    QMap<QString, DhtContact> failedByDistance;
+    for (int b = 0; b < buckets->size(); b++) {
+        const QList<DhtContact> &bucket = buckets->at(b);
+        for (int i = 0; i < bucket.size(); i++) {
+            QString key = QString::fromLatin1(distance(bucket.at(i).nodeId, target).toHex());
+            if (bucket.at(i).failures >= DHT_MAX_FAILURES) {
+                failedByDistance.insert(key, bucket.at(i));
+            } else {
+                byDistance.insert(key, bucket.at(i));
+            }
+        }
+    }
+
+    QList<DhtContact> closest = byDistance.values() + failedByDistance.values();
+    return closest.mid(0, count);
+}
+
+int DhtRoutingTable::getNumberOfContacts() {
+
+    int numContacts = 0;
+    for (int b = 0; b < buckets->size(); b++) {
+        numContacts += buckets->at(b).size();
+    }
+    return numContacts;
+}
+
+QByteArray DhtRoutingTable::distance(const QByteArray &a, const QByteArray &b) {
+
+    QByteArray result(DHT_ID_BYTES, 0);
+    for (int i = 0; i < DHT_ID_BYTES && i < a.size() && i < b.size(); i++) {
+        result[i] = a.at(i) ^ b.at(i);
+    }
+    return result;
+}
+
+int DhtRoutingTable::getBucketIndex(const QByteArray &nodeId) {
+
+    QByteArray d = distance(ownId, nodeId);
+    for (int i = 0; i < DHT_ID_BYTES; i++) {
+
+        uchar byte = (uchar) d.at(i);
+        if (byte == 0) continue;
+
+        int bit = 7;
+        while (!(byte & (1 << bit))) bit--;
+        return (DHT_ID_BYTES - 1 - i) * 8 + bit;
+    }
+    return 0;
+}
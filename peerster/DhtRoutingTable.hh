@@ -0,0 +1,48 @@
+#ifndef DHTROUTINGTABLE_HH
+#define DHTROUTINGTABLE_HH
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QHostAddress>
+
+#define DHT_ID_BYTES (32)                   // node ids and keys are SHA-256 hashes
+#define DHT_BUCKET_SIZE (8)                 // k: contacts per bucket, and replicas of a record
+#define DHT_MAX_FAILURES (2)                // unanswered requests in a row before a contact can be replaced
+
+struct DhtContact {
+    QByteArray nodeId;
+    QString origin;                         // the node's Peerster identifier
+    QHostAddress address;
+    quint16 port;
+    int failures;
+};
+
+/* Kademlia routing table: contacts are kept in one bucket per bit of XOR distance to our
+ * own node id, each bucket holding up to DHT_BUCKET_SIZE contacts, most recently seen last.
+ * A full bucket keeps its old contacts (long lived nodes tend to stay) and only makes room
+ * for a new one once an old contact has stopped answering.
+ */
+
+class DhtRoutingTable
+{
+
+public:
+    DhtRoutingTable(QByteArray ownId);
+
+    void addContact(DhtContact contact);
+    void contactFailed(QByteArray nodeId);
+    QList<DhtContact> findClosest(QByteArray target, int count);
+    int getNumberOfContacts();
+
+    static QByteArray distance(const QByteArray &a, const QByteArray &b);
+
+private:
+    QByteArray ownId;
+    QVector<QList<DhtContact> > *buckets;   // bucket i: contacts whose distance has its highest bit at i
+
+    int getBucketIndex(const QByteArray &nodeId);
+};
+
+#endif // DHTROUTINGTABLE_HH
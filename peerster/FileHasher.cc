@@ -0,0 +1,196 @@
+#include "FileHasher.hh"
+#include "FileShareManager.hh"
+#include "HashTree.hh"
+#include "ShareIndex.hh"
+
+#include <QDebug>
+#include <QFile>
+#include <QList>
+#include <QFuture>
+#include <QThreadStorage>
+#include <QtConcurrentMap>
+#include <QtCrypto>
+
+FileHasher::FileHasher(QStringList files, bool contentDefined) {
+    this->files = files;
+    this->contentDefined = contentDefined;
+
+    // Deleted from the GUI thread once finished() has been delivered
+    setAutoDelete(false);
+}
+
+void FileHasher::run() {
+
+    for (int i = 0; i < files.size(); i++) {
+        hashFile(files.at(i));
+    }
+
+    emit finished();
+}
+
+/* Random values for the gear hash, the same on every node so that everyone cuts the same blocks */
+struct GearTable {
+    quint64 values[256];
+
+    GearTable() {
+        quint64 state = 0x5045455253544552ULL;      // splitmix64 with a fixed seed
+        for (int i = 0; i < 256; i++) {
+            quint64 z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+static const GearTable gearTable;
+
+// Stricter mask below the normal block size, looser one above it (normalized chunking)
+#define CDC_MASK_SMALL (0xFFFC000000000000ULL)     // 14 bits
+#define CDC_MASK_LARGE (0xFFC0000000000000ULL)     // 10 bits
+
+/* Length of the next content-defined block at the start of data */
+int FileHasher::findBlockBoundary(const uchar *data, int length) {
+
+    if (length <= CDC_MIN_BLOCK_SIZE) return length;
+
+    int normalSize = qMin(length, CDC_NORMAL_BLOCK_SIZE);
+    int maxSize = qMin(length, CDC_MAX_BLOCK_SIZE);
+    quint64 hash = 0;
+
+    // The hash only depends on the last 64 bytes, so there is no need to hash the minimum block
+    int i = CDC_MIN_BLOCK_SIZE - 64;
+    for (; i < CDC_MIN_BLOCK_SIZE; i++) {
+        hash = (hash << 1) + gearTable.values[data[i]];
+    }
+    for (; i < normalSize; i++) {
+        hash = (hash << 1) + gearTable.values[data[i]];
+        if (!(hash & CDC_MASK_SMALL)) return i + 1;
+    }
+    for (; i < maxSize; i++) {
+        hash = (hash << 1) + gearTable.values[data[i]];
+        if (!(hash & CDC_MASK_LARGE)) return i + 1;
+    }
+    return maxSize;
+}
+
+/* Splits a chunk of file data into views of its blocks. Fixed size blocks are BLOCK_SIZE bytes
+   (last one may be shorter). For content-defined blocks the data after the last boundary found
+   is left for the next chunk, unless this is the last one. consumed is set to the bytes split.
+*/
+QList<QByteArray> FileHasher::splitIntoBlocks(const QByteArray &chunk, bool lastChunk, int *consumed) {
+
+    QList<QByteArray> blocks;
+    const uchar *data = (const uchar *) chunk.constData();
+    int offset = 0;
+    while (offset < chunk.size()) {
+
+        int remaining = chunk.size() - offset;
+        if (contentDefined && !lastChunk && remaining < CDC_MAX_BLOCK_SIZE) break;
+
+        int len = contentDefined ? findBlockBoundary(data + offset, remaining) : qMin(BLOCK_SIZE, remaining);
+        blocks.append(QByteArray::fromRawData(chunk.constData() + offset, len));
+        offset += len;
+    }
+
+    *consumed = offset;
+    return blocks;
+}
+
+/* Reads the file sequentially and hashes each block. While the blocks of one chunk are
+   being hashed by the thread pool, the next chunk is read from disk.
+   The block list has a hash per block, followed by the block length for content-defined blocks.
+*/
+void FileHasher::hashFile(QString filePath) {
+
+    // Taken before reading, so that the share index can tell if the file changed while it was hashed
+    qint64 fileSize, modifiedTime;
+    quint64 inode;
+    if (!ShareIndex::statFile(filePath, &fileSize, &modifiedTime, &inode)) {
+        qDebug() << "Cannot stat file to share" << filePath;
+        return;
+    }
+
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "Cannot open file to share" << filePath;
+        return;
+    }
+    int entrySize = HashTree::getBlockEntrySize(contentDefined);
+
+    QByteArray blockListMeta;
+    blockListMeta.reserve(((fileSize + CDC_MIN_BLOCK_SIZE - 1) / CDC_MIN_BLOCK_SIZE) * entrySize);
+
+    // Two chunk buffers: one being hashed, one being filled
+    QByteArray chunks[2];
+    QFuture<QByteArray> pendingHashes;
+    QList<int> pendingLengths;
+    bool hashesPending = false;
+    int current = 0;
+    QByteArray leftover;        // data after the last content-defined boundary
+
+    qint64 bytesRead = 0;
+    while (bytesRead < fileSize) {
+
+        QByteArray data = file.read(HASH_READ_CHUNK_SIZE);
+        if (data.isEmpty()) {
+            qDebug() << "Error reading file to share" << filePath;
+            if (hashesPending) pendingHashes.waitForFinished();
+            return;
+        }
+        bytesRead += data.size();
+        chunks[current] = leftover.isEmpty() ? data : leftover + data;
+
+        // Collect the hashes of the previous chunk before handing out the next one, to keep them in order
+        if (hashesPending) {
+            pendingHashes.waitForFinished();
+            appendBlockEntries(&blockListMeta, pendingHashes.results(), pendingLengths);
+        }
+
+        int consumed;
+        QList<QByteArray> blocks = splitIntoBlocks(chunks[current], bytesRead >= fileSize, &consumed);
+        leftover = chunks[current].mid(consumed);
+
+        pendingLengths.clear();
+        for (int i = 0; i < blocks.size(); i++) {
+            pendingLengths.append(blocks.at(i).size());
+        }
+
+        pendingHashes = QtConcurrent::mapped(blocks, FileHasher::sha256);
+        hashesPending = true;
+        current = 1 - current;
+    }
+
+    if (hashesPending) {
+        pendingHashes.waitForFinished();
+        appendBlockEntries(&blockListMeta, pendingHashes.results(), pendingLengths);
+    }
+
+    // Big files are identified by the root of their hash tree rather than the flat block list
+    QByteArray fileHash = sha256(HashTree::buildMetaFile(blockListMeta, fileSize, contentDefined, NULL));
+    emit fileHashed(filePath, fileSize, modifiedTime, inode, contentDefined, blockListMeta, fileHash);
+}
+
+void FileHasher::appendBlockEntries(QByteArray *blockListMeta, QList<QByteArray> hashes, QList<int> lengths) {
+
+    for (int i = 0; i < hashes.size(); i++) {
+        blockListMeta->append(hashes.at(i));
+        if (contentDefined) {
+            blockListMeta->append((char) (lengths.at(i) >> 8));
+            blockListMeta->append((char) (lengths.at(i) & 0xff));
+        }
+    }
+}
+
+/* SHA-256 of the given data, reusing one QCA hash context per thread.
+   QCA picks its highest priority provider (qca-ossl when installed), whose OpenSSL
+   backend selects SHA-NI or AVX2 code at runtime when the CPU supports them.
+*/
+QByteArray FileHasher::sha256(const QByteArray &data) {
+
+    static QThreadStorage<QCA::Hash *> threadHashers;
+    if (!threadHashers.hasLocalData()) {
+        threadHashers.setLocalData(new QCA::Hash("sha256"));
+    }
+
+    return threadHashers.localData()->hash(data).toByteArray();
+}
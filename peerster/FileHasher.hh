@@ -0,0 +1,49 @@
+#ifndef FILEHASHER_HH
+#define FILEHASHER_HH
+
+#include <QObject>
+#include <QRunnable>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+
+#define HASH_READ_CHUNK_SIZE (4 * 1024 * 1024) // 4 MB, a multiple of BLOCK_SIZE
+#define CDC_MIN_BLOCK_SIZE (2048)           // content-defined blocks are between these sizes
+#define CDC_NORMAL_BLOCK_SIZE (4096)        // .. and usually close to this one
+#define CDC_MAX_BLOCK_SIZE (BLOCK_SIZE)
+
+/* Background job that splits files into blocks and hashes them off the GUI thread.
+ * Files are read one at a time in large sequential chunks; the blocks of each chunk are
+ * hashed in parallel on the global thread pool while the next chunk is being read.
+ * Results are reported per file (in block order) through the fileHashed signal.
+ * Blocks are either fixed size, or content-defined: cut where a rolling (gear) hash of the
+ * last bytes matches a mask, as in FastCDC, so that identical data at different offsets in
+ * different files (or in another version of the same file) gives identical blocks.
+ */
+
+class FileHasher : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    FileHasher(QStringList files, bool contentDefined);
+    void run();
+
+    static QByteArray sha256(const QByteArray &data);
+
+private:
+    QStringList files;
+    bool contentDefined;
+
+    void hashFile(QString filePath);
+    QList<QByteArray> splitIntoBlocks(const QByteArray &chunk, bool lastChunk, int *consumed);
+    void appendBlockEntries(QByteArray *blockListMeta, QList<QByteArray> hashes, QList<int> lengths);
+    static int findBlockBoundary(const uchar *data, int length);
+
+signals:
+    void fileHashed(QString filePath, qint64 fileSize, qint64 modifiedTime, quint64 inode, bool contentDefined,
+                    QByteArray blockListMeta, QByteArray fileHash);
+    void finished();
+};
+
+#endif // FILEHASHER_HH
@@ -1,204 +1,793 @@
 #include "FileShareManager.hh"
+#include "FileHasher.hh"
+#include "HashTree.hh"
 
 #include <math.h>
 #include <QFile>
 #include <QDebug>
-#include <QtCrypto>
+#include <QThreadPool>
 #include <QByteArray>
 #include <QList>
 #include <QDir>
+#include <QDateTime>
 
-FileShareManager::FileShareManager() {
+FileShareManager::FileShareManager(QString stateDir, bool contentDefinedChunking) {
+    this->contentDefinedChunking = contentDefinedChunking;
     sharedFilesMap = new QMap<QString, SharedFile*>();
-    sharedFilesHash = new QHash<QByteArray, FileBlock *>();
-    fileRequestsSent = new QMap<QByteArray, QString>();
+    searchIndex = new SearchIndex();
+    contentSummary = new ContentSummary();
+    sharedFilesHash = new BlockStore();
+    sharedFileIds = new QHash<QString, int>();
+    servedBlocks = new BlockCache(BLOCK_CACHE_SIZE);
+    relayedBlocks = NULL;
+    blockIO = new AsyncBlockIO();
+    blockReads = new QHash<quint64, QByteArray>();
+    localBlockReads = new QHash<quint64, QPair<OngoingDownload *, QByteArray> >();
+    blocksBeingRead = new QSet<QByteArray>();
+    downloadWrites = new QHash<quint64, OngoingDownload *>();
+    downloadVerifications = new QHash<quint64, OngoingDownload *>();
+    lastVerifyId = 0;
+    downloadsToRequest = new QList<OngoingDownload *>();
+    connect(blockIO, SIGNAL(readFinished(quint64,QByteArray)), this, SLOT(blockReadFinished(quint64,QByteArray)));
+    connect(blockIO, SIGNAL(writeFinished(quint64,bool)), this, SLOT(downloadWriteFinished(quint64,bool)));
+    compressedBlocks = new QCache<QByteArray, QByteArray>(COMPRESSED_BLOCK_CACHE_SIZE);
+    shareIndex = new ShareIndex(stateDir + "/" + SHARE_INDEX_FILE_NAME);
+    fileRequestsSent = new QHash<QByteArray, FileRequest>();
     ongoingDownloadList = new QList<OngoingDownload *>();
-    searchResultFiles = new QMap<QString, QPair<QString, QByteArray> >();
+    expectedBlocks = new QMultiHash<QByteArray, OngoingDownload *>();
+    downloadedBlocks = new QHash<QByteArray, OngoingDownload *>();
+    fileSources = new QHash<QByteArray, QStringList>();
+
+    searches = new QMap<quint32, SearchQuery *>();
+    lastSearchId = 0;
+
+    downloadStats.timeouts = 0;
+    downloadStats.retries = 0;
+    downloadStats.stalls = 0;
+
+    // Start serving whatever we shared before the last shutdown
+    restoreSharedFiles();
 }
 
 void FileShareManager::shareFiles(QStringList files) {
     qDebug() << "Started file sharing for" << files.size() << "files";
 
-    // Divide each file into blocks and compute SHA-256 of each block
+    // Files that haven't changed since they were last hashed are shared straight from the index
+    QStringList filesToHash;
     for (int i = 0; i < files.size(); i++) {
-        splitFileAndHash(files.at(i));
+
+        qint64 fileSize;
+        QByteArray blockListMeta, fileHash;
+        if (shareIndex->lookup(files.at(i), contentDefinedChunking, &fileSize, &blockListMeta, &fileHash)) {
+            addSharedFile(files.at(i), fileSize, contentDefinedChunking, blockListMeta, fileHash);
+        } else {
+            filesToHash.append(files.at(i));
+        }
     }
+
+    if (filesToHash.isEmpty()) return;
+
+    // Divide each file into blocks and compute SHA-256 of each block .. in the background
+    FileHasher *hasher = new FileHasher(filesToHash, contentDefinedChunking);
+    connect(hasher, SIGNAL(fileHashed(QString,qint64,qint64,quint64,bool,QByteArray,QByteArray)),
+            this, SLOT(fileHashed(QString,qint64,qint64,quint64,bool,QByteArray,QByteArray)));
+    connect(hasher, SIGNAL(finished()),
+            this, SLOT(saveShareIndex()));
+    connect(hasher, SIGNAL(finished()),
+            hasher, SLOT(deleteLater()));
+    QThreadPool::globalInstance()->start(hasher);
 }
 
-/* Splits a given file into blocks and computes SHA-256 hash of each block
-   Stores the necessary information in internal data structures
-*/
-void FileShareManager::splitFileAndHash(QString fileName) {
+/* Shares again every file in the share index .. only files that changed on disk are re-hashed */
+void FileShareManager::restoreSharedFiles() {
+
+    QStringList indexedFiles = shareIndex->getIndexedFiles();
+    QStringList existingFiles;
+    bool indexChanged = false;
+
+    for (int i = 0; i < indexedFiles.size(); i++) {
+
+        if (QFile::exists(indexedFiles.at(i))) {
+            existingFiles.append(indexedFiles.at(i));
+        } else {
+            // Shared file is gone .. forget about it
+            shareIndex->remove(indexedFiles.at(i));
+            indexChanged = true;
+        }
+    }
+
+    if (indexChanged) shareIndex->save();
 
-    QFile file(fileName);
-    file.open(QIODevice::ReadOnly);
-    QDataStream fileStream(&file);
+    if (!existingFiles.isEmpty()) {
+        shareFiles(existingFiles);
+    }
+}
 
-    int fileSize = file.size();
-    int numBlocks = ceil((double) fileSize/BLOCK_SIZE);
+/* Called on the GUI thread once the background hasher is done with a file */
+void FileShareManager::fileHashed(QString filePath, qint64 fileSize, qint64 modifiedTime, quint64 inode,
+                                  bool contentDefined, QByteArray blockListMeta, QByteArray fileHash) {
 
-    QByteArray blockListMeta;
+    shareIndex->update(filePath, fileSize, modifiedTime, inode, contentDefined, blockListMeta, fileHash);
+    addSharedFile(filePath, fileSize, contentDefined, blockListMeta, fileHash);
+}
 
-    for (int i = 0; i < numBlocks; i++) {
-        // Read in next block
-        char *buffer = new char[BLOCK_SIZE];
-        uint len = BLOCK_SIZE;
-        int numBytesRead = fileStream.readRawData(buffer, len);
-        QByteArray data = QByteArray::fromRawData(buffer, numBytesRead);
+void FileShareManager::saveShareIndex() {
 
-        // Hash the block and append it to the block list meta file
-        //QByteArray hash = QCA::Hash("sha256").hash(buffer).toByteArray();
-        QByteArray hash = QCA::Hash("sha256").hash(data).toByteArray();
-        blockListMeta.append(hash);
+    shareIndex->save();
+}
 
-        // Update Shared files hash (for each block)
-        FileBlock *fileBlock = new FileBlock(fileName, TYPE_FILE_CHUNK, data);
-        sharedFilesHash->insert(hash, fileBlock);
+/* Stores the block hashes of a split and hashed file in internal data structures
+   Only the location of each block is kept; the data is read from the file when requested
+*/
+void FileShareManager::addSharedFile(QString filePath, qint64 fileSize, bool contentDefined,
+                                     QByteArray blockListMeta, QByteArray fileHash) {
+
+    // A file shared again (e.g. after it changed) replaces its old blocks
+    if (sharedFileIds->contains(filePath)) {
+        QList<QByteArray> droppedHashes = sharedFilesHash->removeFile(sharedFileIds->take(filePath));
+        for (int i = 0; i < droppedHashes.size(); i++) {
+            servedBlocks->remove(droppedHashes.at(i));
+            compressedBlocks->remove(droppedHashes.at(i));
+        }
     }
 
+    // Update Shared files hash (for each block) .. blocks already shared by another file are kept once
+    int fileId = sharedFilesHash->addFile(filePath, fileSize, contentDefined, blockListMeta);
+    sharedFileIds->insert(filePath, fileId);
+    int numBlocks = blockListMeta.size() / HashTree::getBlockEntrySize(contentDefined);
+
     // Update Shared files map
-    QByteArray fileHash = QCA::Hash("sha256").hash(blockListMeta).toByteArray();
-    SharedFile *sharedFile = new SharedFile(fileName, fileSize, fileHash);
+    SharedFile *sharedFile = new SharedFile(filePath, fileSize, fileHash);
     // First strip out filename from the path!
-    QString strippedFileName = fileName.split("/").last();
+    QString strippedFileName = filePath.split("/").last();
     sharedFilesMap->insert(strippedFileName, sharedFile);
+    searchIndex->addFile(strippedFileName);
+    contentSummary->addFileName(strippedFileName);
 
-    // Update Shared files hash (for the file)
-    FileBlock *metaBlock = new FileBlock(fileName, TYPE_FILE_HASH, blockListMeta);
-    sharedFilesHash->insert(fileHash, metaBlock);
+    // Update Shared files hash (for the file) .. and the interior nodes of a big file's hash tree
+    QHash<QByteArray, QByteArray> interiorNodes;
+    QByteArray metaFile = HashTree::buildMetaFile(blockListMeta, fileSize, contentDefined, &interiorNodes);
+    sharedFilesHash->addMetaBlock(fileId, fileHash, metaFile);
+
+    QHash<QByteArray, QByteArray>::const_iterator it;
+    for (it = interiorNodes.constBegin(); it != interiorNodes.constEnd(); ++it) {
+        sharedFilesHash->addMetaBlock(fileId, it.key(), it.value());
+    }
 
     qDebug() << "Shared file size =" << fileSize << ", numBlocks =" << numBlocks
-                << ", metafile size =" << blockListMeta.size();
+                << ", distinct blocks shared =" << sharedFilesHash->getNumberOfBlocks()
+                << ", metafile size =" << metaFile.size() << ", tree nodes =" << interiorNodes.size();
     qDebug() << "Shared file hash =" << fileHash.toHex();
 
-    file.close();
+    emit fileShared(strippedFileName, fileHash);
 }
 
+/* Blocks served recently are answered from memory, others are read from the shared file (and cached) */
 QByteArray FileShareManager::fetchBlockData(QByteArray requestedBlockHash) {
 
-    FileBlock *requestedBlock = sharedFilesHash->value(requestedBlockHash);
-    QByteArray data = NULL;
-    if (requestedBlock != NULL) {
-        data = requestedBlock->getFileBlockContent();
+    QByteArray data = servedBlocks->lookup(requestedBlockHash);
+    if (data.isEmpty()) {
+        data = sharedFilesHash->fetchBlock(requestedBlockHash);
+        if (data.isEmpty()) data = fetchDownloadedBlock(requestedBlockHash);
+        servedBlocks->insert(requestedBlockHash, data);
+    }
+
+    reportBlockCacheStats();
+    return data;
+}
+
+/* Like fetchBlockData, except that blocks on disk (shared files, partial downloads) that aren't cached
+   are read in the background: *pending is then set and the data comes with blockDataRead.
+   Concurrent reads of a block are one read.
+*/
+QByteArray FileShareManager::fetchBlockDataAsync(QByteArray requestedBlockHash, bool *pending) {
+
+    *pending = blocksBeingRead->contains(requestedBlockHash);
+    if (*pending) return QByteArray();
+
+    QByteArray data = servedBlocks->lookup(requestedBlockHash);
+    reportBlockCacheStats();
+    if (!data.isEmpty()) return data;
+
+    // So are blocks a download already wrote to its partial file
+    int fd, length;
+    qint64 offset;
+    OngoingDownload *download = downloadedBlocks->value(requestedBlockHash);
+    if (sharedFilesHash->getBlockFile(requestedBlockHash, &fd, &offset, &length) ||
+            (download != NULL && download->getBlockFile(requestedBlockHash, &fd, &offset, &length))) {
+        blockReads->insert(blockIO->read(fd, offset, length), requestedBlockHash);
+        blocksBeingRead->insert(requestedBlockHash);
+        *pending = true;
+        return QByteArray();
+    }
+
+    // Metafiles, tree nodes and blocks still buffered by downloads are in memory
+    data = sharedFilesHash->fetchBlock(requestedBlockHash);
+    if (data.isEmpty()) data = fetchDownloadedBlock(requestedBlockHash);
+    servedBlocks->insert(requestedBlockHash, data);
+    return data;
+}
+
+void FileShareManager::blockReadFinished(quint64 readId, QByteArray data) {
+
+    if (localBlockReads->contains(readId)) {
+        QPair<OngoingDownload *, QByteArray> localRead = localBlockReads->take(readId);
+        localBlockRead(localRead.first, localRead.second, data);
+        return;
+    }
+
+    QByteArray blockHash = blockReads->take(readId);
+    blocksBeingRead->remove(blockHash);
+    if (!data.isEmpty()) servedBlocks->insert(blockHash, data);
+
+    emit blockDataRead(blockHash, data);
+}
+
+void FileShareManager::reportBlockCacheStats() {
+
+    BlockCache::Stats stats = servedBlocks->getStats();
+    if ((stats.hits + stats.misses) % BLOCK_CACHE_REPORT_INTERVAL == 0) {
+        qDebug() << "Block cache: hits =" << stats.hits << ", misses =" << stats.misses
+                 << ", evictions =" << stats.evictions << ", cached blocks =" << stats.blocks
+                 << ", cached bytes =" << stats.bytes;
+    }
+}
+
+/* Size of a block we serve, as far as we can tell without reading it .. -1 if we don't have it */
+int FileShareManager::getBlockLength(QByteArray blockHash) {
+
+    int length = sharedFilesHash->getBlockLength(blockHash);
+    if (length >= 0) return length;
+
+    OngoingDownload *download = downloadedBlocks->value(blockHash);
+    return download != NULL ? download->getBlockLength(blockHash) : -1;
+}
+
+BlockCache::Stats FileShareManager::getBlockCacheStats() {
+    return servedBlocks->getStats();
+}
+
+/* Turns this node into a cache for the blocks it forwards: popular files fetched by several
+   nodes behind us then cross the links beyond us once
+*/
+void FileShareManager::enableRelayCache(qint64 maxBytes) {
+
+    if (relayedBlocks == NULL) relayedBlocks = new BlockCache(maxBytes);
+}
+
+/* Blocks must have been checked against their hash .. they are served to others as is */
+void FileShareManager::cacheRelayedBlock(QByteArray blockHash, QByteArray data) {
+
+    if (relayedBlocks == NULL || data.isEmpty()) return;
+    relayedBlocks->insert(blockHash, data);
+}
+
+/* Returns a relayed block we still hold, or an empty array */
+QByteArray FileShareManager::fetchRelayedBlock(QByteArray blockHash) {
+
+    if (relayedBlocks == NULL) return QByteArray();
+
+    QByteArray data = relayedBlocks->lookup(blockHash);
+
+    BlockCache::Stats stats = relayedBlocks->getStats();
+    if ((stats.hits + stats.misses) % BLOCK_CACHE_REPORT_INTERVAL == 0) {
+        qDebug() << "Relay cache: hits =" << stats.hits << ", misses =" << stats.misses
+                 << ", evictions =" << stats.evictions << ", cached blocks =" << stats.blocks
+                 << ", cached bytes =" << stats.bytes;
     }
+
     return data;
 }
 
-void FileShareManager::newDownloadFileRequest(QByteArray fileHash, QString fileName) {
+/* Returns the block compressed, or an empty array if compressing it doesn't save any bytes.
+   Popular blocks are only compressed once: results (including incompressible ones) are cached.
+*/
+QByteArray FileShareManager::fetchCompressedBlockData(QByteArray requestedBlockHash, QByteArray data) {
+
+    QByteArray *cachedData = compressedBlocks->object(requestedBlockHash);
+    if (cachedData != NULL) return *cachedData;
+    if (data.isEmpty()) return QByteArray();
+
+    QByteArray compressedData = qCompress(data, BLOCK_COMPRESSION_LEVEL);
+    if (compressedData.size() >= data.size()) compressedData.clear();
+
+    compressedBlocks->insert(requestedBlockHash, new QByteArray(compressedData),
+                             compressedData.size() + requestedBlockHash.size() + COMPRESSED_BLOCK_ENTRY_OVERHEAD);
+    return compressedData;
+}
+
+/* Returns false if the file is already being downloaded .. destination is then used as one more source */
+bool FileShareManager::newDownloadFileRequest(QByteArray fileHash, QString fileName, QString destination) {
+
+    if (findOngoingDownload(fileHash, QString()) != NULL) {
+        qDebug() << "Already downloading" << fileHash.toHex();
+        addFileSource(fileHash, destination);
+        return false;
+    }
 
-    fileRequestsSent->insert(fileHash, fileName);
+    FileRequest request;
+    request.fileName = fileName;
+    request.destination = destination;
+    request.deadline = QDateTime::currentMSecsSinceEpoch() + FILE_REQUEST_TIMEOUT;
+    request.attempts = 0;
+    fileRequestsSent->insert(fileHash, request);
+    addFileSource(fileHash, destination);
+    return true;
 }
 
-bool FileShareManager::isMetaFile(QVariantMap message) {
+/* Records that origin holds the file .. ongoing downloads of the file start using it right away */
+void FileShareManager::addFileSource(QByteArray fileHash, QString origin) {
+
+    QStringList &sources = (*fileSources)[fileHash];
+    if (sources.contains(origin)) return;
+    sources.append(origin);
+
+    for (int i = 0; i < ongoingDownloadList->size(); i++) {
+        if (ongoingDownloadList->at(i)->getFileHash() == fileHash) {
+            ongoingDownloadList->at(i)->addSource(origin);
+        }
+    }
+}
+
+/* Handles a block reply addressed to us: either the metafile of a file we asked for or a
+   block of an ongoing download. Returns (source, block hash) of the block requests to send next.
+*/
+QList<QPair<QString, QByteArray> > FileShareManager::receivedBlockReply(QVariantMap message) {
 
     QByteArray messageHash = message.value("BlockReply").toByteArray();
-    QString fileName = fileRequestsSent->value(messageHash);
 
     // If no matching hash found in fileRequestsSent, message contains file data block
-    if (fileName.isEmpty()) return false;
-    else return true;
+    if (fileRequestsSent->contains(messageHash)) return createOngoingDownload(message);
+    return receivedFileDataBlock(message);
+}
+
+/* A source refused a block request for lack of upload capacity: the downloads waiting for the block
+   leave it alone for the delay it asked for. Returns (source, block hash) of the requests to send instead.
+*/
+QList<QPair<QString, QByteArray> > FileShareManager::receivedBlockBusy(QVariantMap message) {
+
+    QByteArray blockHash = message.value("BlockBusy").toByteArray();
+    QList<OngoingDownload *> downloads = expectedBlocks->values(blockHash);
+
+    QList<QPair<QString, QByteArray> > blocksToRequest;
+    for (int i = 0; i < downloads.size(); i++) {
+        downloads.at(i)->retryLater(blockHash, message.value("Origin").toString(), message.value("RetryAfter").toUInt());
+        blocksToRequest.append(downloads.at(i)->takeBlocksToRequest());
+    }
+    return blocksToRequest;
+}
+
+/* Blocks of files still being downloaded are served too, so that content spreads before
+   anyone has the whole file
+*/
+QByteArray FileShareManager::fetchDownloadedBlock(QByteArray blockHash) {
+
+    OngoingDownload *download = downloadedBlocks->value(blockHash);
+    return download != NULL ? download->readBlock(blockHash) : QByteArray();
+}
+
+/* Indexes a block or tree node a download accepted, so requests for it are served without a scan */
+void FileShareManager::addDownloadedBlock(OngoingDownload *download, QByteArray blockHash) {
+
+    if (download->hasBlock(blockHash) && !downloadedBlocks->contains(blockHash)) {
+        downloadedBlocks->insert(blockHash, download);
+    }
+}
+
+/* Shares a completed download .. its block hashes are known already, so it is not hashed again */
+void FileShareManager::shareCompletedDownload(OngoingDownload *download) {
+
+    QByteArray blockListMeta = download->getBlockListMeta();
+    QByteArray metaFile = HashTree::buildMetaFile(blockListMeta, download->getFileSize(),
+                                                  download->isContentDefined(), NULL);
+    if (FileHasher::sha256(metaFile) != download->getFileHash()) {
+        qDebug() << "Not sharing" << download->getFilePath() << ".. its metafile doesn't match the file hash";
+        return;
+    }
+
+    // The blocks were verified as they were written .. the file as it is now is what they describe
+    qint64 fileSize, modifiedTime;
+    quint64 inode;
+    if (ShareIndex::statFile(download->getFilePath(), &fileSize, &modifiedTime, &inode) &&
+            fileSize == download->getFileSize()) {
+        shareIndex->update(download->getFilePath(), fileSize, modifiedTime, inode, download->isContentDefined(),
+                           blockListMeta, download->getFileHash());
+        shareIndex->save();
+    }
+    addSharedFile(download->getFilePath(), download->getFileSize(), download->isContentDefined(),
+                  blockListMeta, download->getFileHash());
+}
+
+/* Starts tracking a download .. its missing blocks are indexed so that replies are matched in constant time */
+void FileShareManager::addOngoingDownload(OngoingDownload *download) {
+
+    ongoingDownloadList->append(download);
+    download->setBlockIO(blockIO);
+    addDownloadedBlock(download, download->getFileHash());
+    expectBlocks(download, download->getPendingBlockHashes());
 }
 
-QByteArray FileShareManager::createOngoingDownload(QVariantMap message) {
+/* Indexes blocks a download still needs .. blocks we already share (e.g. part of another
+   version of the file) are copied locally instead of being requested from the network.
+   Those in shared files are read in the background and handed over by localBlockRead.
+*/
+void FileShareManager::expectBlocks(OngoingDownload *download, QList<QByteArray> blockHashes) {
+
+    for (int i = 0; i < blockHashes.size(); i++) {
+
+        QByteArray blockHash = blockHashes.at(i);
+        int fd, length;
+        qint64 offset;
+        if (sharedFilesHash->getBlockFile(blockHash, &fd, &offset, &length)) {
+            localBlockReads->insert(blockIO->read(fd, offset, length), qMakePair(download, blockHash));
+            download->startLocalRead(blockHash);
+            continue;
+        }
+
+        // Metafiles and tree nodes are in memory
+        QByteArray localData = sharedFilesHash->fetchBlock(blockHash);
+        if (localData.isEmpty()) {
+            if (!expectedBlocks->contains(blockHash, download)) expectedBlocks->insert(blockHash, download);
+            continue;
+        }
+
+        QVariantMap localReply;
+        localReply.insert("BlockReply", blockHash);
+        localReply.insert("Data", localData);
+
+        // A tree node found locally makes the hashes below it known
+        blockHashes.append(download->receivedBlock(localReply));
+        addDownloadedBlock(download, blockHash);
+    }
+
+    // Received blocks are written in the background once enough of them are buffered
+    if (download->needsFlush()) {
+        quint64 writeId = download->startFlush();
+        if (writeId != 0) downloadWrites->insert(writeId, download);
+    }
+
+    // So are blocks written before a restart checked
+    if (download->hasBlocksToVerify()) {
+        BlockVerifier *verifier = download->startVerifying(++lastVerifyId);
+        downloadVerifications->insert(lastVerifyId, download);
+        connect(verifier, SIGNAL(finished(quint64,QByteArray)), this, SLOT(blocksVerified(quint64,QByteArray)));
+        connect(verifier, SIGNAL(finished(quint64,QByteArray)), verifier, SLOT(deleteLater()));
+        QThreadPool::globalInstance()->start(verifier);
+    }
+}
+
+/* A block of a download was read from a shared file. If the file changed since it was shared
+   (or the read failed), the block is fetched from the network instead.
+*/
+void FileShareManager::localBlockRead(OngoingDownload *download, QByteArray blockHash, QByteArray data) {
+
+    if (!ongoingDownloadList->contains(download)) return;
+
+    if (!data.isEmpty() && FileHasher::sha256(data) == blockHash) {
+        QVariantMap localReply;
+        localReply.insert("BlockReply", blockHash);
+        localReply.insert("Data", data);
+        expectBlocks(download, download->receivedBlock(localReply));
+        addDownloadedBlock(download, blockHash);
+    }
+
+    download->localReadFinished(blockHash);
+    if (download->isPending(blockHash) && !expectedBlocks->contains(blockHash, download)) {
+        expectedBlocks->insert(blockHash, download);
+    }
+
+    if (download->getNumberOfPendingBlocks() == 0) {
+        completeDownload(download);
+    } else if (!downloadsToRequest->contains(download)) {
+        downloadsToRequest->append(download);
+    }
+}
+
+/* Blocks that failed verification are fetched from the next timeout check on */
+void FileShareManager::blocksVerified(quint64 verifyId, QByteArray hashes) {
+
+    OngoingDownload *download = downloadVerifications->take(verifyId);
+    if (download == NULL || !ongoingDownloadList->contains(download)) return;
+
+    QList<QByteArray> verifiedHashes;
+    expectBlocks(download, download->verifyFinished(verifyId, hashes, &verifiedHashes));
+    for (int i = 0; i < verifiedHashes.size(); i++) {
+        addDownloadedBlock(download, verifiedHashes.at(i));
+    }
+    if (download->getNumberOfPendingBlocks() == 0) {
+        completeDownload(download);
+    } else if (!downloadsToRequest->contains(download)) {
+        downloadsToRequest->append(download);
+    }
+}
+
+/* Finishes a download that has every block, off the event loop: its last buffered blocks are
+   written through blockIO, then a DownloadFinisher moves the file into place and downloadFinished
+   shares it. Each step calls this again when it completes. Returns true if the download was dropped.
+*/
+bool FileShareManager::completeDownload(OngoingDownload *download) {
+
+    if (download->getNumberOfPendingBlocks() > 0 || download->hasWritesInFlight() || download->isFinishing()) {
+        return false;
+    }
+
+    if (download->getWriteFailures() >= DOWNLOAD_MAX_WRITE_FAILURES) {
+        qDebug() << "Giving up on" << download->getFilePath() << ".. its blocks can't be written";
+        endDownload(download);
+        return true;
+    }
+
+    if (download->hasDirtyBlocks()) {
+        quint64 writeId = download->startFlush();
+        if (writeId != 0) {
+            downloadWrites->insert(writeId, download);
+            return false;
+        }
+    }
+
+    DownloadFinisher *finisher = download->startFinishing();
+    connect(finisher, SIGNAL(finished(QByteArray,bool)), this, SLOT(downloadFinished(QByteArray,bool)));
+    connect(finisher, SIGNAL(finished(QByteArray,bool)), finisher, SLOT(deleteLater()));
+    QThreadPool::globalInstance()->start(finisher);
+    return false;
+}
+
+/* The file of a completed download is in place .. serve it from now on */
+void FileShareManager::downloadFinished(QByteArray fileHash, bool ok) {
+
+    OngoingDownload *download = findOngoingDownload(fileHash, QString());
+    if (download == NULL || !download->isFinishing()) return;
+
+    if (download->finishingFinished(ok)) shareCompletedDownload(download);
+    endDownload(download);
+}
+
+void FileShareManager::endDownload(OngoingDownload *download) {
+
+    OngoingDownload::Stats stats = download->getStats();
+    downloadStats.timeouts += stats.timeouts;
+    downloadStats.retries += stats.retries;
+    downloadStats.stalls += stats.stalls;
+
+    removeOngoingDownload(download);
+    pruneFileSources(download->getFileHash());
+    delete download;
+}
+
+void FileShareManager::downloadWriteFinished(quint64 writeId, bool ok) {
+
+    OngoingDownload *download = downloadWrites->take(writeId);
+    if (download == NULL || !ongoingDownloadList->contains(download)) return;
+
+    // Requests held back while the disk was behind go out again
+    download->flushFinished(writeId, ok);
+    if (!completeDownload(download) && !downloadsToRequest->contains(download)) downloadsToRequest->append(download);
+}
+
+void FileShareManager::removeOngoingDownload(OngoingDownload *download) {
+
+    ongoingDownloadList->removeOne(download);
+    downloadsToRequest->removeOne(download);
+
+    QList<QByteArray> blockHashes = download->getPendingBlockHashes();
+    for (int i = 0; i < blockHashes.size(); i++) {
+        expectedBlocks->remove(blockHashes.at(i), download);
+    }
+
+    blockHashes = download->getAvailableBlockHashes();
+    for (int i = 0; i < blockHashes.size(); i++) {
+        if (downloadedBlocks->value(blockHashes.at(i)) == download) downloadedBlocks->remove(blockHashes.at(i));
+    }
+}
+
+/* Returns (source, block hash) of the first blocks to request (the initial windows) */
+QList<QPair<QString, QByteArray> > FileShareManager::createOngoingDownload(QVariantMap message) {
 
     // We received response to the file request .. remove the request from fileRequestsSent
     QByteArray messageHash = message.value("BlockReply").toByteArray();
-    QString fileName = fileRequestsSent->value(messageHash);
-    fileRequestsSent->remove(messageHash);
+    QString fileName = fileRequestsSent->take(messageHash).fileName;
 
-    // Validate data in message first .. should be a multiple of HASH_NUM_BYTES
+    // Validate data in message first .. a flat block list or the root of a hash tree
     QByteArray metaFileData = message.value("Data").toByteArray();
-    if ((metaFileData.length() % HASH_NUM_BYTES) != 0) return NULL;
+    int height, numBlocks;
+    qint64 fileSize;
+    QByteArray childHashes;
+    bool contentDefined;
+    if (!HashTree::parseMetaFile(metaFileData, &height, &fileSize, &numBlocks, &contentDefined, &childHashes)) {
+        pruneFileSources(messageHash);
+        return QList<QPair<QString, QByteArray> >();
+    }
 
-    // Create new OngoingDownload with blocks contained in message's data
+    // Create new OngoingDownload with blocks (or tree nodes) contained in message's data
     QString saveFileDir = QDir::homePath();
-    int fileSize = (metaFileData.length() / HASH_NUM_BYTES) * BLOCK_SIZE;
-    QList<QByteArray> *blockHashList = getBlockHashList(metaFileData);
-    OngoingDownload *newDownload = new OngoingDownload(saveFileDir, fileName, fileSize, blockHashList);
 
-    ongoingDownloadList->append(newDownload);
+    // A second download into the same partial file would truncate it under the first one's writes
+    QString filePath = saveFileDir + "/" + DOWNLOAD_FOLDER_NAME + "/" + fileName;
+    OngoingDownload *existingDownload = findOngoingDownload(messageHash, filePath);
+    if (existingDownload != NULL) {
+        qDebug() << "Not starting download of" << fileName << ".." << existingDownload->getFilePath()
+                 << "is already being downloaded";
+        if (existingDownload->getFileHash() == messageHash) addFileSource(messageHash, message.value("Origin").toString());
+        pruneFileSources(messageHash);
+        return QList<QPair<QString, QByteArray> >();
+    }
+
+    // Fetch blocks from every origin that advertised the file, starting with the one that sent the metafile
+    addFileSource(messageHash, message.value("Origin").toString());
+    QStringList sources = fileSources->value(messageHash);
+    sources.removeAll(message.value("Origin").toString());
+    sources.prepend(message.value("Origin").toString());
+
+    OngoingDownload *newDownload = new OngoingDownload(saveFileDir, fileName, messageHash, metaFileData, sources);
+    if (!newDownload->hasPartialFile()) {
+        delete newDownload;
+        pruneFileSources(messageHash);
+        return QList<QPair<QString, QByteArray> >();
+    }
+    addOngoingDownload(newDownload);
 
-    // Return hash of the first block to fetch
-    return newDownload->getNextBlockToRequest();
+    // Nothing to fetch for an empty file .. or every block was found locally
+    if (newDownload->getNumberOfPendingBlocks() == 0) {
+        completeDownload(newDownload);
+        return QList<QPair<QString, QByteArray> >();
+    }
+
+    // Return hashes of the first blocks to fetch
+    return newDownload->takeBlocksToRequest();
 }
 
-QList<QByteArray> *FileShareManager::getBlockHashList(QByteArray metaFileData) {
+/* Returns the ongoing download of the file with the given hash or into the given path (if any) */
+OngoingDownload *FileShareManager::findOngoingDownload(QByteArray fileHash, QString filePath) {
+
+    for (int i = 0; i < ongoingDownloadList->size(); i++) {
+        OngoingDownload *download = ongoingDownloadList->at(i);
+        if (download->getFileHash() == fileHash || download->getFilePath() == filePath) return download;
+    }
+    return NULL;
+}
 
-    QList<QByteArray> *blockHashList = new QList<QByteArray>();
-    QByteArray *blockHash = new QByteArray();
+/* Returns (source, block hash) of the blocks to request next (if any) */
+QList<QPair<QString, QByteArray> > FileShareManager::receivedFileDataBlock(QVariantMap dataBlockMessage) {
 
-    for (int idx = 0; idx < metaFileData.length(); idx++) {
+    // Check if it's a block we need .. the same block may be part of several files being downloaded
+    QByteArray blockHash = dataBlockMessage.value("BlockReply").toByteArray();
+    QList<OngoingDownload *> blocksOngoingDownloads = expectedBlocks->values(blockHash);
+    expectedBlocks->remove(blockHash);
 
-        if ((idx % HASH_NUM_BYTES) == 0 && idx != 0) {
-            blockHashList->append(*blockHash);
-            blockHash = new QByteArray();
+    // Error checking to make sure that we requested the block that we received
+    QList<QPair<QString, QByteArray> > blocksToRequest;
+    for (int i = 0; i < blocksOngoingDownloads.size(); i++) {
+
+        // Update ongoing download data stucture .. a tree node makes the blocks below it expected
+        OngoingDownload *blocksOngoingDownload = blocksOngoingDownloads.at(i);
+        expectBlocks(blocksOngoingDownload, blocksOngoingDownload->receivedBlock(dataBlockMessage));
+        addDownloadedBlock(blocksOngoingDownload, blockHash);
+
+        // We downloaded the whole file successfully! .. once its last blocks are written
+        if (blocksOngoingDownload->getNumberOfPendingBlocks() == 0) {
+            completeDownload(blocksOngoingDownload);
+            continue;
         }
 
-        blockHash->append(metaFileData.at(idx));
+        // Hashes of next blocks to download .. as many as the window allows
+        blocksToRequest.append(blocksOngoingDownload->takeBlocksToRequest());
     }
 
-    // append the last accumulated blockHash too!
-    blockHashList->append(*blockHash);
+    return blocksToRequest;
+}
+
+/* Picks up the downloads interrupted by the last shutdown.
+   Returns (source, block hash) of the first blocks to request for them.
+*/
+QList<QPair<QString, QByteArray> > FileShareManager::resumeDownloads() {
 
-    return blockHashList;
+    QString saveFileDir = QDir::homePath();
+    QDir downloadFolder(saveFileDir + "/" + DOWNLOAD_FOLDER_NAME);
+    QStringList stateFiles = downloadFolder.entryList(
+                QStringList() << QString("*") + PARTIAL_FILE_SUFFIX + DOWNLOAD_STATE_SUFFIX, QDir::Files);
+
+    QList<QPair<QString, QByteArray> > blocksToRequest;
+    for (int i = 0; i < stateFiles.size(); i++) {
+
+        // Skip partial files a download started since this run is already writing to
+        QString stateFileName = stateFiles.at(i);
+        QString filePath = downloadFolder.filePath(stateFileName.left(
+                    stateFileName.size() - QString(PARTIAL_FILE_SUFFIX DOWNLOAD_STATE_SUFFIX).size()));
+        if (findOngoingDownload(QByteArray(), filePath) != NULL) continue;
+
+        OngoingDownload *download = OngoingDownload::restore(saveFileDir, downloadFolder.filePath(stateFileName));
+        if (download == NULL) continue;
+
+        // No room left for it .. or the same file is already being downloaded under another name
+        if (!download->hasPartialFile()) {
+            delete download;
+            continue;
+        }
+        if (findOngoingDownload(download->getFileHash(), QString()) != NULL) {
+            qDebug() << "Not resuming" << download->getFilePath() << ".. the file is already being downloaded";
+            delete download;
+            continue;
+        }
+        addOngoingDownload(download);
 
+        // Every block was already there
+        if (completeDownload(download)) continue;
+        blocksToRequest.append(download->takeBlocksToRequest());
+    }
+
+    return blocksToRequest;
 }
 
-QByteArray FileShareManager::receivedFileDataBlock(QVariantMap dataBlockMessage) {
+/* Called periodically: resends metafile and block requests that were not answered in time.
+   A metafile request is retried with exponential backoff, moving on to the next source that
+   advertised the file each time, until FILE_REQUEST_MAX_ATTEMPTS have been made.
+   Also asks for blocks of downloads that verified resumed blocks or wrote blocks since the last check.
+   Returns (destination, hash) of the requests to send.
+*/
+QList<QPair<QString, QByteArray> > FileShareManager::checkDownloadTimeouts() {
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<QPair<QString, QByteArray> > requestsToSend;
 
-    // Check if it's a block we need
-    QByteArray blockHash = dataBlockMessage.value("BlockReply").toByteArray();
-    OngoingDownload *blocksOngoingDownload = NULL;
-    int downloadListIdx;
-    for (downloadListIdx = 0; downloadListIdx < ongoingDownloadList->length(); downloadListIdx++) {
+    QHash<QByteArray, FileRequest>::iterator it = fileRequestsSent->begin();
+    while (it != fileRequestsSent->end()) {
 
-        if (ongoingDownloadList->at(downloadListIdx)->blockBelongsToFile(blockHash)) {
-            blocksOngoingDownload = ongoingDownloadList->at(downloadListIdx);
-            break;
+        FileRequest &request = it.value();
+        if (request.deadline > now) {
+            ++it;
+            continue;
         }
-    }
 
-    // Error checking to make sure that we requested the block that we received
-    if (blocksOngoingDownload == NULL) return NULL;
+        downloadStats.timeouts++;
+        if (++request.attempts >= FILE_REQUEST_MAX_ATTEMPTS) {
+            qDebug() << "No answer to the download request for" << request.fileName << ".. giving up";
+            QByteArray fileHash = it.key();
+            it = fileRequestsSent->erase(it);
+            pruneFileSources(fileHash);
+            continue;
+        }
 
-    // Update ongoing download data stucture
-    blocksOngoingDownload->receivedBlock(dataBlockMessage);
+        QStringList sources = fileSources->value(it.key());
+        if (!sources.isEmpty()) request.destination = sources.at(request.attempts % sources.size());
+        request.deadline = now + ((qint64) FILE_REQUEST_TIMEOUT << request.attempts);
+        downloadStats.retries++;
 
-    if (blocksOngoingDownload->getNumberOfPendingBlocks() == 0) {
+        requestsToSend.append(qMakePair(request.destination, it.key()));
+        ++it;
+    }
 
-        // We downloaded the whole file successfully!
-        blocksOngoingDownload->dumpDataToFile();
-        ongoingDownloadList->removeAt(downloadListIdx);
-        return NULL;
+    for (int i = 0; i < ongoingDownloadList->size(); i++) {
+        requestsToSend.append(ongoingDownloadList->at(i)->checkTimeouts(now));
+    }
+    while (!downloadsToRequest->isEmpty()) {
+        requestsToSend.append(downloadsToRequest->takeFirst()->takeBlocksToRequest());
     }
 
-    // Return hash of next block to download
-    return blocksOngoingDownload->getNextBlockToRequest();
+    return requestsToSend;
 }
 
-QList<SharedFile *> *FileShareManager::searchForSharedFiles(QString keywords) {
+/* Timeout, retry and stall counters over all downloads since startup */
+OngoingDownload::Stats FileShareManager::getDownloadStats() {
 
-    // Split keywords string into tokens delimited by white space
-    QStringList keywordsList = keywords.split(" ", QString::SkipEmptyParts, Qt::CaseInsensitive);
+    OngoingDownload::Stats totals = downloadStats;
+    for (int i = 0; i < ongoingDownloadList->size(); i++) {
+        OngoingDownload::Stats stats = ongoingDownloadList->at(i)->getStats();
+        totals.timeouts += stats.timeouts;
+        totals.retries += stats.retries;
+        totals.stalls += stats.stalls;
+    }
+    return totals;
+}
 
-    QList<SharedFile *> *matchedSharedFiles = new QList<SharedFile *>();
-    QStringList sharedFileNamesList = sharedFilesMap->keys();
-    for (int keywordIdx = 0; keywordIdx < keywordsList.length(); keywordIdx++) {
-        // for each keyword to search
+/* Shared files whose name contains any of the keywords, best matches first, at most SEARCH_MAX_RESULTS */
+QList<SharedFile *> FileShareManager::searchForSharedFiles(QString keywords) {
 
-        QString keyword = keywordsList.at(keywordIdx);
-        for (int fileIdx = 0; fileIdx < sharedFileNamesList.length(); fileIdx++) {
-            // for each shared file
+    QStringList matchedFileNames = searchIndex->search(keywords, SEARCH_MAX_RESULTS);
 
-            // match filename with keyword
-            QString fileName = sharedFileNamesList.at(fileIdx);
-            int matchIdx = fileName.indexOf(keyword, 0, Qt::CaseInsensitive);
-            if (matchIdx >= 0) {
-                // Match found!
-                SharedFile *matchedFile = sharedFilesMap->value(fileName);
-                matchedSharedFiles->append(matchedFile);
-            }
-        }
+    QList<SharedFile *> matchedSharedFiles;
+    for (int i = 0; i < matchedFileNames.size(); i++) {
+        SharedFile *matchedFile = sharedFilesMap->value(matchedFileNames.at(i));
+        if (matchedFile != NULL) matchedSharedFiles.append(matchedFile);
     }
 
     return matchedSharedFiles;
@@ -214,67 +803,111 @@ QList<SharedFile *> *FileShareManager::searchForSharedFiles(QString keywords) {
 
 //}
 
-void FileShareManager::receivedSearchResultFiles(QVariantMap searchReplyMessage) {
-
-    // First make sure that the search reply corresponds to the current search!
-    QString searchKeywords = searchReplyMessage.value("SearchReply").toString();
-    if (currentSearchKeywords != searchKeywords) return;
+/* Adds the files of a search reply to the search it answers and returns those new to that search,
+   < file hash, file name >
+*/
+QMap<QByteArray, QString> FileShareManager::receivedSearchResultFiles(QVariantMap searchReplyMessage) {
+
+    // Replies from older nodes carry no search id .. match them by keywords
+    SearchQuery *search = NULL;
+    if (searchReplyMessage.contains("SearchID")) {
+        search = searches->value(searchReplyMessage.value("SearchID").toUInt());
+    } else {
+        QMap<quint32, SearchQuery *>::const_iterator it;
+        for (it = searches->constBegin(); it != searches->constEnd(); ++it) {
+            if (it.value()->getKeywords() == searchReplyMessage.value("SearchReply").toString()) search = it.value();
+        }
+    }
+    if (search == NULL) return QMap<QByteArray, QString>();   // search is over (or not ours)
 
-    //QList<QByteArray> *fileHashList = getFileHashList(searchReplyMessage);
     QVariantList fileHashList = searchReplyMessage.value("MatchIDs").toList();
     QVariantList fileNamesList = searchReplyMessage.value("MatchNames").toList();
     QString destination = searchReplyMessage.value("Origin").toString();
 
-    for (int i = 0; i < fileHashList.length(); i++) {
+    // Every origin advertising the same file hash is a source to download from
+    for (int i = 0; i < fileHashList.length() && i < fileNamesList.length(); i++) {
+        addFileSource(fileHashList.at(i).toByteArray(), destination);
+    }
 
-        // Get the last part of filename after slash from the absolute path
-        QStringList slashDelimFileName = fileNamesList.at(i).toString().split("/");
-        QString fileName = slashDelimFileName.last();
+    return search->addResults(fileNamesList, fileHashList);
+}
 
-        QByteArray fileHash = fileHashList.at(i).toByteArray();
+/* Starts tracking a new search .. any number of searches may run at the same time */
+SearchQuery *FileShareManager::startNewSearch(QString newSearchKeywords, quint32 initialSearchBudget) {
 
-        QPair<QString, QByteArray> destinationHashPair(destination, fileHash);
-        //QPair<QString, QByteArray> destinationHashPair(destination, fileHashList->at(i));
+    // New search id .. the host identifier is different on every run, so a counter will do
+    SearchQuery *search = new SearchQuery(++lastSearchId, newSearchKeywords, initialSearchBudget,
+                                          QDateTime::currentMSecsSinceEpoch());
+    searches->insert(search->getSearchId(), search);
+    return search;
+}
 
-        searchResultFiles->insert(fileName, destinationHashPair);
-    }
+/* Called on every tick of the search scheduler: returns the searches to send again with their
+   doubled budget, and forgets searches past their lifetime
+*/
+QList<SearchQuery *> FileShareManager::takeSearchRounds(qint64 now) {
 
-}
+    QList<SearchQuery *> dueSearches;
 
-void FileShareManager::startNewSearch(QString newSearchKeywords, quint32 initialSearchBudget) {
+    QMap<quint32, SearchQuery *>::iterator it = searches->begin();
+    while (it != searches->end()) {
 
-    // Set current search keywords to the string provided
-    this->currentSearchKeywords = newSearchKeywords;
+        SearchQuery *search = it.value();
+        if (search->isExpired(now)) {
+            QList<QByteArray> resultHashes = search->getResultHashes();
+            delete search;
+            it = searches->erase(it);
+            for (int i = 0; i < resultHashes.size(); i++) {
+                pruneFileSources(resultHashes.at(i));
+            }
+            continue;
+        }
 
-    // initialize current search budget
-    this->currentSearchBudget = initialSearchBudget;
+        if (search->isDue(now)) {
+            search->expandBudget(now);
+            if (search->isExpanding()) dueSearches.append(search);
+        }
+        ++it;
+    }
 
-    // We need to clear the former search results list!
-    searchResultFiles->clear();
+    return dueSearches;
 }
 
-QString FileShareManager::getDestinationForDownload(QString fileName) {
+/* True while some search still needs budget expansion rounds or may still get replies */
+bool FileShareManager::hasActiveSearches() {
 
-    return searchResultFiles->value(fileName).first;
+    return !searches->isEmpty();
 }
 
-QByteArray FileShareManager::getFileHashForDownload(QString fileName) {
+QStringList FileShareManager::getSourcesForDownload(QByteArray fileHash) {
 
-    return searchResultFiles->value(fileName).second;
+    return fileSources->value(fileHash);
 }
 
-int FileShareManager::getNumberOfSearchHits() {
+/* Forgets the sources of a file once no search, file request or download refers to it anymore */
+void FileShareManager::pruneFileSources(QByteArray fileHash) {
 
-    return searchResultFiles->keys().length();
+    if (fileRequestsSent->contains(fileHash) || findOngoingDownload(fileHash, QString()) != NULL) return;
+
+    QMap<quint32, SearchQuery *>::const_iterator it;
+    for (it = searches->constBegin(); it != searches->constEnd(); ++it) {
+        if (it.value()->hasResult(fileHash)) return;
+    }
+    fileSources->remove(fileHash);
 }
 
-QString FileShareManager::getCurrentSearchKeywords() {
+ContentSummary *FileShareManager::getContentSummary() {
 
-    return this->currentSearchKeywords;
+    return contentSummary;
 }
 
-quint32 FileShareManager::getIncrementedSearchBudget() {
+/* Names (without path) and hashes of the files we share */
+QList<QPair<QString, QByteArray> > FileShareManager::getSharedFiles() {
 
-    currentSearchBudget *= 2;
-    return currentSearchBudget;
+    QList<QPair<QString, QByteArray> > files;
+    QMap<QString, SharedFile *>::const_iterator it;
+    for (it = sharedFilesMap->constBegin(); it != sharedFilesMap->constEnd(); ++it) {
+        files.append(qMakePair(it.key(), it.value()->getFileHash()));
+    }
+    return files;
 }
@@ -5,50 +5,129 @@
 #include <QStringList>
 #include <QTimer>
 #include <QVariantMap>
+#include <QCache>
+#include <QSet>
 
 #include "SharedFile.hh"
-#include "FileBlock.hh"
+#include "BlockStore.hh"
+#include "BlockCache.hh"
+#include "ShareIndex.hh"
+#include "SearchIndex.hh"
+#include "SearchQuery.hh"
+#include "ContentSummary.hh"
 #include "OngoingDownload.hh"
+#include "AsyncBlockIO.hh"
 
 #define BLOCK_SIZE (8192) // 8 kB
 #define HASH_NUM_BYTES (32) // 32 bytes in SHA256 hash
+#define SHARE_INDEX_FILE_NAME "share_index"
+#define FILE_REQUEST_TIMEOUT (2000)         // ms before a metafile request is sent again, doubled every time
+#define FILE_REQUEST_MAX_ATTEMPTS (8)
+#define BLOCK_COMPRESSION_LEVEL (1)         // zlib level .. fast, most of the gain on text
+#define COMPRESSED_BLOCK_CACHE_SIZE (4 * 1024 * 1024)  // bytes of compressed blocks kept for popular blocks
+#define COMPRESSED_BLOCK_ENTRY_OVERHEAD (128)   // bytes charged per cache entry on top of its data (node, key, array headers)
+#define BLOCK_CACHE_REPORT_INTERVAL (1024)  // block requests served between two cache statistics reports
+#define RELAY_CACHE_SIZE (16 * 1024 * 1024) // bytes of forwarded blocks kept when relay caching is on
 
 class FileShareManager : public QObject
 {
     Q_OBJECT
 
 public:
-    FileShareManager();
+    FileShareManager(QString stateDir, bool contentDefinedChunking);
 
     void shareFiles(QStringList files);
-    void splitFileAndHash(QString fileName);
+    void restoreSharedFiles();
+    void addSharedFile(QString filePath, qint64 fileSize, bool contentDefined, QByteArray blockListMeta,
+                       QByteArray fileHash);
     QByteArray fetchBlockData(QByteArray requestedBlockHash);
-    void newDownloadFileRequest(QByteArray fileHash, QString fileName);
-    bool isMetaFile(QVariantMap message);
-    QByteArray createOngoingDownload(QVariantMap message);
-    QByteArray receivedFileDataBlock(QVariantMap dataBlockMessage);
-    QList<SharedFile *> *searchForSharedFiles(QString keywords);
+    QByteArray fetchBlockDataAsync(QByteArray requestedBlockHash, bool *pending);
+    int getBlockLength(QByteArray blockHash);
+    QByteArray fetchCompressedBlockData(QByteArray requestedBlockHash, QByteArray data);
+    BlockCache::Stats getBlockCacheStats();
+    void enableRelayCache(qint64 maxBytes);
+    void cacheRelayedBlock(QByteArray blockHash, QByteArray data);
+    QByteArray fetchRelayedBlock(QByteArray blockHash);
+    bool newDownloadFileRequest(QByteArray fileHash, QString fileName, QString destination);
+    QList<QPair<QString, QByteArray> > receivedBlockReply(QVariantMap message);
+    QList<QPair<QString, QByteArray> > receivedBlockBusy(QVariantMap message);
+    QList<QPair<QString, QByteArray> > resumeDownloads();
+    QList<QPair<QString, QByteArray> > checkDownloadTimeouts();
+    OngoingDownload::Stats getDownloadStats();
+    QList<SharedFile *> searchForSharedFiles(QString keywords);
     QList<QByteArray> *getFileHashList(QVariantMap searchReplyMessage);
-    void receivedSearchResultFiles(QVariantMap searchReplyMessage);
-    void startNewSearch(QString newSearchKeywords, quint32 initialSearchBudget);
-    QString getDestinationForDownload(QString fileName);
-    QByteArray getFileHashForDownload(QString fileName);
-    int getNumberOfSearchHits();
-    quint32 getIncrementedSearchBudget();
-    QString getCurrentSearchKeywords();
+    QMap<QByteArray, QString> receivedSearchResultFiles(QVariantMap searchReplyMessage);
+    SearchQuery *startNewSearch(QString newSearchKeywords, quint32 initialSearchBudget);
+    QList<SearchQuery *> takeSearchRounds(qint64 now);
+    bool hasActiveSearches();
+    QStringList getSourcesForDownload(QByteArray fileHash);
+    ContentSummary *getContentSummary();
+    QList<QPair<QString, QByteArray> > getSharedFiles();
+    void addFileSource(QByteArray fileHash, QString origin);
 
 
 private:
+    struct FileRequest {
+        QString fileName;
+        QString destination;                        // source the metafile was last requested from
+        qint64 deadline;
+        int attempts;
+    };
+
+    bool contentDefinedChunking;                    // split shared files at content-defined boundaries
     QMap<QString, SharedFile *> *sharedFilesMap;      // < filename, sharedfile >
-    QHash<QByteArray, FileBlock *> *sharedFilesHash; // FileBlock can be either actual file chunk or hash of a block
-    QMap<QByteArray, QString> *fileRequestsSent;    // < filemeta hash, filename >
+    SearchIndex *searchIndex;                       // trigrams of the shared file names, for searches
+    ContentSummary *contentSummary;                 // Bloom filters of the names shared here and nearby
+    BlockStore *sharedFilesHash;                    // file blocks and metafiles we serve, by hash
+    BlockCache *servedBlocks;                       // recently served blocks, so popular ones aren't read again
+    BlockCache *relayedBlocks;                      // blocks forwarded for others .. NULL unless relay caching is on
+    QCache<QByteArray, QByteArray> *compressedBlocks; // < block hash, compressed block or empty if it doesn't shrink >
+    AsyncBlockIO *blockIO;                          // disk reads of served blocks and writes of downloads
+    QHash<quint64, QByteArray> *blockReads;         // < read id, hash of the block being read >
+    QHash<quint64, QPair<OngoingDownload *, QByteArray> > *localBlockReads;  // < read id, download and hash of a block copied from a shared file >
+    QSet<QByteArray> *blocksBeingRead;
+    QHash<quint64, OngoingDownload *> *downloadWrites;  // < write id, download whose blocks are being written >
+    QHash<quint64, OngoingDownload *> *downloadVerifications;  // < verify id, download whose resumed blocks are being checked >
+    quint64 lastVerifyId;
+    QList<OngoingDownload *> *downloadsToRequest;   // verified or written blocks, to request more from the next timeout check
+    QHash<QString, int> *sharedFileIds;             // < file path, id of the file in the block store >
+    ShareIndex *shareIndex;                         // hashes of shared files persisted across restarts
+    QHash<QByteArray, FileRequest> *fileRequestsSent; // < filemeta hash, metafile request >
     QList<OngoingDownload *> *ongoingDownloadList;
-    QMap<QString, QPair<QString, QByteArray> > *searchResultFiles;   // < filename, < destination, filemeta hash > >
+    QMultiHash<QByteArray, OngoingDownload *> *expectedBlocks;  // < block hash, download still waiting for it >
+    QHash<QByteArray, OngoingDownload *> *downloadedBlocks;     // < block hash, download that can serve it >
+    QMap<quint32, SearchQuery *> *searches;         // < search id, search started here >
+    quint32 lastSearchId;                           // origin and id tell searches apart across the network
+    QHash<QByteArray, QStringList> *fileSources;    // < filemeta hash, origins that advertised the file > while in use
+    OngoingDownload::Stats downloadStats;           // metafile requests and finished downloads
+
+    QList<QPair<QString, QByteArray> > createOngoingDownload(QVariantMap message);
+    OngoingDownload *findOngoingDownload(QByteArray fileHash, QString filePath);
+    void endDownload(OngoingDownload *download);
+    void pruneFileSources(QByteArray fileHash);
+    QList<QPair<QString, QByteArray> > receivedFileDataBlock(QVariantMap dataBlockMessage);
+    void addOngoingDownload(OngoingDownload *download);
+    void removeOngoingDownload(OngoingDownload *download);
+    void expectBlocks(OngoingDownload *download, QList<QByteArray> blockHashes);
+    void addDownloadedBlock(OngoingDownload *download, QByteArray blockHash);
+    void localBlockRead(OngoingDownload *download, QByteArray blockHash, QByteArray data);
+    QByteArray fetchDownloadedBlock(QByteArray blockHash);
+    void shareCompletedDownload(OngoingDownload *download);
+    bool completeDownload(OngoingDownload *download);
+    void reportBlockCacheStats();
 
-    QString currentSearchKeywords;
-    quint32 currentSearchBudget;
+public slots:
+    void fileHashed(QString filePath, qint64 fileSize, qint64 modifiedTime, quint64 inode, bool contentDefined,
+                    QByteArray blockListMeta, QByteArray fileHash);
+    void saveShareIndex();
+    void blockReadFinished(quint64 readId, QByteArray data);
+    void downloadWriteFinished(quint64 writeId, bool ok);
+    void downloadFinished(QByteArray fileHash, bool ok);
+    void blocksVerified(quint64 verifyId, QByteArray hashes);
 
-    QList<QByteArray> *getBlockHashList(QByteArray metaFileData);
+signals:
+    void fileShared(QString fileName, QByteArray fileHash);
+    void blockDataRead(QByteArray blockHash, QByteArray data);     // empty if the read failed
 };
 
 #endif // FILESHAREMANAGER_HH
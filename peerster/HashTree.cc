@@ -0,0 +1,127 @@
+#include "HashTree.hh"
+#include "FileHasher.hh"
+#include "FileShareManager.hh"
+
+#include <QDataStream>
+
+/* Returns the metafile for a file with the given block list (block hashes, or block entries for
+   content-defined blocks). For a hash tree, the interior nodes below the root are added to
+   interiorNodes (< node hash, node >) if it is not NULL.
+*/
+QByteArray HashTree::buildMetaFile(QByteArray blockListMeta, qint64 fileSize, bool contentDefined,
+                                   QHash<QByteArray, QByteArray> *interiorNodes) {
+
+    int entrySize = getBlockEntrySize(contentDefined);
+    int numBlocks = blockListMeta.size() / entrySize;
+    if (!contentDefined && numBlocks <= HASH_TREE_FANOUT) return blockListMeta;
+
+    // Hash groups of children into their parent until the top level fits in the root
+    QByteArray level = blockListMeta;
+    int fanout = contentDefined ? HASH_TREE_CDC_FANOUT : HASH_TREE_FANOUT;
+    int height = 1;
+    while (level.size() / entrySize > (BLOCK_SIZE - HASH_TREE_HEADER_SIZE) / entrySize) {
+
+        QByteArray parentLevel;
+        for (int offset = 0; offset < level.size(); offset += fanout * entrySize) {
+
+            QByteArray node = level.mid(offset, fanout * entrySize);
+            QByteArray nodeHash = FileHasher::sha256(node);
+            if (interiorNodes != NULL) interiorNodes->insert(nodeHash, node);
+            parentLevel.append(nodeHash);
+        }
+        level = parentLevel;
+        entrySize = HASH_NUM_BYTES;
+        fanout = HASH_TREE_FANOUT;
+        height++;
+    }
+
+    QByteArray root;
+    QDataStream stream(&root, QIODevice::WriteOnly);
+    if (contentDefined) {
+        stream.writeRawData(HASH_TREE_CDC_MAGIC, 4);
+        stream << (quint32) numBlocks << (quint64) fileSize;
+    } else {
+        stream.writeRawData(HASH_TREE_MAGIC, 4);
+        stream << (quint32) height << (quint64) fileSize;
+    }
+    root.append(level);
+
+    return root;
+}
+
+/* Reads any metafile format. A flat metafile is a tree of height 1 whose size is only known
+   up to the length of the last block. Returns false if the metafile is malformed.
+*/
+bool HashTree::parseMetaFile(QByteArray metaFile, int *height, qint64 *fileSize, int *numBlocks,
+                             bool *contentDefined, QByteArray *childHashes) {
+
+    bool cdcTree = metaFile.startsWith(HASH_TREE_CDC_MAGIC);
+    if (metaFile.length() >= HASH_TREE_HEADER_SIZE && (cdcTree || metaFile.startsWith(HASH_TREE_MAGIC))) {
+
+        QDataStream stream(metaFile.mid(4, HASH_TREE_HEADER_SIZE - 4));
+        quint32 field;
+        quint64 size;
+        stream >> field >> size;
+
+        // Work out the shape of the tree .. the root must have exactly as many children as needed
+        qint64 blocks, rootChildren;
+        int treeHeight, entrySize;
+        if (cdcTree) {
+            blocks = field;
+            rootChildren = blocks;
+            entrySize = HASH_TREE_CDC_ENTRY_SIZE;
+            qint64 fanout = HASH_TREE_CDC_FANOUT;
+            for (treeHeight = 1; rootChildren > (BLOCK_SIZE - HASH_TREE_HEADER_SIZE) / entrySize; treeHeight++) {
+                rootChildren = (rootChildren + fanout - 1) / fanout;
+                entrySize = HASH_NUM_BYTES;
+                fanout = HASH_TREE_FANOUT;
+            }
+        } else {
+            treeHeight = field;
+            if (treeHeight < 2 || treeHeight > HASH_TREE_MAX_HEIGHT) return false;
+            blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            qint64 blocksPerChild = getBlocksUnderNode(treeHeight - 1, false);
+            rootChildren = (blocks + blocksPerChild - 1) / blocksPerChild;
+            entrySize = HASH_NUM_BYTES;
+        }
+
+        // Blocks are at most BLOCK_SIZE long
+        if (blocks > HASH_TREE_MAX_BLOCKS || size > (quint64) blocks * BLOCK_SIZE ||
+                metaFile.length() - HASH_TREE_HEADER_SIZE != rootChildren * entrySize) return false;
+
+        *height = treeHeight;
+        *fileSize = size;
+        *numBlocks = (int) blocks;
+        *contentDefined = cdcTree;
+        *childHashes = metaFile.mid(HASH_TREE_HEADER_SIZE);
+        return true;
+    }
+
+    // Flat metafile
+    if (metaFile.length() % HASH_NUM_BYTES != 0 || metaFile.length() / HASH_NUM_BYTES > HASH_TREE_MAX_BLOCKS) return false;
+
+    *height = 1;
+    *numBlocks = metaFile.length() / HASH_NUM_BYTES;
+    *fileSize = (qint64) *numBlocks * BLOCK_SIZE;
+    *contentDefined = false;
+    *childHashes = metaFile;
+    return true;
+}
+
+/* Number of data blocks covered by a node at the given level (a data block itself is level 0) */
+qint64 HashTree::getBlocksUnderNode(int level, bool contentDefined) {
+
+    if (level == 0) return 1;
+
+    qint64 blocks = contentDefined ? HASH_TREE_CDC_FANOUT : HASH_TREE_FANOUT;
+    for (int i = 1; i < level; i++) {
+        blocks *= HASH_TREE_FANOUT;
+    }
+    return blocks;
+}
+
+/* Size of an entry in a level 1 node */
+int HashTree::getBlockEntrySize(bool contentDefined) {
+
+    return contentDefined ? HASH_TREE_CDC_ENTRY_SIZE : HASH_NUM_BYTES;
+}
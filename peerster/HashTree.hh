@@ -0,0 +1,40 @@
+#ifndef HASHTREE_HH
+#define HASHTREE_HH
+
+#include <QByteArray>
+#include <QHash>
+
+#define HASH_TREE_MAGIC "PTRE"
+#define HASH_TREE_CDC_MAGIC "PCDC"          // tree of content-defined (variable length) blocks
+#define HASH_TREE_HEADER_SIZE (16)          // magic, height or number of blocks (quint32), file size (quint64)
+#define HASH_TREE_FANOUT (256)              // BLOCK_SIZE / HASH_NUM_BYTES hashes fit in a node
+#define HASH_TREE_CDC_ENTRY_SIZE (34)       // block hash followed by the block length (quint16)
+#define HASH_TREE_CDC_FANOUT (240)          // block entries in a level 1 node
+#define HASH_TREE_MAX_HEIGHT (6)
+#define HASH_TREE_MAX_BLOCKS (1 << 22)     // 32 GB of fixed size blocks .. metafiles come from the network
+
+/* Metafile formats.
+ * Files of up to HASH_TREE_FANOUT fixed size blocks keep the flat metafile: their block hashes
+ * concatenated. Bigger files get a hash tree instead: the metafile is the root, a header
+ * (tree height, exact file size) followed by the hashes of its children. Each interior
+ * node is a block of up to HASH_TREE_FANOUT child hashes, served and fetched like any other
+ * block and verified against the hash in its parent, so every block can be checked back to
+ * the file hash as soon as the node above it has arrived.
+ * Files split into content-defined blocks always use a tree (with the number of blocks in
+ * the header instead of the height); their level 1 entries also give the length of each block.
+ * Levels count up from the data blocks: a level 1 node lists blocks, the root is at level 'height'.
+ */
+
+class HashTree
+{
+
+public:
+    static QByteArray buildMetaFile(QByteArray blockListMeta, qint64 fileSize, bool contentDefined,
+                                    QHash<QByteArray, QByteArray> *interiorNodes);
+    static bool parseMetaFile(QByteArray metaFile, int *height, qint64 *fileSize, int *numBlocks,
+                              bool *contentDefined, QByteArray *childHashes);
+    static qint64 getBlocksUnderNode(int level, bool contentDefined);
+    static int getBlockEntrySize(bool contentDefined);
+};
+
+#endif // HASHTREE_HH
@@ -1,8 +1,11 @@
 #include <QDebug>
 #include <QList>
 #include <QVariantList>
-#include <QtCrypto>
 #include "MessageManager.hh"
+#include "FileHasher.hh"
+#include "FileShareManager.hh"
+#include "ContentSummary.hh"
+#include "DhtRoutingTable.hh"
 
 MessageManager::MessageManager(QString currentHostName) {
 
@@ -57,7 +60,7 @@ QVariantMap *MessageManager::createNewPrivateMessage(QString destination, QStrin
     return messageMap;
 }
 
-/* Creates a new block request message */
+/* Creates a new block request message .. it tells the destination we can take compressed replies */
 QVariantMap *MessageManager::createBlockRequestMessage(QString destination, quint32 hopLimit, QByteArray blockHash) {
 
     QVariantMap *messageMap = new QVariantMap();
@@ -65,12 +68,14 @@ QVariantMap *MessageManager::createBlockRequestMessage(QString destination, quin
     messageMap->insert("Origin", hostName);
     messageMap->insert("HopLimit", hopLimit);
     messageMap->insert("BlockRequest", blockHash);
+    messageMap->insert("Compress", BLOCK_COMPRESSION_CODEC);
 
     return messageMap;
 }
 
-/* Creates a new block reply message */
-QVariantMap *MessageManager::createBlockReplyMessage(QString destination, quint32 hopLimit, QByteArray blockHash, QByteArray data) {
+/* Creates a new block reply message .. if compression is given, data is compressed with that codec */
+QVariantMap *MessageManager::createBlockReplyMessage(QString destination, quint32 hopLimit, QByteArray blockHash, QByteArray data,
+                                                     QString compression) {
 
     QVariantMap *messageMap = new QVariantMap();
     messageMap->insert("Dest", destination);
@@ -78,24 +83,50 @@ QVariantMap *MessageManager::createBlockReplyMessage(QString destination, quint3
     messageMap->insert("HopLimit", hopLimit);
     messageMap->insert("BlockReply", blockHash);
     messageMap->insert("Data", data);
+    if (!compression.isEmpty()) messageMap->insert("Compress", compression);
 
     return messageMap;
 }
 
-QVariantMap *MessageManager::decrementHopLimit(QVariantMap message) {
+/* Creates the answer to a block request we have no upload capacity for: ask again in retryAfter ms */
+QVariantMap *MessageManager::createBlockBusyMessage(QString destination, quint32 hopLimit, QByteArray blockHash,
+                                                    quint32 retryAfter) {
 
-    QVariantMap *newMessage = new QVariantMap(message);
-    quint16 hopLimit = newMessage->value("HopLimit").toUInt() - 1;
-    newMessage->insert("HopLimit", hopLimit);
-    return newMessage;
+    QVariantMap *messageMap = new QVariantMap();
+    messageMap->insert("Dest", destination);
+    messageMap->insert("Origin", hostName);
+    messageMap->insert("HopLimit", hopLimit);
+    messageMap->insert("BlockBusy", blockHash);
+    messageMap->insert("RetryAfter", retryAfter);
+
+    return messageMap;
 }
 
-QVariantMap *MessageManager::createSearchRequestMessage(QString origin, QString searchKeywords, quint32 budget) {
+/* Creates a message carrying our content summary (attenuated Bloom filters) for a neighbor */
+QVariantMap *MessageManager::createContentSummaryMessage(QByteArray summary) {
+
+    QVariantMap *messageMap = new QVariantMap();
+    messageMap->insert("Summary", summary);
+
+    return messageMap;
+}
+
+/* Decrements the hop limit in place so that forwarded messages don't need a copy */
+void MessageManager::decrementHopLimit(QVariantMap *message) {
+
+    quint32 hopLimit = message->value("HopLimit").toUInt() - 1;
+    message->insert("HopLimit", hopLimit);
+}
+
+/* Creates a new search request .. the id stays the same over the budget expansion rounds of a search */
+QVariantMap *MessageManager::createSearchRequestMessage(QString origin, QString searchKeywords, quint32 budget,
+                                                        quint32 searchId) {
 
     QVariantMap *messageMap = new QVariantMap();
     messageMap->insert("Origin", origin);
     messageMap->insert("Search", searchKeywords);
     messageMap->insert("Budget", budget);
+    messageMap->insert("SearchID", searchId);
 
     return messageMap;
 
@@ -416,10 +447,10 @@ bool MessageManager::isValidBlockReply(QVariantMap message) {
         QString destination = message.value("Dest").toString();
         QString origin = message.value("Origin").toString();
         QByteArray blockReply = message.value("BlockReply").toByteArray();
-        QByteArray data = message.value("Data").toByteArray();
+        QByteArray data = getBlockReplyData(message);
 
-        // Hash of data should explicitely match SHA hash held in blockReply field
-        QByteArray dataHash = QCA::Hash("sha256").hash(data).toByteArray();
+        // Hash of data should explicitely match SHA hash held in blockReply field .. the hash is over the uncompressed data
+        QByteArray dataHash = FileHasher::sha256(data);
 
         return (!destination.isEmpty() && !origin.isEmpty() && !blockReply.isEmpty()
                 && !data.isEmpty() && dataHash == blockReply);
@@ -429,6 +460,21 @@ bool MessageManager::isValidBlockReply(QVariantMap message) {
 
 }
 
+/* Returns the block carried by a block reply, decompressed if needed. Empty if it can't be decompressed. */
+QByteArray MessageManager::getBlockReplyData(QVariantMap message) {
+
+    QByteArray data = message.value("Data").toByteArray();
+    if (!message.contains("Compress")) return data;
+    if (message.value("Compress").toString() != BLOCK_COMPRESSION_CODEC || data.size() < 4) return QByteArray();
+
+    // qCompress puts the uncompressed size first .. never inflate anything bigger than a block
+    const uchar *header = (const uchar *) data.constData();
+    quint32 size = ((quint32) header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    if (size == 0 || size > BLOCK_SIZE) return QByteArray();
+
+    return qUncompress(data);
+}
+
 bool MessageManager::isValidSearchRequest(QVariantMap message) {
 
     if (message.contains("Origin") && message.contains("Search") &&
@@ -443,6 +489,38 @@ bool MessageManager::isValidSearchRequest(QVariantMap message) {
     return false;
 }
 
+bool MessageManager::isValidBlockBusy(QVariantMap message) {
+
+    if (message.contains("Dest") && message.contains("Origin") && message.contains("HopLimit") &&
+            message.contains("BlockBusy") && message.contains("RetryAfter")) {
+
+        return !message.value("Dest").toString().isEmpty() && !message.value("Origin").toString().isEmpty() &&
+                !message.value("BlockBusy").toByteArray().isEmpty();
+    }
+
+    return false;
+}
+
+bool MessageManager::isValidContentSummary(QVariantMap message) {
+
+    return message.contains("Summary") && ContentSummary::isValidSummary(message.value("Summary").toByteArray());
+}
+
+bool MessageManager::isValidDhtMessage(QVariantMap message) {
+
+    if (!message.contains("Dht") || !message.contains("DhtId") || !message.contains("Rpc") ||
+            !message.contains("Target")) {
+        return false;
+    }
+
+    QString type = message.value("Dht").toString();
+    if (type != "FindNode" && type != "FindValue" && type != "Store" && type != "Reply") return false;
+
+    return message.value("DhtId").toByteArray().size() == DHT_ID_BYTES &&
+            message.value("Target").toByteArray().size() == DHT_ID_BYTES &&
+            (type != "Store" || message.value("Record").canConvert<QVariantMap>());
+}
+
 bool MessageManager::isValidSearchReply(QVariantMap message) {
 
     if (message.contains("Origin") && message.contains("Dest") && message.contains("HopLimit") &&
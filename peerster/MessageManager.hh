@@ -2,6 +2,8 @@
 #include <QTimer>
 #include <QHostAddress>
 
+#define BLOCK_COMPRESSION_CODEC "zlib"     // offered in block requests, named in compressed block replies
+
 class Message
 {
 
@@ -41,11 +43,14 @@ public:
 	QVariantMap *createNewRumorMessage(QString messageText);
     QVariantMap *createNewPrivateMessage(QString destination, QString messageText, quint32 hopLimit);
     QVariantMap *createBlockRequestMessage(QString destination, quint32 hopLimit, QByteArray blockHash);
-    QVariantMap *createBlockReplyMessage(QString destination, quint32 hopLimit, QByteArray blockHash, QByteArray data);
-    QVariantMap *decrementHopLimit(QVariantMap message);
-    QVariantMap *createSearchRequestMessage(QString origin, QString searchKeywords, quint32 budget);
+    QVariantMap *createBlockReplyMessage(QString destination, quint32 hopLimit, QByteArray blockHash, QByteArray data,
+                                         QString compression = QString());
+    QVariantMap *createBlockBusyMessage(QString destination, quint32 hopLimit, QByteArray blockHash, quint32 retryAfter);
+    void decrementHopLimit(QVariantMap *message);
+    QVariantMap *createSearchRequestMessage(QString origin, QString searchKeywords, quint32 budget, quint32 searchId);
     QVariantMap *createSearchReplyMessage(QString destination, quint32 hopLimit, QString searchKeywords,
                                           QStringList matchedFiles, QList<QByteArray> matchedFileHashes);
+    QVariantMap *createContentSummaryMessage(QByteArray summary);
     QVariantMap *createNewImageChunk(QPair<QVector<uint>*, QVector<uint>* >* imageChunk, int idx);
     QVariantMap *createNewImageCompResult(int idx, double result);
 
@@ -65,8 +70,12 @@ public:
     bool containsLastAddress(QVariantMap rumorMessage);
     bool isValidBlockRequest(QVariantMap message);
     bool isValidBlockReply(QVariantMap message);
+    QByteArray getBlockReplyData(QVariantMap message);
+    bool isValidBlockBusy(QVariantMap message);
     bool isValidSearchRequest(QVariantMap message);
     bool isValidSearchReply(QVariantMap message);
+    bool isValidContentSummary(QVariantMap message);
+    bool isValidDhtMessage(QVariantMap message);
     bool isValidImageChunk(QVariantMap message);
     bool isValidImageCompResult(QVariantMap message);
 
@@ -2,15 +2,24 @@
 #include <QHostInfo>
 #include <time.h>
 #include <QDataStream>
+#include <QDir>
+#include <QDateTime>
+#include <QtAlgorithms>
+#include <QSet>
 #include <iostream>
 #include <sstream>
 
 #include "NetSocket.hh"
 
+// Key of a neighbor in the neighborsByAddress index
+static quint64 addressKey(QHostAddress ipAddress, quint16 port) {
+    return ((quint64) ipAddress.toIPv4Address() << 16) | port;
+}
+
 /* Constructor and binding application to a port
 ======================================================================================================================================================================*/
 
-NetSocket::NetSocket(bool noForward)
+NetSocket::NetSocket(bool noForward, bool contentDefinedChunking, bool relayCache)
 {
     // Pick a range of four UDP ports to try to allocate by default,
     // computed based on my Unix user ID.
@@ -23,6 +32,8 @@ NetSocket::NetSocket(bool noForward)
     myPortMax = myPortMin + 3;
 
     noForwardFlag = noForward;
+    contentDefinedChunkingFlag = contentDefinedChunking;
+    relayCacheFlag = relayCache;
 }
 
 bool NetSocket::bind()
@@ -36,8 +47,12 @@ bool NetSocket::bind()
 
             // setup neighbors list and their timers
             neighborsList = getLocalNeighborsList(myCurrentPort);
+            neighborsByAddress = new QHash<quint64, Peer*>();
             neighborTimers = new QMap<Peer*, QTimer*>();
             for (int idx = 0; idx < neighborsList->size(); idx++) {
+                Peer *neighbor = neighborsList->at(idx);
+                neighborsByAddress->insert(addressKey(neighbor->getIpAddress(), neighbor->getPort()), neighbor);
+
                 QTimer *timer = new QTimer(this);
                 timer->setSingleShot(true);
                 connect(timer,SIGNAL(timeout()),this,SLOT(onNeighborTimerTimeout()));
@@ -56,8 +71,20 @@ bool NetSocket::bind()
                     "-" + QString::number(randomIdentifier);
             //hostIdentifier = QHostInfo::localHostName().append(QString::number(p));
             messageManager = new MessageManager(hostIdentifier);
-
-            fileShareManager = new FileShareManager();
+            searchHistory = new SearchHistory();
+            uploadScheduler = new UploadScheduler(UPLOAD_RATE_LIMIT);
+            uploadTimer = new QTimer(this);
+            uploadTimer->setInterval(UPLOAD_INTERVAL);
+            connect(uploadTimer,SIGNAL(timeout()),this,SLOT(sendScheduledBlockReplies()));
+
+            // Persistent state (share index etc.) is kept per port, as several instances may run
+            QString stateDir = QDir::homePath() + "/" + STATE_DIR_NAME + "/" + QString::number(myCurrentPort);
+            fileShareManager = new FileShareManager(stateDir, contentDefinedChunkingFlag);
+            if (relayCacheFlag && !noForwardFlag) fileShareManager->enableRelayCache(RELAY_CACHE_SIZE);
+            blockReadsInFlight = new QHash<QByteArray, QList<UploadScheduler::UploadRequest> >();
+            connect(fileShareManager, SIGNAL(blockDataRead(QByteArray,QByteArray)),
+                    this, SLOT(gotBlockData(QByteArray,QByteArray)));
+            QTimer::singleShot(DOWNLOAD_RESUME_DELAY, this, SLOT(resumeDownloads()));
 
             // setup the router class
             router = new Router();
@@ -73,6 +100,18 @@ bool NetSocket::bind()
             // Periodically generate route rumor message to "announce" oneself
             setupPeriodicRouteRumors();
 
+            // Periodically resend block requests that got no reply
+            setupDownloadTimeouts();
+
+            // Budget expansion rounds of the searches started here
+            setupPeriodicSearchRequests();
+
+            // Tell neighbors what can be found through us, so searches are sent where the files are
+            setupContentSummaryExchange();
+
+            // Publish our files in the DHT and look up searches and file sources there too
+            setupDht();
+
             return true;
 
 
@@ -113,11 +152,75 @@ void NetSocket::startRumormongering() {
     if (neighbor != NULL) sendStatusMessage(statusMessage, neighbor);
 }
 
+void NetSocket::setupContentSummaryExchange() {
+
+    summaryRound = 0;
+    lastSentSummaryVersion = 0;
+
+    QTimer *timer = new QTimer(this);
+    connect(timer,SIGNAL(timeout()),this,SLOT(sendContentSummaries()));
+    timer->start(SUMMARY_EXCHANGE_INTERVAL);
+}
+
+/* Sends each neighbor our content summary when it changed .. and once in a while anyway,
+   for neighbors that joined or lost a datagram
+*/
+void NetSocket::sendContentSummaries() {
+
+    ContentSummary *contentSummary = fileShareManager->getContentSummary();
+    bool refresh = summaryRound++ % SUMMARY_REFRESH_ROUNDS == 0;
+    if (!refresh && contentSummary->getVersion() == lastSentSummaryVersion) return;
+    lastSentSummaryVersion = contentSummary->getVersion();
+
+    for (int i = 0; i < neighborsList->size(); i++) {
+        Peer *neighbor = neighborsList->at(i);
+        QVariantMap *summaryMessage = messageManager->createContentSummaryMessage(contentSummary->getSummaryFor(neighbor));
+        sendMessage(summaryMessage, neighbor);
+        delete summaryMessage;
+    }
+}
+
+void NetSocket::setupDht() {
+
+    dht = new Dht(hostIdentifier, neighborsList);
+    connect(dht, SIGNAL(sendMessage(QVariantMap,QHostAddress,quint16)),
+            this, SLOT(sendDhtMessage(QVariantMap,QHostAddress,quint16)));
+    connect(dht, SIGNAL(foundFiles(quint32,QVariantList)), this, SLOT(gotDhtFiles(quint32,QVariantList)));
+    connect(dht, SIGNAL(foundHolders(QByteArray,QStringList)), this, SLOT(gotDhtFileHolders(QByteArray,QStringList)));
+    connect(fileShareManager, SIGNAL(fileShared(QString,QByteArray)), this, SLOT(publishSharedFile(QString,QByteArray)));
+
+    // Files restored from the share index were shared before we got here
+    QList<QPair<QString, QByteArray> > sharedFiles = fileShareManager->getSharedFiles();
+    for (int i = 0; i < sharedFiles.size(); i++) {
+        dht->publishFile(sharedFiles.at(i).first, sharedFiles.at(i).second);
+    }
+}
+
+/* One timer drives every search .. it only runs while there are searches */
 void NetSocket::setupPeriodicSearchRequests() {
 
     searchRequestsTimer = new QTimer(this);
+    searchRequestsTimer->setInterval(SEARCH_INTERVAL);
     connect(searchRequestsTimer,SIGNAL(timeout()),this,SLOT(sendPeriodicSearchRequest()));
-    searchRequestsTimer->start(SEARCH_INTERVAL);
+}
+
+
+void NetSocket::setupDownloadTimeouts() {
+
+    QTimer *timer = new QTimer(this);
+    connect(timer,SIGNAL(timeout()),this,SLOT(checkDownloadTimeouts()));
+    timer->start(DOWNLOAD_TIMEOUT_CHECK_INTERVAL);
+}
+
+void NetSocket::checkDownloadTimeouts() {
+
+    QList<QPair<QString, QByteArray> > requestsToResend = fileShareManager->checkDownloadTimeouts();
+    if (requestsToResend.isEmpty()) return;
+
+    OngoingDownload::Stats stats = fileShareManager->getDownloadStats();
+    qDebug() << "Resending" << requestsToResend.size() << "block requests .. timeouts:" << stats.timeouts
+             << "retries:" << stats.retries << "stalled sources:" << stats.stalls;
+    sendBlockRequests(requestsToResend);
 }
 
 
@@ -126,14 +229,24 @@ void NetSocket::setupPeriodicSearchRequests() {
 
 void NetSocket::sendMessage(QVariantMap *messageMap, Peer *peer) {
 
+    sendMessage(messageMap, peer->getIpAddress(), peer->getPort());
+}
+
+void NetSocket::sendMessage(QVariantMap *messageMap, QHostAddress address, quint16 port) {
+
     // Serialize the Message map into a byte array
     QByteArray messageBytes;
-    QDataStream *messageStream = new QDataStream(&messageBytes, QIODevice::WriteOnly);
-    (*messageStream) << (*messageMap);
-    delete messageStream;
+    QDataStream messageStream(&messageBytes, QIODevice::WriteOnly);
+    messageStream << (*messageMap);
 
     // Send the message over the network to the destination port
-    writeDatagram(messageBytes, peer->getIpAddress(), peer->getPort());
+    writeDatagram(messageBytes, address, port);
+}
+
+/* DHT contacts are not neighbors: they are answered straight at their address */
+void NetSocket::sendDhtMessage(QVariantMap message, QHostAddress address, quint16 port) {
+
+    sendMessage(&message, address, port);
 }
 
 void NetSocket::sendRumorMessage(QVariantMap *messageMap, Peer *neighbor) {
@@ -173,14 +286,11 @@ void NetSocket::sendStatusMessage(QVariantMap *messageMap, Peer *neighbor) {
 
 void NetSocket::sendPrivateMessage(QString destination, QString message, quint32 hopLimit) {
 
-    QVariantMap *privateMessage = messageManager->createNewPrivateMessage(destination,message,hopLimit);
-    QPair<QHostAddress, quint16> *host = router->lookupOrigin(destination);
-
-    if (host != NULL) {
+    Peer *peer = router->lookupNextHop(destination);
 
-        Peer *peer = searchForPeer(host->first, host->second);
-        if(peer == NULL) return;        // shouldn't really happen but just for safety!
+    if (peer != NULL) {
 
+        QVariantMap *privateMessage = messageManager->createNewPrivateMessage(destination,message,hopLimit);
         sendMessage(privateMessage, peer);
     }
 }
@@ -192,12 +302,8 @@ void NetSocket::sendNewPrivateMessage(QString destination, QString message) {
 
 void NetSocket::sendFileRequestMessage(QVariantMap *message, Peer *peer) {
 
+    // Sent again from checkDownloadTimeouts() if no reply comes back in time
     sendMessage(message, peer);
-
-    // for now assuming that we always get a response
-
-    // TODO: wait for a block response message or timeout
-    //startNeighborsTimer(peer);
 }
 
 void NetSocket::sendBlockRequestMessage(QVariantMap *message, Peer *peer) {
@@ -205,44 +311,114 @@ void NetSocket::sendBlockRequestMessage(QVariantMap *message, Peer *peer) {
     sendMessage(message, peer);
 }
 
+/* Sends each (destination, block hash) request towards its destination through the forwarding table */
+void NetSocket::sendBlockRequests(QList<QPair<QString, QByteArray> > blockRequests) {
+
+    for (int i = 0; i < blockRequests.size(); i++) {
+
+        QString destination = blockRequests.at(i).first;
+        Peer *peer = router->lookupNextHop(destination);
+        if (peer == NULL) continue;     // no route .. the request will be considered lost
+
+        QVariantMap *newBlockRequest = messageManager->
+                createBlockRequestMessage(destination, HOP_LIMIT, blockRequests.at(i).second);
+        sendBlockRequestMessage(newBlockRequest, peer);
+        delete newBlockRequest;
+    }
+}
+
+/* Continues the downloads that were interrupted by the last shutdown */
+void NetSocket::resumeDownloads() {
+
+    sendBlockRequests(fileShareManager->resumeDownloads());
+}
+
 void NetSocket::sendBlockReplyMessage(QVariantMap *message, Peer *peer) {
 
     sendMessage(message, peer);
 }
 
+/* Neighbors to send a search to: first those whose content summary may have a match
+   (numMatching of them), closest match first, then the others in random order
+*/
+QList<Peer *> NetSocket::getSearchTargets(QString searchKeywords, int *numMatching) {
+
+    ContentSummary *contentSummary = fileShareManager->getContentSummary();
+    QStringList foldedKeywords = searchKeywords.toCaseFolded().split(" ", QString::SkipEmptyParts);
+
+    QList<QPair<int, int> > matches;        // < match level, neighbor index >
+    QList<Peer *> others;
+    for (int i = 0; i < neighborsList->size(); i++) {
+        int level = contentSummary->getMatchLevel(neighborsList->at(i), foldedKeywords);
+        if (level >= 0) {
+            matches.append(qMakePair(level, i));
+        } else {
+            others.insert(qrand() % (others.size() + 1), neighborsList->at(i));
+        }
+    }
+
+    qSort(matches);
+    QList<Peer *> targets;
+    for (int i = 0; i < matches.size(); i++) {
+        targets.append(neighborsList->at(matches.at(i).second));
+    }
+    *numMatching = targets.size();
+    return targets + others;
+}
+
+/* Splits the budget of the search request over the neighbors .. most of it goes to those likely
+   to lead to a match, the rest to the others: files more than SUMMARY_DEPTH hops away only show
+   up in no summary, and a false positive must not capture every search.
+   Other fields (search id) are kept as is
+*/
 void NetSocket::sendSearchRequestMessage(QVariantMap *message) {
 
-    QString origin = message->value("Origin").toString();
-    QString searchKeywords = message->value("Search").toString();
     quint32 budget = message->value("Budget").toUInt();
-    QVariantMap *newMessage;
+    int numMatching;
+    QList<Peer *> targets = getSearchTargets(message->value("Search").toString(), &numMatching);
+    if (targets.isEmpty()) return;
+
+    if (numMatching == 0 || numMatching == targets.size()) {
+        sendSearchWithBudget(*message, targets, budget);
+        return;
+    }
+
+    quint32 matchBudget = qMin(budget, qMax((quint32) 1, budget * SEARCH_MATCH_BUDGET_SHARE / 100));
+    sendSearchWithBudget(*message, targets.mid(0, numMatching), matchBudget);
+    sendSearchWithBudget(*message, targets.mid(numMatching), budget - matchBudget);
+}
+
+/* Splits budget evenly over targets, earlier targets getting the remainder */
+void NetSocket::sendSearchWithBudget(QVariantMap message, QList<Peer *> targets, quint32 budget) {
+
+    if (targets.isEmpty() || budget == 0) return;
 
     // Corner case of having more peers than budget
-    if ((int) budget <= neighborsList->length()) {
+    if ((int) budget <= targets.length()) {
 
-        newMessage = messageManager->createSearchRequestMessage(origin, searchKeywords, 1);
+        message.insert("Budget", (quint32) 1);
         for (int i = 0; i < (int) budget; i++) {
 
-            Peer *peer = neighborsList->at(i);
-            sendMessage(newMessage, peer);
+            Peer *peer = targets.at(i);
+            sendMessage(&message, peer);
         }
     } else {
 
-        int minBudgetPerPeer = budget / neighborsList->length();
-        int numPeersWithSurplusBudget = budget % neighborsList->length();
+        int minBudgetPerPeer = budget / targets.length();
+        int numPeersWithSurplusBudget = budget % targets.length();
 
-        newMessage = messageManager->createSearchRequestMessage(origin, searchKeywords, minBudgetPerPeer + 1);
+        message.insert("Budget", (quint32) minBudgetPerPeer + 1);
         for (int i = 0; i < numPeersWithSurplusBudget; i++) {
 
-            Peer *peer = neighborsList->at(i);
-            sendMessage(newMessage, peer);
+            Peer *peer = targets.at(i);
+            sendMessage(&message, peer);
         }
 
-        newMessage = messageManager->createSearchRequestMessage(origin, searchKeywords, minBudgetPerPeer);
-        for (int i = numPeersWithSurplusBudget; i < neighborsList->length(); i++) {
+        message.insert("Budget", (quint32) minBudgetPerPeer);
+        for (int i = numPeersWithSurplusBudget; i < targets.length(); i++) {
 
-            Peer *peer = neighborsList->at(i);
-            sendMessage(newMessage, peer);
+            Peer *peer = targets.at(i);
+            sendMessage(&message, peer);
         }
     }
 }
@@ -299,15 +475,22 @@ void NetSocket::addNewNeighbor(QString hostString) {
     Peer *newPeer = new Peer(hostString);
 
     // TODO: check if the peer already exists in the list!!
+    // (address may still be unresolved here, so it is indexed on first lookup instead)
     neighborsList->append(newPeer);
 }
 
 void NetSocket::addNewNeighbor(QString hostName, QHostAddress hostIp, quint16 hostPort) {
 
+    if (searchForPeer(hostIp, hostPort) != NULL) return;
+
     Peer *newPeer = new Peer(hostName, hostIp, hostPort);
+    appendNeighbor(newPeer);
+}
 
-    // TODO: check if the peer already exists in the list!!
-    neighborsList->append(newPeer);
+void NetSocket::appendNeighbor(Peer *peer) {
+
+    neighborsList->append(peer);
+    neighborsByAddress->insert(addressKey(peer->getIpAddress(), peer->getPort()), peer);
 }
 
 Peer *NetSocket::pickRandomNeighbor() {
@@ -346,7 +529,7 @@ bool NetSocket::areSameNeighbors(Peer *peer1, Peer *peer2) {
 
     //QString hostName1 = peer1->getHostName();
     QHostAddress ipAddr1 = peer1->getIpAddress();
-    quint16 port1 = peer2->getPort();
+    quint16 port1 = peer1->getPort();
 
     //QString hostName2 = peer2->getHostName();
     QHostAddress ipAddr2 = peer2->getIpAddress();
@@ -365,20 +548,27 @@ bool NetSocket::areSameNeighbors(Peer *peer1, Peer *peer2) {
 // Adds the neighbor if it doesn't already exist in the Neighbors list
 bool NetSocket::dynamicAddNeighbor(Peer *newPeer) {
 
-    for (int idx = 0; idx < neighborsList->size(); idx++) {
-        if (!areSameNeighbors(newPeer,neighborsList->value(idx))) {
-            neighborsList->append(newPeer);
-            return true;
-        }
-    }
-    return false;
+    if (searchForPeer(newPeer->getIpAddress(), newPeer->getPort()) != NULL) return false;
+
+    appendNeighbor(newPeer);
+    return true;
 }
 
 Peer *NetSocket::searchForPeer(QHostAddress ipAddress, quint16 port) {
 
+    // Fast path: neighbors are indexed by address
+    quint64 key = addressKey(ipAddress, port);
+    Peer *peer = neighborsByAddress->value(key);
+    if (peer != NULL && peer->getIpAddress() == ipAddress && peer->getPort() == port) {
+        return peer;
+    }
+
+    // Neighbors added by hostname only get their address once the lookup completes,
+    // so fall back to a scan and index whatever we find
     for (int idx = 0; idx < neighborsList->size(); idx++) {
-        Peer *peer = neighborsList->at(idx);
+        peer = neighborsList->at(idx);
         if (peer->getIpAddress() == ipAddress && peer->getPort() == port) {
+            neighborsByAddress->insert(key, peer);
             return peer;
         }
     }
@@ -414,6 +604,19 @@ void NetSocket::onNeighborTimerTimeout() {
 
 void NetSocket::readMessage() {
 
+    // Handle the datagrams already queued before replying, so that identical block requests
+    // arriving together are answered with a single read of the block
+    for (int i = 0; i < READ_BATCH_SIZE && hasPendingDatagrams(); i++) {
+        processDatagram();
+    }
+    sendScheduledBlockReplies();
+
+    // Under sustained load, let timers (download timeouts, DHT, uploads) run before the next batch
+    if (hasPendingDatagrams()) QTimer::singleShot(0, this, SLOT(readMessage()));
+}
+
+void NetSocket::processDatagram() {
+
     // Create data structures to hold incoming message bytes and sender's network info
     QByteArray messageBytes;
     messageBytes.resize(pendingDatagramSize());
@@ -429,12 +632,23 @@ void NetSocket::readMessage() {
     (*messageStream) >> messageMap;
     delete messageStream;
 
-    //QString hostName = QHostInfo::fromName(peerIp.toString()).hostName();
-    QString hostName = "";
-    Peer *sender = new Peer(hostName, senderIp, senderPort);
+    // DHT nodes talk to many nodes that are not our neighbors .. keep them out of the neighbors list
+    if (messageManager->isValidDhtMessage(messageMap)) {
+        dht->receivedMessage(messageMap, senderIp, senderPort);
+        return;
+    }
+
+    // Use the neighbor object we already hold for this address so that routes
+    // and timers refer to a single Peer per neighbor
+    Peer *sender = searchForPeer(senderIp, senderPort);
+    if (sender == NULL) {
 
-    // if we haven't seen the neighbor before, add to PeerList
-    dynamicAddNeighbor(sender);
+        // if we haven't seen the neighbor before, add to PeerList
+        //QString hostName = QHostInfo::fromName(peerIp.toString()).hostName();
+        QString hostName = "";
+        sender = new Peer(hostName, senderIp, senderPort);
+        appendNeighbor(sender);
+    }
 
     if (messageManager->isRouteRumorMessage(messageMap)) {
         // Message is route rumor message
@@ -477,6 +691,11 @@ void NetSocket::readMessage() {
 
         gotBlockReply(messageMap, sender);
 
+    } else if (messageManager->isValidBlockBusy(messageMap)) {
+        // Message is a block request refused for lack of upload capacity
+
+        gotBlockBusy(messageMap);
+
     } else if (messageManager->isValidSearchRequest(messageMap)) {
         // Message is of type Search Request
 
@@ -491,6 +710,11 @@ void NetSocket::readMessage() {
 
         gotSearchReply(messageMap);
 
+    } else if (messageManager->isValidContentSummary(messageMap)) {
+        // Message is a neighbor's content summary
+
+        fileShareManager->getContentSummary()->receivedSummary(sender, messageMap.value("Summary").toByteArray());
+
     } else if (messageManager->isValidImageChunk(messageMap)) {
         // Message is of type Image chunk
 
@@ -636,11 +860,10 @@ void NetSocket::gotPrivateMessage(QVariantMap messageMap) {
 
 void NetSocket::routeMessage(QVariantMap *message) {
 
-    // Find a peer in our routing table to forward the message to
-    QString origin = message->value("Origin").toString();
-    QPair<QHostAddress, quint16> *targetRouter = router->lookupOrigin(origin);
-    Peer *peer = searchForPeer(targetRouter->first, targetRouter->second);
-    if (peer == NULL) return;       // shouldn't really happen but just for safety!
+    // Find the next hop towards the destination in our forwarding table
+    QString destination = message->value("Dest").toString();
+    Peer *peer = router->lookupNextHop(destination);
+    if (peer == NULL) return;       // no route to the destination (yet)
 
     sendMessage(message, peer);
 }
@@ -651,72 +874,207 @@ void NetSocket::gotBlockRequest(QVariantMap message, Peer *sender) {
 
     if (destination == hostIdentifier) {    // Message intended for us
 
-        // Fetch block data for the request SHA key
-        QByteArray requestedBlockHash = message.value("BlockRequest").toByteArray();
-        QByteArray data = fileShareManager->fetchBlockData(requestedBlockHash);
+        // Answered with the other requests for the same block once the pending datagrams are read
+        queueBlockReply(message, sender, QByteArray());
 
-        if (!data.isEmpty()) {
+    } else if (message.value("HopLimit").toUInt() > 0 && !noForwardFlag) {
 
-            // Send the origin back the message with the data .. send it to sender who will forward it back
-            QString origin = message.value("Origin").toString();
-            QVariantMap *replyMessage = messageManager->createBlockReplyMessage(origin, HOP_LIMIT, requestedBlockHash, data);
-            sendBlockReplyMessage(replyMessage, sender);
+        // A block we relayed recently is answered here instead of crossing the same links again
+        QByteArray cachedData = fileShareManager->fetchRelayedBlock(message.value("BlockRequest").toByteArray());
+        if (!cachedData.isEmpty()) {
+            queueBlockReply(message, sender, cachedData);
+            return;
         }
 
-    } else if (message.value("HopLimit").toUInt() > 0 && !noForwardFlag) {
-
         // Forward the new message with decremented hop limit
-        QVariantMap *messageToForward = messageManager->decrementHopLimit(message);
-        routeMessage(messageToForward);
+        messageManager->decrementHopLimit(&message);
+        routeMessage(&message);
     }
 }
 
-void NetSocket::gotBlockReply(QVariantMap message, Peer *sender) {
+/* Data is given for blocks found in the relay cache, and read when the reply is sent otherwise.
+   The reply waits for its turn in the upload scheduler.
+*/
+void NetSocket::queueBlockReply(QVariantMap requestMessage, Peer *sender, QByteArray data) {
 
+    // Requests for blocks we don't have would only take queue slots and tokens from real ones
+    int cost = data.isEmpty() ? fileShareManager->getBlockLength(requestMessage.value("BlockRequest").toByteArray())
+                              : data.size();
+    if (cost < 0) return;
 
-    QString destination = message.value("Dest").toString();
-    if (destination == hostIdentifier) {        // Message intended for us
+    UploadScheduler::UploadRequest uploadRequest;
+    uploadRequest.request = requestMessage;
+    uploadRequest.sender = sender;
+    uploadRequest.data = data;
+    uploadRequest.cost = cost;
 
-        if (fileShareManager->isMetaFile(message)) {
-            // Message contains block list metafile
+    if (uploadScheduler->enqueue(requestMessage.value("Origin").toString(), uploadRequest)) return;
 
-            // Request for the first block
-            QByteArray firstBlockHash = fileShareManager->createOngoingDownload(message);
+    UploadScheduler::Stats stats = uploadScheduler->getStats();
+    if (stats.refused % UPLOAD_REPORT_INTERVAL == 1) {
+        qDebug() << "Upload queue full: refused =" << stats.refused << ", queued =" << stats.queued
+                 << ", sent bytes =" << stats.sentBytes;
+    }
 
-            if (!firstBlockHash.isEmpty()) {
-                // Send Block Request message for the first block (back to the sender??)
-                QString destination = message.value("Origin").toString();
-                QVariantMap *newBlockRequest = messageManager->
-                        createBlockRequestMessage(destination, HOP_LIMIT, firstBlockHash);
-                sendBlockRequestMessage(newBlockRequest, sender);
-            }
+    // Tell the requester when to ask again, in the name of the node it asked (as replies do)
+    QVariantMap *busyMessage = messageManager->createBlockBusyMessage(requestMessage.value("Origin").toString(), HOP_LIMIT,
+                                                                      requestMessage.value("BlockRequest").toByteArray(),
+                                                                      uploadScheduler->getRetryDelay());
+    busyMessage->insert("Origin", requestMessage.value("Dest"));
+    sendMessage(busyMessage, sender);
+    delete busyMessage;
+}
 
-        } else {
-            // Message contains file block data
-
-            QByteArray nextBlockHash = fileShareManager->receivedFileDataBlock(message);
-            if (!nextBlockHash.isEmpty()) {
-                // Send Block Request message for the next block
-                QString destination = message.value("Origin").toString();
-                QVariantMap *newBlockRequest = messageManager->
-                        createBlockRequestMessage(destination, HOP_LIMIT, nextBlockHash);
-                sendBlockRequestMessage(newBlockRequest, sender);
+/* Sends the block replies whose turn came .. and keeps going on a timer while some are held back */
+void NetSocket::sendScheduledBlockReplies() {
+
+    sendBlockReplies(uploadScheduler->takeReady(QDateTime::currentMSecsSinceEpoch()));
+
+    if (!uploadScheduler->hasQueuedRequests()) {
+        uploadTimer->stop();
+    } else if (!uploadTimer->isActive()) {
+        uploadTimer->start();
+    }
+}
+
+/* Single flight: each requested block is read (and compressed) once, however many requests for it
+   are answered together. The reply map holding the data is built once per encoding and only gets the
+   addresses of each requester, so the data itself is shared rather than copied for each of them.
+*/
+void NetSocket::sendBlockReplies(QList<UploadScheduler::UploadRequest> requests) {
+
+    // Requests for the same block, in the order the blocks first come up
+    QHash<QByteArray, QList<UploadScheduler::UploadRequest> > requestsByBlock;
+    QList<QByteArray> blockHashes;
+    for (int i = 0; i < requests.size(); i++) {
+        QByteArray blockHash = requests.at(i).request.value("BlockRequest").toByteArray();
+        if (!requestsByBlock.contains(blockHash)) blockHashes.append(blockHash);
+        requestsByBlock[blockHash].append(requests.at(i));
+    }
+
+    for (int i = 0; i < blockHashes.size(); i++) {
+
+        QByteArray blockHash = blockHashes.at(i);
+        QList<UploadScheduler::UploadRequest> blockRequests = requestsByBlock.value(blockHash);
+
+        QByteArray data;
+        for (int j = 0; j < blockRequests.size() && data.isEmpty(); j++) {
+            data = blockRequests.at(j).data;
+        }
+
+        // Blocks that must come from disk are answered once read .. along with any request for them meanwhile
+        bool pending = false;
+        if (data.isEmpty()) data = fileShareManager->fetchBlockDataAsync(blockHash, &pending);
+        if (pending) {
+            (*blockReadsInFlight)[blockHash].append(blockRequests);
+            continue;
+        }
+        if (!data.isEmpty()) sendBlockData(blockHash, data, blockRequests);
+    }
+}
+
+void NetSocket::gotBlockData(QByteArray blockHash, QByteArray data) {
+
+    QList<UploadScheduler::UploadRequest> blockRequests = blockReadsInFlight->take(blockHash);
+    if (!data.isEmpty()) sendBlockData(blockHash, data, blockRequests);
+}
+
+/* Replies to every request for a block */
+void NetSocket::sendBlockData(QByteArray blockHash, QByteArray data, QList<UploadScheduler::UploadRequest> blockRequests) {
+
+    QVariantMap *plainReply = messageManager->createBlockReplyMessage(QString(), HOP_LIMIT, blockHash, data);
+    QVariantMap *compressedReply = NULL;
+    QSet<QPair<QString, Peer *> > answered;
+
+    for (int j = 0; j < blockRequests.size(); j++) {
+
+        // A request sent again before we replied gets a single reply
+        QVariantMap request = blockRequests.at(j).request;
+        QPair<QString, Peer *> requester = qMakePair(request.value("Origin").toString(), blockRequests.at(j).sender);
+        if (answered.contains(requester)) continue;
+        answered.insert(requester);
+
+        // Compress the block if the requester can take it and it gets smaller
+        QVariantMap *replyMessage = plainReply;
+        if (request.value("Compress").toString() == BLOCK_COMPRESSION_CODEC) {
+            if (compressedReply == NULL) {
+                QByteArray compressedData = fileShareManager->fetchCompressedBlockData(blockHash, data);
+                compressedReply = compressedData.isEmpty() ? plainReply :
+                        messageManager->createBlockReplyMessage(QString(), HOP_LIMIT, blockHash, compressedData,
+                                                                BLOCK_COMPRESSION_CODEC);
             }
+            replyMessage = compressedReply;
         }
+
+        // Send the origin back the message with the data .. send it to sender who will forward it back.
+        // Relays answer in the name of the node that was asked, so the requester credits that source.
+        // The reply is checked against its hash either way.
+        replyMessage->insert("Dest", request.value("Origin"));
+        replyMessage->insert("Origin", request.value("Dest"));
+        sendBlockReplyMessage(replyMessage, blockRequests.at(j).sender);
+    }
+
+    if (compressedReply != plainReply) delete compressedReply;
+    delete plainReply;
+}
+
+void NetSocket::gotBlockReply(QVariantMap message, Peer *sender) {
+
+
+    QString destination = message.value("Dest").toString();
+    if (destination == hostIdentifier) {        // Message intended for us
+
+        // Message contains the block list metafile of a file we asked for, or file block data.
+        // Blocks travel compressed when that saves bytes .. hand over the original data
+        if (message.contains("Compress")) {
+            message.insert("Data", messageManager->getBlockReplyData(message));
+            message.remove("Compress");
+        }
+
+        // Send Block Request messages for the next blocks .. keeps the download windows full
+        sendBlockRequests(fileShareManager->receivedBlockReply(message));
     } else if (message.value("HopLimit").toUInt() > 0 && !noForwardFlag){
 
+        // Keep a copy of the block for later requests passing through us .. the reply was
+        // checked against its hash on arrival
+        fileShareManager->cacheRelayedBlock(message.value("BlockReply").toByteArray(),
+                                            messageManager->getBlockReplyData(message));
+
         // Forward the new message with decremented hop limit
-        QVariantMap *messageToForward = messageManager->decrementHopLimit(message);
-        routeMessage(messageToForward);
+        messageManager->decrementHopLimit(&message);
+        routeMessage(&message);
+    }
+}
+
+void NetSocket::gotBlockBusy(QVariantMap message) {
+
+    if (message.value("Dest").toString() == hostIdentifier) {
+
+        // The source is busy .. the block may go to another source meanwhile
+        sendBlockRequests(fileShareManager->receivedBlockBusy(message));
+
+    } else if (message.value("HopLimit").toUInt() > 0 && !noForwardFlag) {
+
+        messageManager->decrementHopLimit(&message);
+        routeMessage(&message);
     }
 }
 
 void NetSocket::gotSearchRequest(QVariantMap message, Peer *sender) {
 
-    // Search for files locally first and send reply if match(es) found
+    // Copies of a search we have seen already are only forwarded if they bring a bigger budget.
+    // Requests without a search id (older nodes) are told apart by their keywords.
+    QString origin = message.value("Origin").toString();
     QString keywords = message.value("Search").toString();
-    QList<SharedFile *> *localMatches = fileShareManager->searchForSharedFiles(keywords);
-    if (!localMatches->isEmpty()) {
+    QString searchKey = message.contains("SearchID") ? message.value("SearchID").toString() : keywords;
+    SearchHistory::SearchStatus status = searchHistory->record(origin, searchKey, message.value("Budget").toUInt(),
+                                                               QDateTime::currentMSecsSinceEpoch());
+    if (status == SearchHistory::Duplicate) return;
+
+    // Search for files locally first and send reply if match(es) found .. once per search
+    QList<SharedFile *> localMatches;
+    if (status == SearchHistory::NewSearch) localMatches = fileShareManager->searchForSharedFiles(keywords);
+    if (!localMatches.isEmpty()) {
         // Found local matches .. send Search Reply message back to sender
 
         QString destination = message.value("Origin").toString();
@@ -724,26 +1082,25 @@ void NetSocket::gotSearchRequest(QVariantMap message, Peer *sender) {
 
         QStringList matchedFileNames;
         QList<QByteArray> fileHashesArray;
-        for (int i = 0; i < localMatches->length(); i++) {
+        for (int i = 0; i < localMatches.length(); i++) {
 
-            SharedFile *matchedFile = localMatches->at(i);
+            SharedFile *matchedFile = localMatches.at(i);
             matchedFileNames.append(matchedFile->getFileName());
             fileHashesArray.append(matchedFile->getFileHash());
         }
 
         QVariantMap *searchReplyMessage = messageManager->
                 createSearchReplyMessage(destination, HOP_LIMIT, searchKeywords, matchedFileNames, fileHashesArray);
+        if (message.contains("SearchID")) searchReplyMessage->insert("SearchID", message.value("SearchID"));
         sendSearchReplyMessage(searchReplyMessage, sender);
+        delete searchReplyMessage;
     }
 
     // Decrement budget and forward if budget > 0
     if (message.value("Budget").toUInt() > 0 && !noForwardFlag) {
 
-        QString origin = message.value("Origin").toString();
-        QString keywords = message.value("Search").toString();
-        quint16 budget = message.value("Budget").toUInt() - 1;
-        QVariantMap *newMessage = messageManager->createSearchRequestMessage(origin, keywords, budget);
-        sendSearchRequestMessage(newMessage);
+        message.insert("Budget", message.value("Budget").toUInt() - 1);
+        sendSearchRequestMessage(&message);
     }
 }
 
@@ -755,37 +1112,52 @@ void NetSocket::gotSearchReply(QVariantMap message) {
         // Search reply intended for us
         //qDebug() << message.value("MatchIDs").toByteArray().toHex();
 
-        // Store searched file info for future downloads
-        fileShareManager->receivedSearchResultFiles(message);
+        // Store searched file info for future downloads .. the search stops expanding once it has enough results
+        QMap<QByteArray, QString> searchResultFiles = fileShareManager->receivedSearchResultFiles(message);
 
-        // Send list of filenames in Search reply to gui by emiting a signal
-        QVariantList filesList = message.value("MatchNames").toList();
-        QStringList fileNamesList;
-        for (int i = 0; i < filesList.length(); i++) {
-
-            // Get the last part of filename after slash from the absolute path
-            QStringList slashDelimFileName = filesList.at(i).toString().split("/");
-            QString fileName = slashDelimFileName.last();
-            fileNamesList.append(fileName);
-        }
-
-        // stop the search request timer if threshold number of matches have been received
-        if (fileShareManager->getNumberOfSearchHits() >= SEARCH_MATCH_THRESHOLD) {
-            searchRequestsTimer->stop();
-        }
-
-        emit receivedSearchResults(fileNamesList);
+        // Send the files new to their search to gui by emiting a signal
+        if (!searchResultFiles.isEmpty()) emit receivedSearchResults(searchResultFiles, message.value("Origin").toString());
 
 
     } else if (message.value("HopLimit").toUInt() > 0 && !noForwardFlag) {
         // Search reply not intended for us .. decrement hop limit and forward
 
         // Forward the new message with decremented hop limit
-        QVariantMap *messageToForward = messageManager->decrementHopLimit(message);
-        routeMessage(messageToForward);
+        messageManager->decrementHopLimit(&message);
+        routeMessage(&message);
     }
 }
 
+/* Files found in the DHT are handled like search replies from their holders */
+void NetSocket::gotDhtFiles(quint32 searchId, QVariantList records) {
+
+    for (int i = 0; i < records.size(); i++) {
+
+        QVariantMap record = records.at(i).toMap();
+        if (record.value("Holder").toString() == hostIdentifier) continue;
+
+        QVariantMap reply;
+        reply.insert("Origin", record.value("Holder"));
+        reply.insert("SearchID", searchId);
+        reply.insert("MatchNames", QVariantList() << record.value("Name"));
+        reply.insert("MatchIDs", QVariantList() << record.value("Hash"));
+        QMap<QByteArray, QString> searchResultFiles = fileShareManager->receivedSearchResultFiles(reply);
+        if (!searchResultFiles.isEmpty()) emit receivedSearchResults(searchResultFiles, record.value("Holder").toString());
+    }
+}
+
+void NetSocket::gotDhtFileHolders(QByteArray fileHash, QStringList holders) {
+
+    for (int i = 0; i < holders.size(); i++) {
+        if (holders.at(i) != hostIdentifier) fileShareManager->addFileSource(fileHash, holders.at(i));
+    }
+}
+
+void NetSocket::publishSharedFile(QString fileName, QByteArray fileHash) {
+
+    dht->publishFile(fileName, fileHash);
+}
+
 void NetSocket::gotImageChunk(QVariantMap message, Peer *sender) {
 
     // Read in the message
@@ -832,41 +1204,41 @@ void NetSocket::startFileDownload(QString targetId, QString fileHash) {
 
 }
 
-void NetSocket::startFileDownload(QString fileName) {
+/* Downloads a search result .. origin advertised it, others may have since its search ended */
+void NetSocket::startFileDownload(QString fileName, QByteArray fileHash, QString origin) {
 
     qDebug() << "Downloading" << fileName;
 
-    // Fetch destination and filehash to start file download
-    QString destination = fileShareManager->getDestinationForDownload(fileName);
-    QByteArray fileHash = fileShareManager->getFileHashForDownload(fileName);
-    createNewFileDownload(destination, fileHash, fileName);
+    // The metafile is fetched from the first source
+    QStringList sources = fileShareManager->getSourcesForDownload(fileHash);
+    if (sources.isEmpty()) sources.append(origin);
+    createNewFileDownload(sources.first(), fileHash, fileName);
 
 }
 
 void NetSocket::createNewFileDownload(QString destination, QByteArray fileHash, QString fileName) {
 
+    // Update data structure to keep track of file requests sent .. retried on timeout even without a route yet
+    if (!fileShareManager->newDownloadFileRequest(fileHash, fileName, destination)) return;
+
+    // More sources to fetch blocks from
+    dht->findHolders(fileHash);
+
     // Target id should be in our routing table
-    QPair<QHostAddress, quint16> *targetRouter = router->lookupOrigin(destination);
-    if (targetRouter == NULL) {
+    Peer *peer = router->lookupNextHop(destination);
+    if (peer == NULL) {
         qDebug() << "Cannot find a peer to forward download request";
     } else {
         qDebug() << "Forwarding download request message to " + destination;
 
-        // Get the peer to whom to send the block request message to
-        Peer *peer = searchForPeer(targetRouter->first, targetRouter->second);
-        if(peer == NULL) return;        // shouldn't really happen but just for safety!
-
         // Create a new block request message containing hash of file sought
 
         qDebug() << "Start file download for" << fileHash.toHex();
         QVariantMap *blockRequestMessage = messageManager->createBlockRequestMessage(destination, HOP_LIMIT, fileHash);
 
-        // Update data structure to keep track of file requests sent
-        fileShareManager->newDownloadFileRequest(fileHash, fileName);
-
         // Forward the message to be routed to the targetId
         sendFileRequestMessage(blockRequestMessage, peer);
-
+        delete blockRequestMessage;
     }
 }
 
@@ -875,29 +1247,35 @@ void NetSocket::createNewFileDownload(QString destination, QByteArray fileHash,
 
 void NetSocket::startNewFileSearch(QString searchKeywords) {
 
-    fileShareManager->startNewSearch(searchKeywords, SEARCH_BUDGET);
-    startFileSearch(searchKeywords, SEARCH_BUDGET);
-    setupPeriodicSearchRequests();
+    SearchQuery *search = fileShareManager->startNewSearch(searchKeywords, SEARCH_BUDGET);
+    dht->findFiles(search->getSearchId(), searchKeywords);
+
+    startFileSearch(search);
+    if (!searchRequestsTimer->isActive()) searchRequestsTimer->start();
 }
 
-void NetSocket::startFileSearch(QString searchKeywords, quint32 searchBudget) {
+/* Floods one round of the search with its current budget */
+void NetSocket::startFileSearch(SearchQuery *search) {
 
-    qDebug() << "Started searching for" << searchKeywords;
+    qDebug() << "Searching for" << search->getKeywords() << "with budget" << search->getBudget();
 
-    QVariantMap *searchRequestMessage = messageManager->createSearchRequestMessage(hostIdentifier, searchKeywords, searchBudget);
+    // Our own request coming back to us is a duplicate
+    searchHistory->record(hostIdentifier, QString::number(search->getSearchId()), search->getBudget(),
+                          QDateTime::currentMSecsSinceEpoch());
+
+    QVariantMap *searchRequestMessage = messageManager->createSearchRequestMessage(hostIdentifier, search->getKeywords(),
+                                                                                   search->getBudget(), search->getSearchId());
     sendSearchRequestMessage(searchRequestMessage);
+    delete searchRequestMessage;
 }
 
+/* Scheduler tick: sends the next round of every search that is due, and stops once no search is left */
 void NetSocket::sendPeriodicSearchRequest() {
 
-    quint32 newBudget = fileShareManager->getIncrementedSearchBudget();
-
-    // Stop the timer if budget exceeds limit
-    if (newBudget >= SEARCH_BUDGET_LIMIT) {
-        searchRequestsTimer->stop();
-    } else {
-
-        QString currentSearchKeywords = fileShareManager->getCurrentSearchKeywords();
-        startFileSearch(currentSearchKeywords, newBudget);
+    QList<SearchQuery *> dueSearches = fileShareManager->takeSearchRounds(QDateTime::currentMSecsSinceEpoch());
+    for (int i = 0; i < dueSearches.size(); i++) {
+        startFileSearch(dueSearches.at(i));
     }
+
+    if (!fileShareManager->hasActiveSearches()) searchRequestsTimer->stop();
 }
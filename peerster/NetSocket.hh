@@ -9,16 +9,24 @@
 #include "Peer.hh"
 #include "Router.hh"
 #include "ImageProcessor.hh"
+#include "SearchHistory.hh"
+#include "Dht.hh"
+#include "UploadScheduler.hh"
 
 #define NEIGHBOR_TIMER_DURATION (1000)
 #define START_RUMORMONGERING_INTERVAL (10000)
 #define ROUTE_RUMOR_MESSAGE_INTERVAL (60000)
-#define SEARCH_INTERVAL (1000)
+#define DOWNLOAD_TIMEOUT_CHECK_INTERVAL (250)    // ms
+#define DOWNLOAD_RESUME_DELAY (10000)   // ms, gives routes to the download sources time to come in
+#define READ_BATCH_SIZE (64)            // datagrams handled before timers and other events get a turn
+#define UPLOAD_INTERVAL (10)            // ms between two rounds of block replies held back by the upload scheduler
+#define UPLOAD_REPORT_INTERVAL (1000)   // refused block requests between two upload statistics reports
+
+#define STATE_DIR_NAME ".peerster"     // under the home directory, one subdirectory per port
 
 #define HOP_LIMIT (10)
 #define SEARCH_BUDGET (2)
-#define SEARCH_BUDGET_LIMIT (100)
-#define SEARCH_MATCH_THRESHOLD (10)
+#define SEARCH_MATCH_BUDGET_SHARE (75)  // percent of a search budget for neighbors whose summary matches
 
 
 class NetSocket : public QUdpSocket
@@ -26,7 +34,7 @@ class NetSocket : public QUdpSocket
 	Q_OBJECT
 
 public:
-    NetSocket(bool noForward);
+    NetSocket(bool noForward, bool contentDefinedChunking, bool relayCache);
 
 	// Bind this socket to a Peerster-specific default port.
 	bool bind();
@@ -34,8 +42,12 @@ public:
     void setupBackgroundTimer();
     void setupPeriodicRouteRumors();
     void setupPeriodicSearchRequests();
+    void setupContentSummaryExchange();
+    void setupDownloadTimeouts();
+    void setupDht();
 
     void sendMessage(QVariantMap *message, Peer *peer);
+    void sendMessage(QVariantMap *message, QHostAddress address, quint16 port);
 	void sendRumorMessage(QVariantMap *messageMap, Peer *neighbor);
     void sendRumorMessageToAllNeighbors(QVariantMap *messageMap);
 	void sendNewRumorMessage(QString message);
@@ -44,8 +56,14 @@ public:
     void sendNewPrivateMessage(QString destination, QString message);
     void sendFileRequestMessage(QVariantMap *message, Peer *peer);
     void sendBlockRequestMessage(QVariantMap *message, Peer *peer);
+    void sendBlockRequests(QList<QPair<QString, QByteArray> > blockRequests);
     void sendBlockReplyMessage(QVariantMap *message, Peer *peer);
+    void queueBlockReply(QVariantMap requestMessage, Peer *sender, QByteArray data);
+    void sendBlockReplies(QList<UploadScheduler::UploadRequest> requests);
+    void sendBlockData(QByteArray blockHash, QByteArray data, QList<UploadScheduler::UploadRequest> blockRequests);
     void sendSearchRequestMessage(QVariantMap *message);
+    void sendSearchWithBudget(QVariantMap message, QList<Peer *> targets, quint32 budget);
+    QList<Peer *> getSearchTargets(QString searchKeywords, int *numMatching);
     void sendSearchReplyMessage(QVariantMap *message, Peer *peer);
 
     QList<Peer*> *getLocalNeighborsList(int myPort);
@@ -56,31 +74,36 @@ public:
 	bool dynamicAddNeighbor(Peer *newPeer);
 	bool areSameNeighbors(Peer *peer1, Peer *peer2);
     Peer *searchForPeer(QHostAddress ipAddress, quint16 port);
+    void appendNeighbor(Peer *peer);
     void startNeighborsTimer(Peer *neighbor);
     bool stopNeighborsTimer(Peer *neighbor);
 
+    void processDatagram();
     void gotRumorMessage(QVariantMap messageMap, Peer *sender, bool isRouteRumor);
 	void gotStatusMessage(QVariantMap messageMap, Peer *sender);
     void gotPrivateMessage(QVariantMap messageMap);
     void routeMessage(QVariantMap *message);
     void gotBlockRequest(QVariantMap message, Peer *sender);
     void gotBlockReply(QVariantMap message, Peer *sender);
+    void gotBlockBusy(QVariantMap message);
     void gotSearchRequest(QVariantMap message, Peer *sender);
     void gotSearchReply(QVariantMap message);
     void gotImageChunk(QVariantMap message, Peer *sender);
     void gotImageCompResult(QVariantMap message);
 
     void startFileDownload(QString targetId, QString fileHash);
-    void startFileDownload(QString fileName);
+    void startFileDownload(QString fileName, QByteArray fileHash, QString origin);
     void createNewFileDownload(QString destination, QByteArray fileHash, QString fileName);
 
     void startNewFileSearch(QString searchKeywords);
-    void startFileSearch(QString searchKeywords, quint32 searchBudget);
+    void startFileSearch(SearchQuery *search);
 
 
     QString hostIdentifier;
     Router *router;
     bool noForwardFlag;
+    bool contentDefinedChunkingFlag;       // split shared files into content-defined blocks
+    bool relayCacheFlag;                    // keep blocks we forward and answer requests for them
     FileShareManager *fileShareManager;
     ImageProcessor *imageProcessor;         // For distributed image matching
 
@@ -89,8 +112,16 @@ private:
 	MessageManager *messageManager;
 	int myCurrentPort;
 	QList<Peer*> *neighborsList;
+    QHash<quint64, Peer*> *neighborsByAddress;   // < ipv4 address and port, neighbor >
     QMap<Peer*,QTimer*> *neighborTimers;	// when waiting for a status message from the neighbor
-    QTimer *searchRequestsTimer;
+    QTimer *searchRequestsTimer;            // drives the budget expansion rounds of every search
+    SearchHistory *searchHistory;           // searches seen recently, to answer and forward each once
+    Dht *dht;                               // keyword and file holder lookups without flooding
+    UploadScheduler *uploadScheduler;       // shares the uplink fairly between the nodes downloading from us
+    QTimer *uploadTimer;                    // runs while block replies are held back
+    QHash<QByteArray, QList<UploadScheduler::UploadRequest> > *blockReadsInFlight;  // < block hash, requests waiting for the disk >
+    int summaryRound;
+    quint32 lastSentSummaryVersion;
 
 public slots:
 	void readMessage();
@@ -99,11 +130,20 @@ public slots:
 	void startRumormongering();
     void sendRouteRumorMessage();
     void sendPeriodicSearchRequest();
+    void sendContentSummaries();
+    void resumeDownloads();
+    void checkDownloadTimeouts();
+    void sendScheduledBlockReplies();
+    void gotBlockData(QByteArray blockHash, QByteArray data);
+    void sendDhtMessage(QVariantMap message, QHostAddress address, quint16 port);
+    void publishSharedFile(QString fileName, QByteArray fileHash);
+    void gotDhtFiles(quint32 searchId, QVariantList records);
+    void gotDhtFileHolders(QByteArray fileHash, QStringList holders);
     void sendImageChunkToPeer(QPair<QVector<uint>*, QVector<uint>* >* imageChunk, int idx, Peer *peer);
 
 signals:
 	void receivedMessage(QString message);
-    void receivedSearchResults(QStringList searchResultFiles);
+    void receivedSearchResults(QMap<QByteArray, QString> searchResultFiles, QString origin);
 
 };
 
@@ -1,72 +1,1069 @@
 #include "OngoingDownload.hh"
+#include "FileShareManager.hh"
+#include "FileHasher.hh"
+#include "HashTree.hh"
 
 #include <QDebug>
 #include <QFile>
 #include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QtAlgorithms>
+#include <QDataStream>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
 
-OngoingDownload::OngoingDownload(QString saveFileDir, QString fileName, int fileSize, QList<QByteArray> *blocks) {
+OngoingDownload::OngoingDownload(QString saveFileDir, QString fileName, QByteArray fileHash, QByteArray metaFile,
+                                 QStringList sources, QBitArray writtenBlocks) {
 
     this->saveFileDir = saveFileDir;
     this->fileName = fileName;
-    this->fileSize = fileSize;
-    this->pendingBlockRequests = blocks;
-    this->data = new QList<QByteArray>();
+    this->fileHash = fileHash;
+    this->metaFile = metaFile;
+
+    // The metafile was checked by the caller
+    int height;
+    QByteArray childHashes;
+    HashTree::parseMetaFile(metaFile, &height, &fileSize, &numBlocks, &contentDefined, &childHashes);
+
+    // Grown as tree nodes make blocks known
+    blockHashes = new QVector<QByteArray>();
+    blockLengths = new QVector<int>();
+    pendingBlocks = new QMultiHash<QByteArray, int>();
+    pendingNodes = new QMultiHash<QByteArray, TreeNode>();
+    receivedNodes = new QHash<QByteArray, QByteArray>();
+    availableBlocks = new QHash<QByteArray, int>();
+    nodesToRequest = new QList<QByteArray>();
+    nextBlockToRequest = 0;
+
+    // Blocks written in an earlier run are not fetched again if they check out
+    bool resuming = !writtenBlocks.isEmpty();
+    receivedBlocks = new QBitArray();
+    this->writtenBlocks = new QBitArray(writtenBlocks);
+    blocksToVerify = new QList<int>();
+    verifyingBlocks = new QHash<quint64, QList<int> >();
+    numVerifying = 0;
+
+    QString downloadFolder = saveFileDir + "/" + DOWNLOAD_FOLDER_NAME;
+    downloadFilePath = downloadFolder + "/" + fileName;
+    partialFile = new QFile(downloadFilePath + PARTIAL_FILE_SUFFIX);
+    dirtyBlocks = new QMap<qint64, QByteArray>();
+    dirtyBytes = 0;
+    blockIO = NULL;
+    writingBlocks = new QMap<qint64, QByteArray>();
+    writingBytes = 0;
+    writesInFlight = new QHash<quint64, QList<qint64> >();
+    writeFailures = 0;
+    finishing = false;
+    bool opened = openPartialFile(resuming);
+    stateFile = new QFile(partialFile->fileName() + DOWNLOAD_STATE_SUFFIX);
+    stateBitmapOffset = -1;
+
+    // The metafile is the top node: block hashes for a small file, tree nodes for a big one
+    expandNode(childHashes, height, 0);
+
+    this->sources = new QList<DownloadSource>();
+    for (int i = 0; i < sources.size(); i++) {
+        addSource(sources.at(i));
+    }
+    if (opened) saveState();
+
+    lostRequests = new QList<QByteArray>();
+    localReads = new QSet<QByteArray>();
+    outstandingRequests = new QMultiHash<QByteArray, OutstandingRequest>();
+
+    stats.timeouts = 0;
+    stats.retries = 0;
+    stats.stalls = 0;
+}
+
+OngoingDownload::~OngoingDownload() {
+
+    // Keep what we have so far if the download is given up before it completes
+    if (partialFile->isOpen()) flushDirtyBlocks();
+
+    delete blockHashes;
+    delete blockLengths;
+    delete pendingBlocks;
+    delete pendingNodes;
+    delete receivedNodes;
+    delete availableBlocks;
+    delete nodesToRequest;
+    delete partialFile;
+    delete dirtyBlocks;
+    delete writingBlocks;
+    delete writesInFlight;
+    delete receivedBlocks;
+    delete writtenBlocks;
+    delete blocksToVerify;
+    delete verifyingBlocks;
+    delete stateFile;
+    delete sources;
+    delete lostRequests;
+    delete localReads;
+    delete outstandingRequests;
+}
+
+/* Makes the children of a hash tree node (or of a flat metafile) known. The children of a level 1
+   node are data blocks: they are fetched, unless they were already written before a restart
+   (those are verified first). Other children are tree nodes to request. Returns the hashes newly expected.
+*/
+QList<QByteArray> OngoingDownload::expandNode(QByteArray nodeData, int level, int firstBlock) {
+
+    QList<QByteArray> newHashes;
+    QList<int> childBlocks;
+    qint64 blocksPerChild = HashTree::getBlocksUnderNode(level - 1, contentDefined);
+    int entrySize = level == 1 ? HashTree::getBlockEntrySize(contentDefined) : HASH_NUM_BYTES;
+
+    if (level == 1) growBlockState(qMin((qint64) numBlocks, firstBlock + (qint64) nodeData.length() / entrySize));
+
+    for (int i = 0; (i + 1) * entrySize <= nodeData.length(); i++) {
+
+        qint64 childFirstBlock = firstBlock + i * blocksPerChild;
+        if (childFirstBlock >= numBlocks) break;        // more hashes than blocks .. ignore them
+        QByteArray childHash = nodeData.mid(i * entrySize, HASH_NUM_BYTES);
+
+        if (level == 1) {
+            (*blockHashes)[childFirstBlock] = childHash;
+            if (contentDefined) {
+                const uchar *length = (const uchar *) nodeData.constData() + i * entrySize + HASH_NUM_BYTES;
+                (*blockLengths)[childFirstBlock] = qBound(1, (length[0] << 8) | length[1], BLOCK_SIZE);
+            }
+            childBlocks.append(childFirstBlock);
+            continue;
+        }
+
+        // Identical nodes are requested once and expanded at every position
+        if (!isPending(childHash)) {
+            newHashes.append(childHash);
+            nodesToRequest->append(childHash);
+        }
+        TreeNode node;
+        node.level = level - 1;
+        node.firstBlock = childFirstBlock;
+        pendingNodes->insert(childHash, node);
+    }
+
+    for (int i = 0; i < childBlocks.size(); i++) {
+
+        // Blocks written before a restart are checked in the background now that their hash is known
+        int blockIdx = childBlocks.at(i);
+        if (writtenBlocks->testBit(blockIdx) && partialFile->isOpen()) {
+            blocksToVerify->append(blockIdx);
+            continue;
+        }
+        writtenBlocks->clearBit(blockIdx);
+        if (receivedBlocks->testBit(blockIdx)) continue;
+
+        QByteArray blockHash = blockHashes->at(blockIdx);
+        if (!isPending(blockHash)) newHashes.append(blockHash);
+        pendingBlocks->insert(blockHash, blockIdx);
+    }
+
+    return newHashes;
+}
+
+bool OngoingDownload::hasBlocksToVerify() {
+    return !blocksToVerify->isEmpty();
+}
+
+/* Hands the blocks waiting to be verified to a task reading them from the partial file */
+BlockVerifier *OngoingDownload::startVerifying(quint64 verifyId) {
+
+    // Every block sits in its own BLOCK_SIZE slot until the download completes
+    QList<qint64> offsets;
+    QList<int> lengths;
+    for (int i = 0; i < blocksToVerify->size(); i++) {
+        offsets.append((qint64) blocksToVerify->at(i) * BLOCK_SIZE);
+        lengths.append(blockLengths->at(blocksToVerify->at(i)));
+    }
+
+    verifyingBlocks->insert(verifyId, *blocksToVerify);
+    numVerifying += blocksToVerify->size();
+    blocksToVerify->clear();
+
+    return new BlockVerifier(verifyId, dup(partialFile->handle()), offsets, lengths);
+}
+
+/* Called with the hashes a BlockVerifier found. Blocks matching their expected hash are kept,
+   the others are fetched again. Returns the hashes this made expected, the verified ones go in verifiedHashes.
+*/
+QList<QByteArray> OngoingDownload::verifyFinished(quint64 verifyId, QByteArray hashes, QList<QByteArray> *verifiedHashes) {
+
+    QList<QByteArray> newHashes;
+    if (!verifyingBlocks->contains(verifyId)) return newHashes;
+
+    QList<int> blockIndices = verifyingBlocks->take(verifyId);
+    numVerifying -= blockIndices.size();
+
+    for (int i = 0; i < blockIndices.size(); i++) {
+
+        int blockIdx = blockIndices.at(i);
+        QByteArray blockHash = blockHashes->at(blockIdx);
+        writtenBlocks->clearBit(blockIdx);
+
+        if (hashes.mid(i * HASH_NUM_BYTES, HASH_NUM_BYTES) == blockHash) {
+            receivedBlocks->setBit(blockIdx);
+            availableBlocks->insert(blockHash, blockIdx);
+            verifiedHashes->append(blockHash);
+            continue;
+        }
+
+        // Requested in file order like any other block
+        if (!isPending(blockHash)) newHashes.append(blockHash);
+        pendingBlocks->insert(blockHash, blockIdx);
+        nextBlockToRequest = qMin(nextBlockToRequest, blockIdx);
+    }
+
+    return newHashes;
+}
+
+bool OngoingDownload::isPending(QByteArray hash) {
+    return pendingBlocks->contains(hash) || pendingNodes->contains(hash);
+}
+
+/* Adds another origin that advertised this file .. it is used from the next round of requests */
+void OngoingDownload::addSource(QString origin) {
+
+    if (findSource(origin) >= 0) return;
+
+    DownloadSource source;
+    source.origin = origin;
+    source.window = DOWNLOAD_INITIAL_WINDOW;
+    source.slowStartThreshold = DOWNLOAD_MAX_WINDOW;
+    source.smoothedRtt = -1;
+    source.rttVariance = 0;
+    source.outstanding = 0;
+    source.backoff = 1;
+    source.consecutiveTimeouts = 0;
+    source.busyUntil = 0;
+    sources->append(source);
+}
+
+QByteArray OngoingDownload::getFileHash() {
+    return fileHash;
+}
+
+OngoingDownload::Stats OngoingDownload::getStats() {
+    return stats;
+}
+
+int OngoingDownload::findSource(QString origin) {
+
+    for (int i = 0; i < sources->size(); i++) {
+        if (sources->at(i).origin == origin) return i;
+    }
+    return -1;
+}
+
+bool OngoingDownload::isOutstandingAt(QByteArray blockHash, int sourceIdx) {
+
+    QMultiHash<QByteArray, OutstandingRequest>::const_iterator it = outstandingRequests->constFind(blockHash);
+    for (; it != outstandingRequests->constEnd() && it.key() == blockHash; ++it) {
+        if (it.value().sourceIdx == sourceIdx) return true;
+    }
+    return false;
+}
+
+/* Next block for the given source to request: lost requests first, then hash tree nodes,
+   then blocks never requested in file order, and in endgame a block still outstanding at
+   another source.
+   Returns an empty array if there is nothing (useful) left to ask this source for.
+*/
+QByteArray OngoingDownload::pickBlockFor(int sourceIdx, bool *retransmission) {
+
+    *retransmission = true;
+    while (!lostRequests->isEmpty()) {
+        QByteArray blockHash = lostRequests->takeFirst();
+        if (isPending(blockHash) && !localReads->contains(blockHash)) return blockHash;  // unless it arrived late after all
+    }
+
+    *retransmission = false;
+
+    // The blocks below a node can't be asked for before it arrives
+    while (!nodesToRequest->isEmpty()) {
+        QByteArray nodeHash = nodesToRequest->takeFirst();
+        if (pendingNodes->contains(nodeHash) && !outstandingRequests->contains(nodeHash)) return nodeHash;
+    }
+
+    while (nextBlockToRequest < numBlocks) {
+        QByteArray blockHash = nextBlockToRequest < blockHashes->size() ? blockHashes->at(nextBlockToRequest) : QByteArray();
+        if (blockHash.isEmpty()) return QByteArray();   // waiting for its tree node
+        nextBlockToRequest++;
+
+        // Identical blocks are only requested once
+        if (pendingBlocks->contains(blockHash) && !outstandingRequests->contains(blockHash) &&
+                !localReads->contains(blockHash)) return blockHash;
+    }
+
+    *retransmission = true;
+
+    // Endgame: duplicate the oldest request that this source isn't already serving
+    QByteArray oldestBlockHash;
+    qint64 oldestRequestTime = 0;
+    QMultiHash<QByteArray, OutstandingRequest>::const_iterator it;
+    for (it = outstandingRequests->constBegin(); it != outstandingRequests->constEnd(); ++it) {
+
+        if (it.value().sourceIdx == sourceIdx || isOutstandingAt(it.key(), sourceIdx)) continue;
+        if (oldestBlockHash.isEmpty() || it.value().requestTime < oldestRequestTime) {
+            oldestBlockHash = it.key();
+            oldestRequestTime = it.value().requestTime;
+        }
+    }
+    return oldestBlockHash;
 }
 
-QByteArray OngoingDownload::getNextBlockToRequest() {
+/* Indices of sources sorted by estimated throughput (window / round trip time), fastest first */
+QList<int> OngoingDownload::getSourcesByThroughput() {
+
+    QList<QPair<double, int> > ranked;
+    for (int i = 0; i < sources->size(); i++) {
+        const DownloadSource &source = sources->at(i);
+        double rtt = source.smoothedRtt > 0 ? source.smoothedRtt : DOWNLOAD_INITIAL_RTO;
+        ranked.append(qMakePair(-source.window / rtt, i));
+    }
+    qSort(ranked);
 
-    // Returns the first block from pendingBlockRequests
-    return pendingBlockRequests->at(0);
+    QList<int> sourceIndices;
+    for (int i = 0; i < ranked.size(); i++) {
+        sourceIndices.append(ranked.at(i).second);
+    }
+    return sourceIndices;
 }
 
-bool OngoingDownload::blockBelongsToFile(QByteArray blockHash) {
+/* Returns the (source origin, block hash) requests to send now so that every source's window is full.
+   Fastest sources are served first so they get the lost and remaining blocks. A stalled source
+   only gets a single request, to find out when it answers again.
+*/
+QList<QPair<QString, QByteArray> > OngoingDownload::takeBlocksToRequest() {
+
+    QList<QPair<QString, QByteArray> > blocksToRequest;
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    // The disk is behind the network .. let it catch up before more blocks come in
+    if (writingBytes >= DOWNLOAD_DIRTY_BUFFER_LIMIT) return blocksToRequest;
+
+    QList<int> sourceIndices = getSourcesByThroughput();
+    for (int i = 0; i < sourceIndices.size(); i++) {
+
+        int sourceIdx = sourceIndices.at(i);
+        DownloadSource &source = (*sources)[sourceIdx];
+        if (source.busyUntil > now) continue;
+        int window = source.consecutiveTimeouts >= DOWNLOAD_FAILOVER_TIMEOUTS ? 1 : (int) source.window;
+
+        while (source.outstanding < window) {
+
+            bool retransmission;
+            QByteArray blockHash = pickBlockFor(sourceIdx, &retransmission);
+            if (blockHash.isEmpty()) break;
+
+            OutstandingRequest request;
+            request.sourceIdx = sourceIdx;
+            request.requestTime = now;
+            request.deadline = now + getRetransmissionTimeout(source);
+            request.retransmitted = retransmission;
+            outstandingRequests->insert(blockHash, request);
+            source.outstanding++;
+            if (retransmission) stats.retries++;
+
+            blocksToRequest.append(qMakePair(source.origin, blockHash));
+        }
+    }
+
+    return blocksToRequest;
+}
 
-    // Checks if the block given is at the top of the pendingBlockRequests stack
-    return (blockHash == pendingBlockRequests->at(0));
+/* Hashes of the blocks and tree nodes we still need, each listed once */
+QList<QByteArray> OngoingDownload::getPendingBlockHashes() {
+    return pendingBlocks->uniqueKeys() + pendingNodes->uniqueKeys();
 }
 
+/* Blocks still being verified count as pending: they may have to be fetched */
 int OngoingDownload::getNumberOfPendingBlocks() {
-    return pendingBlockRequests->length();
+    return pendingBlocks->size() + pendingNodes->size() + blocksToVerify->size() + numVerifying;
 }
 
-void OngoingDownload::receivedBlock(QVariantMap blockReplyMessage) {
+/* Stores a received block or expands a received tree node. Returns the hashes that this made expected */
+QList<QByteArray> OngoingDownload::receivedBlock(QVariantMap blockReplyMessage) {
 
-    // Confirm that this is the block we needed
     QByteArray blockHash = blockReplyMessage.value("BlockReply").toByteArray();
-    if (blockHash == pendingBlockRequests->at(0)) {
+    QByteArray blockData = blockReplyMessage.value("Data").toByteArray();
+    QList<QByteArray> newHashes;
+
+    if (pendingNodes->contains(blockHash)) {
+
+        // Hash tree node .. its hash was in its parent so its children can be trusted
+        QList<TreeNode> nodes = pendingNodes->values(blockHash);
+        pendingNodes->remove(blockHash);
+        receivedNodes->insert(blockHash, blockData);
+        for (int i = 0; i < nodes.size(); i++) {
+            newHashes.append(expandNode(blockData, nodes.at(i).level, nodes.at(i).firstBlock));
+        }
 
-        // Pop out the block from the pendingBlockRequests since it has been received
-        pendingBlockRequests->removeFirst();
+    } else {
 
-        // Write data to data array .. append only
-        QByteArray blockData = blockReplyMessage.value("Data").toByteArray();
-        data->append(blockData);
+        // Confirm that this is a block we needed
+        QList<int> blockIndices = pendingBlocks->values(blockHash);
+        if (blockIndices.isEmpty()) return newHashes;
+
+        // Queue data for the position(s) of the block .. replies may come in any order
+        availableBlocks->insert(blockHash, blockIndices.first());
+        for (int i = 0; i < blockIndices.size(); i++) {
+            int blockIdx = blockIndices.at(i);
+            dirtyBlocks->insert((qint64) blockIdx * BLOCK_SIZE, blockData);
+            dirtyBytes += blockData.size();
+            (*blockLengths)[blockIdx] = blockData.size();
+
+            // The last fixed size block tells us the exact file size
+            if (!contentDefined && blockIdx == numBlocks - 1) {
+                fileSize = (qint64) blockIdx * BLOCK_SIZE + blockData.size();
+            }
+        }
+        pendingBlocks->remove(blockHash);
+
+        if (dirtyBytes >= DOWNLOAD_DIRTY_BUFFER_LIMIT && blockIO == NULL) flushDirtyBlocks();
     }
 
+    requestAnswered(blockHash, blockReplyMessage.value("Origin").toString());
+    return newHashes;
 }
 
-void OngoingDownload::dumpDataToFile() {
+/* Drops every request for the block, including endgame duplicates at other sources, and
+   updates the round trip estimate and window of the source that answered
+*/
+void OngoingDownload::requestAnswered(QByteArray blockHash, QString origin) {
+
+    int sourceIdx = findSource(origin);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 answeredRequestTime = -1;
+    bool retransmitted = true;
 
-    QString downloadFolder = saveFileDir + "/" + "Peerster_Downloads";
-    QDir().mkpath(downloadFolder);
-//    if(!QDir(saveFileDir).exists()) {
-//        // Create the download folder if it does not exist
-//        QDir().mkdir(downloadFolder);
-//    }
+    QMultiHash<QByteArray, OutstandingRequest>::iterator it = outstandingRequests->find(blockHash);
+    while (it != outstandingRequests->end() && it.key() == blockHash) {
 
-    QString downloadFileFullPath = downloadFolder + "/" + fileName;
-    qDebug() << "Downloading file complete. Dumping to file" << downloadFileFullPath;
+        OutstandingRequest request = it.value();
+        (*sources)[request.sourceIdx].outstanding--;
+        if (request.sourceIdx == sourceIdx) {
+            answeredRequestTime = request.requestTime;
+            retransmitted = request.retransmitted;
+        }
+        it = outstandingRequests->erase(it);
+    }
+
+    // Update round trip estimate and window of the source that answered
+    if (sourceIdx < 0 || answeredRequestTime < 0) return;
+    DownloadSource &source = (*sources)[sourceIdx];
 
-    QFile file(downloadFileFullPath);
-    file.open(QIODevice::WriteOnly);
+    // The source is answering .. forget about earlier timeouts
+    if (source.consecutiveTimeouts >= DOWNLOAD_FAILOVER_TIMEOUTS) {
+        qDebug() << source.origin << "is answering block requests for" << fileName << "again";
+    }
+    source.backoff = 1;
+    source.consecutiveTimeouts = 0;
 
-    for (int i = 0; i < data->length(); i++) {
+    if (!retransmitted) updateRtt(source, now - answeredRequestTime);
+    detectLostRequests(sourceIdx, answeredRequestTime, now);
 
-        int len = data->at(i).length();
-        const char *buffer = data->at(i).data();
-        file.write(buffer, len);
+    if (source.window < source.slowStartThreshold) {
+        source.window += 1;
+    } else {
+        source.window += 1 / source.window;
     }
+    if (source.window > DOWNLOAD_MAX_WINDOW) source.window = DOWNLOAD_MAX_WINDOW;
+}
+
+qint64 OngoingDownload::getRetransmissionTimeout(const DownloadSource &source) {
+
+    qint64 rto = DOWNLOAD_INITIAL_RTO;
+    if (source.smoothedRtt >= 0) {
+        rto = qMax((qint64) (source.smoothedRtt + 4 * source.rttVariance), (qint64) DOWNLOAD_MIN_RTO);
+    }
+    return qMin(rto * source.backoff, (qint64) DOWNLOAD_MAX_RTO);
+}
+
+/* Called periodically: requests past their deadline are queued to be sent again and each
+   source that let one expire backs off. Returns the requests to send now (if any).
+*/
+QList<QPair<QString, QByteArray> > OngoingDownload::checkTimeouts(qint64 now) {
+
+    QSet<int> timedOutSources;
+
+    QMultiHash<QByteArray, OutstandingRequest>::iterator it = outstandingRequests->begin();
+    while (it != outstandingRequests->end()) {
+
+        if (it.value().deadline > now) {
+            ++it;
+            continue;
+        }
+
+        QByteArray blockHash = it.key();
+        (*sources)[it.value().sourceIdx].outstanding--;
+        timedOutSources.insert(it.value().sourceIdx);
+        stats.timeouts++;
+        it = outstandingRequests->erase(it);
+
+        // Endgame duplicates may still be answered by another source
+        if (!outstandingRequests->contains(blockHash) && !lostRequests->contains(blockHash)) {
+            lostRequests->append(blockHash);
+        }
+    }
+
+    // Sources that were busy take requests again
+    bool sourceAvailable = false;
+    for (int i = 0; i < sources->size(); i++) {
+        if ((*sources)[i].busyUntil > 0 && (*sources)[i].busyUntil <= now) {
+            (*sources)[i].busyUntil = 0;
+            sourceAvailable = true;
+        }
+    }
+
+    if (timedOutSources.isEmpty() && !sourceAvailable) return QList<QPair<QString, QByteArray> >();
+
+    QSet<int>::const_iterator sourceIt;
+    for (sourceIt = timedOutSources.constBegin(); sourceIt != timedOutSources.constEnd(); ++sourceIt) {
+
+        DownloadSource &source = (*sources)[*sourceIt];
+        source.slowStartThreshold = qMax(source.window / 2, 2.0);
+        source.window = 1;
+        source.backoff = qMin(source.backoff * 2, DOWNLOAD_MAX_BACKOFF);
+
+        if (++source.consecutiveTimeouts == DOWNLOAD_FAILOVER_TIMEOUTS) {
+            stats.stalls++;
+            qDebug() << source.origin << "stopped answering block requests for" << fileName
+                     << ".. moving its blocks to other sources";
+        }
+    }
+
+    return takeBlocksToRequest();
+}
+
+/* The source refused a request for lack of upload capacity and asked us to wait retryAfter ms.
+   Its window halves as on a loss (without the timeout backoff) and the block goes to whichever
+   source is free first.
+*/
+void OngoingDownload::retryLater(QByteArray blockHash, QString origin, qint64 retryAfter) {
+
+    int sourceIdx = findSource(origin);
+    if (sourceIdx < 0) return;
+
+    QMultiHash<QByteArray, OutstandingRequest>::iterator it = outstandingRequests->find(blockHash);
+    while (it != outstandingRequests->end() && it.key() == blockHash && it.value().sourceIdx != sourceIdx) ++it;
+    if (it == outstandingRequests->end() || it.key() != blockHash) return;
+    outstandingRequests->erase(it);
+
+    DownloadSource &source = (*sources)[sourceIdx];
+    source.outstanding--;
+    source.slowStartThreshold = qMax(source.window / 2, 2.0);
+    source.window = source.slowStartThreshold;
+    source.busyUntil = QDateTime::currentMSecsSinceEpoch() + qBound((qint64) 0, retryAfter, (qint64) DOWNLOAD_MAX_RTO);
+
+    if (!outstandingRequests->contains(blockHash) && !lostRequests->contains(blockHash)) {
+        lostRequests->append(blockHash);
+    }
+}
+
+void OngoingDownload::updateRtt(DownloadSource &source, qint64 rttSample) {
+
+    if (source.smoothedRtt < 0) {
+        source.smoothedRtt = rttSample;
+        source.rttVariance = rttSample / 2.0;
+    } else {
+        source.rttVariance = 0.75 * source.rttVariance + 0.25 * qAbs(source.smoothedRtt - rttSample);
+        source.smoothedRtt = 0.875 * source.smoothedRtt + 0.125 * rttSample;
+    }
+}
+
+/* Requests to a source sent before the one it just answered and still unanswered after a
+   retransmission timeout are assumed lost: they are queued to be sent again and the
+   source's window is halved (once per batch of losses)
+*/
+void OngoingDownload::detectLostRequests(int sourceIdx, qint64 answeredRequestTime, qint64 now) {
+
+    DownloadSource &source = (*sources)[sourceIdx];
+    qint64 rto = getRetransmissionTimeout(source);
+    bool lossDetected = false;
+
+    QMultiHash<QByteArray, OutstandingRequest>::iterator it = outstandingRequests->begin();
+    while (it != outstandingRequests->end()) {
+
+        const OutstandingRequest &request = it.value();
+        if (request.sourceIdx == sourceIdx && request.requestTime < answeredRequestTime &&
+                now - request.requestTime > rto) {
+            lostRequests->append(it.key());
+            source.outstanding--;
+            it = outstandingRequests->erase(it);
+            lossDetected = true;
+        } else {
+            ++it;
+        }
+    }
+
+    if (lossDetected) {
+        source.slowStartThreshold = qMax(source.window / 2, 2.0);
+        source.window = source.slowStartThreshold;
+        qDebug() << "Block requests to" << source.origin << "lost for" << fileName << ", window =" << source.window;
+    }
+}
+
+/* Creates the partial file and reserves space for the whole file up front,
+   so that blocks written out of order don't fragment it. Fails if the disk can't hold the file.
+*/
+bool OngoingDownload::openPartialFile(bool resuming) {
 
+    QDir().mkpath(QFileInfo(downloadFilePath).absolutePath());
+
+    QIODevice::OpenMode mode = QIODevice::ReadWrite;
+    if (!resuming) mode |= QIODevice::Truncate;
+    if (!partialFile->open(mode)) {
+        qDebug() << "Cannot create download file" << partialFile->fileName();
+        return false;
+    }
+
+    // The file size comes from the network .. don't fill the disk on a peer's word
+    qint64 reservedSize = getPartialFileSize();
+    struct statvfs diskStat;
+    if (reservedSize > partialFile->size() &&
+            statvfs(QFile::encodeName(partialFile->fileName()).constData(), &diskStat) == 0 &&
+            (qint64) diskStat.f_bavail * (qint64) diskStat.f_frsize < reservedSize - partialFile->size()) {
+        qDebug() << "Not enough disk space to download" << fileName << "(" << reservedSize << "bytes)";
+        partialFile->close();
+        if (!resuming) partialFile->remove();
+        return false;
+    }
+
+    if (reservedSize > 0) {
+#ifdef Q_OS_LINUX
+        if (fallocate(partialFile->handle(), 0, 0, reservedSize) != 0)
+#endif
+        partialFile->resize(reservedSize);
+    }
+    return true;
+}
+
+/* Space taken by the partial file: content-defined blocks each get a full BLOCK_SIZE slot
+   since their offsets in the file are not known until the blocks before them are
+*/
+qint64 OngoingDownload::getPartialFileSize() {
+
+    if (contentDefined) return (qint64) numBlocks * BLOCK_SIZE;
+    return fileSize;
+}
+
+/* Extends the per-block state to cover the first knownBlocks blocks */
+void OngoingDownload::growBlockState(int knownBlocks) {
+
+    int oldSize = blockHashes->size();
+    if (knownBlocks <= oldSize) return;
+
+    blockHashes->resize(knownBlocks);
+    blockLengths->resize(knownBlocks);
+    for (int i = oldSize; i < knownBlocks; i++) {
+        (*blockLengths)[i] = BLOCK_SIZE;
+    }
+    if (!contentDefined && knownBlocks == numBlocks) {
+        (*blockLengths)[numBlocks - 1] = (int) (fileSize - (qint64) (numBlocks - 1) * BLOCK_SIZE);
+    }
+
+    receivedBlocks->resize(knownBlocks);
+    if (writtenBlocks->size() < knownBlocks) writtenBlocks->resize(knownBlocks);
+}
+
+bool OngoingDownload::hasPartialFile() {
+    return partialFile->isOpen();
+}
+
+void OngoingDownload::setBlockIO(AsyncBlockIO *blockIO) {
+    this->blockIO = blockIO;
+}
+
+bool OngoingDownload::needsFlush() {
+    return blockIO != NULL && dirtyBytes >= DOWNLOAD_DIRTY_BUFFER_LIMIT;
+}
+
+bool OngoingDownload::hasWritesInFlight() {
+    return !writesInFlight->isEmpty();
+}
+
+/* Hands the buffered blocks over to be written in the background, as one batch.
+   They are served from memory until written. Returns the id of the write, 0 if nothing was written.
+*/
+quint64 OngoingDownload::startFlush() {
+
+    if (dirtyBlocks->isEmpty() || !partialFile->isOpen()) return 0;
+
+    QList<QPair<qint64, QByteArray> > blocks;
+    QMap<qint64, QByteArray>::const_iterator it;
+    for (it = dirtyBlocks->constBegin(); it != dirtyBlocks->constEnd(); ++it) {
+        blocks.append(qMakePair(it.key(), it.value()));
+        writingBlocks->insert(it.key(), it.value());
+        writingBytes += it.value().size();
+    }
+
+    // Nothing buffered by QFile may land on top of the blocks written behind its back
+    partialFile->flush();
+
+    quint64 writeId = blockIO->write(partialFile->handle(), blocks);
+    writesInFlight->insert(writeId, dirtyBlocks->keys());
+    dirtyBlocks->clear();
+    dirtyBytes = 0;
+    return writeId;
+}
+
+/* Blocks of a failed write go back to the dirty buffer, to be written again with the next flush */
+void OngoingDownload::flushFinished(quint64 writeId, bool ok) {
+
+    QList<qint64> offsets = writesInFlight->take(writeId);
+    for (int i = 0; i < offsets.size(); i++) {
+
+        QByteArray blockData = writingBlocks->take(offsets.at(i));
+        writingBytes -= blockData.size();
+        if (ok) {
+            receivedBlocks->setBit(offsets.at(i) / BLOCK_SIZE);
+        } else {
+            dirtyBlocks->insert(offsets.at(i), blockData);
+            dirtyBytes += blockData.size();
+        }
+    }
+
+    if (!ok) {
+        qDebug() << "Error writing download file" << partialFile->fileName();
+        writeFailures++;
+    }
+    saveState();
+}
+
+/* A block we share is being read to be copied here: it isn't requested from the network meanwhile */
+void OngoingDownload::startLocalRead(QByteArray blockHash) {
+    localReads->insert(blockHash);
+}
+
+/* If the copy didn't work out, the block is requested in file order like any other */
+void OngoingDownload::localReadFinished(QByteArray blockHash) {
+
+    localReads->remove(blockHash);
+    QList<int> blockIndices = pendingBlocks->values(blockHash);
+    for (int i = 0; i < blockIndices.size(); i++) {
+        nextBlockToRequest = qMin(nextBlockToRequest, blockIndices.at(i));
+    }
+}
+
+/* Writes buffered blocks to their offsets in the partial file, in offset order */
+bool OngoingDownload::flushDirtyBlocks() {
+
+    bool ok = partialFile->isOpen();
+
+    QMap<qint64, QByteArray>::const_iterator it;
+    for (it = dirtyBlocks->constBegin(); ok && it != dirtyBlocks->constEnd(); ++it) {
+        ok = partialFile->seek(it.key()) && partialFile->write(it.value()) == it.value().size();
+        if (ok) receivedBlocks->setBit(it.key() / BLOCK_SIZE);
+    }
+
+    if (!ok) qDebug() << "Error writing download file" << partialFile->fileName();
+
+    dirtyBlocks->clear();
+    dirtyBytes = 0;
+
+    // Only record blocks as received once they were handed to the OS
+    if (ok) ok = partialFile->flush();
+    saveState();
+    return ok;
+}
+
+/* Writes the download state file. The metafile part never changes, so after the first
+   call only the bitmap and sources at the end of the file are rewritten, through blockIO if set.
+   Those writes may land out of order: an older bitmap only lists fewer blocks, which is safe.
+*/
+bool OngoingDownload::saveState() {
+
+    if (stateBitmapOffset < 0) {
+        if (!stateFile->open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+            qDebug() << "Cannot write download state" << stateFile->fileName();
+            return false;
+        }
+
+        QDataStream stream(stateFile);
+        stream << (quint32) DOWNLOAD_STATE_MAGIC << (quint32) DOWNLOAD_STATE_VERSION;
+        stream << fileName << fileHash << metaFile;
+        stateBitmapOffset = stateFile->pos();
+        if (!stateFile->flush()) return false;
+    }
+
+    if (!stateFile->isOpen()) return false;
+
+    QStringList sourceOrigins;
+    for (int i = 0; i < sources->size(); i++) {
+        sourceOrigins.append(sources->at(i).origin);
+    }
+
+    // Blocks from before a restart that could not be checked yet are still kept
+    QBitArray blocksOnDisk = *receivedBlocks | *writtenBlocks;
+    blocksOnDisk.resize(numBlocks);
+
+    // Sources are only ever added, so the tail never shrinks
+    QByteArray state;
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    stream << blocksOnDisk << sourceOrigins;
+
+    if (blockIO != NULL) {
+        QList<QPair<qint64, QByteArray> > blocks;
+        blocks.append(qMakePair(stateBitmapOffset, state));
+        blockIO->write(stateFile->handle(), blocks);
+        return true;
+    }
+    return stateFile->seek(stateBitmapOffset) && stateFile->write(state) == state.size() && stateFile->flush();
+}
+
+/* Recreates a download from the state file left by an earlier run. Blocks the state file
+   says were written are hashed again (in the background) as soon as their hash is known, and
+   only those that match are kept. Returns NULL if the state file is unusable.
+*/
+OngoingDownload *OngoingDownload::restore(QString saveFileDir, QString stateFilePath) {
+
+    QFile file(stateFilePath);
+    if (!file.open(QIODevice::ReadOnly)) return NULL;
+
+    QDataStream stream(&file);
+    quint32 magic, version;
+    stream >> magic >> version;
+    if (magic != DOWNLOAD_STATE_MAGIC || version != DOWNLOAD_STATE_VERSION) {
+        qDebug() << "Ignoring download state in unknown format" << stateFilePath;
+        return NULL;
+    }
+
+    QString fileName;
+    QByteArray fileHash, metaFile;
+    QBitArray writtenBlocks;
+    QStringList sources;
+    stream >> fileName >> fileHash >> metaFile >> writtenBlocks >> sources;
     file.close();
 
+    int height, numBlocks;
+    qint64 fileSize;
+    QByteArray childHashes;
+    bool contentDefined;
+    if (stream.status() != QDataStream::Ok ||
+            !HashTree::parseMetaFile(metaFile, &height, &fileSize, &numBlocks, &contentDefined, &childHashes) ||
+            writtenBlocks.size() != numBlocks) {
+        qDebug() << "Ignoring corrupt download state" << stateFilePath;
+        return NULL;
+    }
+
+    OngoingDownload *download = new OngoingDownload(saveFileDir, fileName, fileHash, metaFile, sources, writtenBlocks);
+    qDebug() << "Resuming download of" << fileName << "with" << download->receivedBlocks->count(true)
+             << "of" << numBlocks << "blocks checked so far";
+    return download;
+}
+
+/* Returns a block or tree node of the file that we already have, or an empty array.
+   Blocks are read from the dirty buffer or from their slot in the partial file.
+*/
+QByteArray OngoingDownload::readBlock(QByteArray blockHash) {
+
+    if (blockHash == fileHash) return metaFile;
+    if (receivedNodes->contains(blockHash)) return receivedNodes->value(blockHash);
+    if (finishing || !availableBlocks->contains(blockHash)) return QByteArray();
+
+    int blockIdx = availableBlocks->value(blockHash);
+    qint64 slotOffset = (qint64) blockIdx * BLOCK_SIZE;
+    if (dirtyBlocks->contains(slotOffset)) return dirtyBlocks->value(slotOffset);
+    if (writingBlocks->contains(slotOffset)) return writingBlocks->value(slotOffset);
+
+    // Not through QFile: its read buffer knows nothing of the blocks written behind its back
+    int length = blockLengths->at(blockIdx);
+    if (!receivedBlocks->testBit(blockIdx) || !partialFile->isOpen()) return QByteArray();
+    QByteArray blockData(length, 0);
+    if (pread(partialFile->handle(), blockData.data(), length, slotOffset) != length) return QByteArray();
+    return blockData;
+}
+
+/* Where a block sits in the partial file, for reading it in the background.
+   False if it isn't there (yet), e.g. because it is still buffered: readBlock returns it then.
+*/
+bool OngoingDownload::getBlockFile(QByteArray blockHash, int *fd, qint64 *offset, int *length) {
+
+    if (finishing || !availableBlocks->contains(blockHash) || !partialFile->isOpen()) return false;
+
+    int blockIdx = availableBlocks->value(blockHash);
+    if (!receivedBlocks->testBit(blockIdx)) return false;
+
+    *fd = partialFile->handle();
+    *offset = (qint64) blockIdx * BLOCK_SIZE;
+    *length = blockLengths->at(blockIdx);
+    return true;
+}
+
+/* True if readBlock can return the block or tree node, without reading it */
+bool OngoingDownload::hasBlock(QByteArray blockHash) {
+
+    return blockHash == fileHash || receivedNodes->contains(blockHash) ||
+            (!finishing && availableBlocks->contains(blockHash));
+}
+
+/* Length of a block or tree node that readBlock can return, -1 if it can't */
+int OngoingDownload::getBlockLength(QByteArray blockHash) {
+
+    if (blockHash == fileHash) return metaFile.size();
+    if (receivedNodes->contains(blockHash)) return receivedNodes->value(blockHash).size();
+    if (finishing || !availableBlocks->contains(blockHash)) return -1;
+    return blockLengths->at(availableBlocks->value(blockHash));
+}
+
+/* Hashes of everything hasBlock is true for */
+QList<QByteArray> OngoingDownload::getAvailableBlockHashes() {
+    return QList<QByteArray>() << fileHash << receivedNodes->keys() << availableBlocks->keys();
+}
+
+QString OngoingDownload::getFilePath() {
+    return downloadFilePath;
+}
+
+qint64 OngoingDownload::getFileSize() {
+    return fileSize;
+}
+
+bool OngoingDownload::isContentDefined() {
+    return contentDefined;
+}
+
+/* Block list of the file in the format the hasher produces: each block hash, followed by the
+   block length for content-defined blocks
+*/
+QByteArray OngoingDownload::getBlockListMeta() {
+
+    QByteArray blockListMeta;
+    for (int i = 0; i < blockHashes->size(); i++) {
+        blockListMeta.append(blockHashes->at(i));
+        if (contentDefined) {
+            blockListMeta.append((char) (blockLengths->at(i) >> 8));
+            blockListMeta.append((char) (blockLengths->at(i) & 0xff));
+        }
+    }
+    return blockListMeta;
+}
+
+bool OngoingDownload::hasDirtyBlocks() {
+    return !dirtyBlocks->isEmpty();
+}
+
+int OngoingDownload::getWriteFailures() {
+    return writeFailures;
+}
+
+bool OngoingDownload::isFinishing() {
+    return finishing;
+}
+
+/* Hands the partial file over to a task that trims the preallocated space to the real file size
+   and atomically moves it into place. Every block must have been written.
+*/
+DownloadFinisher *OngoingDownload::startFinishing() {
+
+    partialFile->flush();
+    finishing = true;
+
+    QVector<int> lengths = contentDefined ? *blockLengths : QVector<int>();
+    return new DownloadFinisher(fileHash, dup(partialFile->handle()), partialFile->fileName(), downloadFilePath,
+                                fileSize, contentDefined, lengths);
+}
+
+/* Called once the DownloadFinisher is done. Returns true if the file was moved into place. */
+bool OngoingDownload::finishingFinished(bool ok) {
+
+    partialFile->close();
+    if (!ok) return false;
+
+    qDebug() << "Downloading file complete. Saved to file" << downloadFilePath;
+
+    // Nothing left to resume
+    stateFile->close();
+    stateFile->remove();
+    return true;
+}
+
+DownloadFinisher::DownloadFinisher(QByteArray fileHash, int fd, QString partialFilePath, QString downloadFilePath,
+                                   qint64 fileSize, bool contentDefined, QVector<int> blockLengths) {
+    this->fileHash = fileHash;
+    this->fd = fd;
+    this->partialFilePath = partialFilePath;
+    this->downloadFilePath = downloadFilePath;
+    this->fileSize = fileSize;
+    this->contentDefined = contentDefined;
+    this->blockLengths = blockLengths;
+    setAutoDelete(false);
+}
+
+void DownloadFinisher::run() {
+
+    bool ok = fd >= 0;
+    if (ok && contentDefined && !compactBlocks()) {
+        qDebug() << "Error compacting download file" << partialFilePath;
+        ok = false;
+    }
+    if (ok && (ftruncate(fd, fileSize) != 0 || fsync(fd) != 0)) {
+        qDebug() << "Error syncing download file" << partialFilePath;
+        ok = false;
+    }
+    if (fd >= 0) close(fd);
+
+    if (ok && rename(QFile::encodeName(partialFilePath).constData(),
+                     QFile::encodeName(downloadFilePath).constData()) != 0) {
+        qDebug() << "Cannot move download into place" << downloadFilePath;
+        ok = false;
+    }
+
+    emit finished(fileHash, ok);
+}
+
+/* Moves content-defined blocks from their slots to their final offsets, front to back.
+   A block never moves forward, so this is done in place.
+*/
+bool DownloadFinisher::compactBlocks() {
+
+    QByteArray blockData(BLOCK_SIZE, 0);
+    qint64 fileOffset = 0;
+    for (int i = 0; i < blockLengths.size(); i++) {
+
+        qint64 slotOffset = (qint64) i * BLOCK_SIZE;
+        int length = blockLengths.at(i);
+        if (slotOffset != fileOffset) {
+            if (pread(fd, blockData.data(), length, slotOffset) != length ||
+                    pwrite(fd, blockData.constData(), length, fileOffset) != length) return false;
+        }
+        fileOffset += length;
+    }
+
+    if (fileOffset != fileSize) {
+        qDebug() << "Block lengths of" << downloadFilePath << "don't add up to the file size";
+        return false;
+    }
+    return true;
+}
+
+BlockVerifier::BlockVerifier(quint64 verifyId, int fd, QList<qint64> offsets, QList<int> lengths) {
+    this->verifyId = verifyId;
+    this->fd = fd;
+    this->offsets = offsets;
+    this->lengths = lengths;
+    setAutoDelete(false);
+}
+
+/* A block that can't be read gets an all zero hash, so it doesn't match */
+void BlockVerifier::run() {
+
+    QByteArray hashes;
+    QByteArray blockData(BLOCK_SIZE, 0);
+    for (int i = 0; i < offsets.size(); i++) {
+
+        int length = lengths.at(i);
+        if (fd >= 0 && pread(fd, blockData.data(), length, offsets.at(i)) == length) {
+            hashes.append(FileHasher::sha256(blockData.left(length)));
+        } else {
+            hashes.append(QByteArray(HASH_NUM_BYTES, 0));
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    emit finished(verifyId, hashes);
 }
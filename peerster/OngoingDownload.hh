@@ -2,28 +2,222 @@
 #define ONGOINGDOWNLOAD_HH
 
 #include <QString>
+#include <QStringList>
 #include <QList>
+#include <QHash>
+#include <QMultiHash>
+#include <QSet>
+#include <QVector>
+#include <QPair>
+#include <QMap>
 #include <QByteArray>
 #include <QVariantMap>
+#include <QFile>
+#include <QBitArray>
+#include <QObject>
+#include <QRunnable>
+
+#include "AsyncBlockIO.hh"
+
+#define DOWNLOAD_INITIAL_WINDOW (4)         // block requests in flight to a source at the start
+#define DOWNLOAD_MAX_WINDOW (256)
+#define DOWNLOAD_INITIAL_RTO (1000)         // ms, before any round trip has been measured
+#define DOWNLOAD_MIN_RTO (200)              // ms
+#define DOWNLOAD_MAX_RTO (60000)            // ms, cap on the backed off timeout
+#define DOWNLOAD_MAX_BACKOFF (64)           // timeout multiplier after repeated timeouts
+#define DOWNLOAD_FAILOVER_TIMEOUTS (3)      // timeouts in a row before a source is considered stalled
+#define DOWNLOAD_DIRTY_BUFFER_LIMIT (1024 * 1024)   // bytes of received blocks held before writing them out
+#define DOWNLOAD_MAX_WRITE_FAILURES (3)     // failed background writes before a download is given up
+#define DOWNLOAD_FOLDER_NAME "Peerster_Downloads"
+#define PARTIAL_FILE_SUFFIX ".part"
+#define DOWNLOAD_STATE_SUFFIX ".state"     // appended to the partial file name
+#define DOWNLOAD_STATE_MAGIC (0x50445354)  // "PDST"
+#define DOWNLOAD_STATE_VERSION (2)         // 2: keeps the metafile as received instead of the block list
+
+class DownloadFinisher;
+class BlockVerifier;
+
+/* A file being downloaded block by block from every source that advertised it, each source with
+ * its own congestion window and retransmission timeout. Blocks go to a preallocated partial file,
+ * with a state file next to it so that the download can be resumed after a restart.
+ */
 
 class OngoingDownload {
 
 public:
-    OngoingDownload(QString saveFileDir, QString fileName, int fileSize, QList<QByteArray> *blocks);
+    struct Stats {
+        int timeouts;                               // block requests not answered before their deadline
+        int retries;                                // block requests sent again
+        int stalls;                                 // times a source stopped answering and was failed over
+    };
 
-    QByteArray getNextBlockToRequest();
-    bool blockBelongsToFile(QByteArray blockHash);
-    void receivedBlock(QVariantMap blockReplyMessage);
+    OngoingDownload(QString saveFileDir, QString fileName, QByteArray fileHash, QByteArray metaFile,
+                    QStringList sources, QBitArray writtenBlocks = QBitArray());
+    ~OngoingDownload();
+
+    static OngoingDownload *restore(QString saveFileDir, QString stateFilePath);
+
+    void addSource(QString origin);
+    QByteArray getFileHash();
+    QList<QPair<QString, QByteArray> > takeBlocksToRequest();
+    QList<QByteArray> getPendingBlockHashes();
+    bool isPending(QByteArray hash);
+    QList<QByteArray> receivedBlock(QVariantMap blockReplyMessage);
+    QList<QPair<QString, QByteArray> > checkTimeouts(qint64 now);
+    void retryLater(QByteArray blockHash, QString origin, qint64 retryAfter);
+    Stats getStats();
     int getNumberOfPendingBlocks();
-    void dumpDataToFile();
+    QByteArray readBlock(QByteArray blockHash);
+    bool hasBlock(QByteArray blockHash);
+    int getBlockLength(QByteArray blockHash);
+    bool getBlockFile(QByteArray blockHash, int *fd, qint64 *offset, int *length);
+    QList<QByteArray> getAvailableBlockHashes();
+    bool hasBlocksToVerify();
+    BlockVerifier *startVerifying(quint64 verifyId);
+    QList<QByteArray> verifyFinished(quint64 verifyId, QByteArray hashes, QList<QByteArray> *verifiedHashes);
+    void setBlockIO(AsyncBlockIO *blockIO);
+    bool needsFlush();
+    quint64 startFlush();
+    void flushFinished(quint64 writeId, bool ok);
+    void startLocalRead(QByteArray blockHash);
+    void localReadFinished(QByteArray blockHash);
+    bool hasWritesInFlight();
+    bool hasDirtyBlocks();
+    int getWriteFailures();
+    DownloadFinisher *startFinishing();
+    bool finishingFinished(bool ok);
+    bool isFinishing();
+    bool hasPartialFile();
+    QString getFilePath();
+    qint64 getFileSize();
+    bool isContentDefined();
+    QByteArray getBlockListMeta();
 
 private:
+    struct DownloadSource {
+        QString origin;
+        double window;                              // max number of outstanding requests
+        double slowStartThreshold;
+        double smoothedRtt;                         // ms, < 0 until first measured
+        double rttVariance;
+        int outstanding;
+        int backoff;                                // timeout multiplier, doubled on every timeout
+        int consecutiveTimeouts;
+        qint64 busyUntil;                           // the source asked us not to send requests before this, 0 if not
+    };
+
+    struct OutstandingRequest {
+        int sourceIdx;
+        qint64 requestTime;
+        qint64 deadline;
+        bool retransmitted;                         // not used for RTT measurements
+    };
+
+    struct TreeNode {
+        int level;
+        int firstBlock;                             // index of the first data block below the node
+    };
+
     QString saveFileDir;
     QString fileName;
-    int fileSize;
-    QList<QByteArray> *pendingBlockRequests;
-    QList<QByteArray> *data;
+    qint64 fileSize;                                // upper bound until the last block is received
+    QByteArray fileHash;
+    QByteArray metaFile;
+    bool contentDefined;                            // variable length blocks
+    int numBlocks;
+    QVector<QByteArray> *blockHashes;               // hashes of the file blocks in order, empty until known
+    QVector<int> *blockLengths;                     // length of each block, BLOCK_SIZE until known
+    QMultiHash<QByteArray, int> *pendingBlocks;     // < block hash, index of a block not received yet >
+    QMultiHash<QByteArray, TreeNode> *pendingNodes; // < node hash, hash tree node not received yet >
+    QHash<QByteArray, QByteArray> *receivedNodes;   // < node hash, hash tree node > to serve to others
+    QHash<QByteArray, int> *availableBlocks;        // < block hash, index of the block in the partial file >
+    QList<QByteArray> *nodesToRequest;              // tree nodes not requested yet, top down
+
+    QString downloadFilePath;
+    QFile *partialFile;                             // blocks are written here at their final offset
+    QMap<qint64, QByteArray> *dirtyBlocks;          // < file offset, received block not written yet >
+    int dirtyBytes;
+    AsyncBlockIO *blockIO;                          // NULL to write blocks out synchronously
+    QMap<qint64, QByteArray> *writingBlocks;        // < file offset, block handed to blockIO and not written yet >
+    int writingBytes;                               // requests are held back while over the dirty buffer limit
+    QHash<quint64, QList<qint64> > *writesInFlight; // < write id, offsets of its blocks >
+    int writeFailures;
+    bool finishing;                                 // the partial file belongs to the DownloadFinisher
+    QBitArray *receivedBlocks;                      // blocks written to the partial file
+    QBitArray *writtenBlocks;                       // blocks written before a restart, checked once their hash is known
+    QList<int> *blocksToVerify;                     // written blocks whose hash is known, not handed to a verifier yet
+    QHash<quint64, QList<int> > *verifyingBlocks;   // < verify id, blocks being checked >
+    int numVerifying;
+    QFile *stateFile;
+    qint64 stateBitmapOffset;                       // where the parts of the state that change start
+
+    QList<DownloadSource> *sources;
+    int nextBlockToRequest;                         // blocks before this index were requested at least once
+    QList<QByteArray> *lostRequests;                // requests to send again
+    QSet<QByteArray> *localReads;                   // blocks being copied from a shared file, not requested meanwhile
+    QMultiHash<QByteArray, OutstandingRequest> *outstandingRequests; // < block hash, request in flight >
+    Stats stats;
+
+    bool openPartialFile(bool resuming);
+    void growBlockState(int knownBlocks);
+    qint64 getPartialFileSize();
+    bool flushDirtyBlocks();
+    bool saveState();
+    QList<QByteArray> expandNode(QByteArray nodeData, int level, int firstBlock);
+    void requestAnswered(QByteArray blockHash, QString origin);
+    int findSource(QString origin);
+    bool isOutstandingAt(QByteArray blockHash, int sourceIdx);
+    QByteArray pickBlockFor(int sourceIdx, bool *retransmission);
+    QList<int> getSourcesByThroughput();
+    qint64 getRetransmissionTimeout(const DownloadSource &source);
+    void updateRtt(DownloadSource &source, qint64 rttSample);
+    void detectLostRequests(int sourceIdx, qint64 answeredRequestTime, qint64 now);
+};
+
+/* The end of a download, on a pool thread: content-defined blocks are moved from their slots
+ * to their final offsets, the file is trimmed to its size, synced and moved into place
+ */
+class DownloadFinisher : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    DownloadFinisher(QByteArray fileHash, int fd, QString partialFilePath, QString downloadFilePath,
+                     qint64 fileSize, bool contentDefined, QVector<int> blockLengths);
+    void run();
+
+private:
+    QByteArray fileHash;
+    int fd;                                         // our own descriptor of the partial file
+    QString partialFilePath;
+    QString downloadFilePath;
+    qint64 fileSize;
+    bool contentDefined;
+    QVector<int> blockLengths;
+
+    bool compactBlocks();
+
+signals:
+    void finished(QByteArray fileHash, bool ok);
+};
+
+/* Hashes blocks written to a partial file before a restart, on a pool thread */
+class BlockVerifier : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    BlockVerifier(quint64 verifyId, int fd, QList<qint64> offsets, QList<int> lengths);
+    void run();
+
+private:
+    quint64 verifyId;
+    int fd;                                         // our own descriptor of the partial file
+    QList<qint64> offsets;
+    QList<int> lengths;
 
+signals:
+    void finished(quint64 verifyId, QByteArray hashes);    // one hash per block, in order
 };
 
 #endif // ONGOINGDOWNLOAD_HH
@@ -1,24 +1,71 @@
 #include "Router.hh"
 
+#include <QDebug>
+#include <QDateTime>
+
 Router::Router()
 {
-    // setup table of destinations for routing
-    routingTable = new QHash<QString, QPair<QHostAddress, quint16>* >();
+    // setup forwarding table of destinations for routing
+    routes = new QHash<QString, Route>();
+
+    // Periodically drop routes to origins we haven't heard from in a while
+    sweepTimer = new QTimer(this);
+    connect(sweepTimer, SIGNAL(timeout()), this, SLOT(expireStaleRoutes()));
+    sweepTimer->start(ROUTE_SWEEP_INTERVAL);
 }
 
-void Router::addRoutingNextHop(QString origin, Peer *sender) {
+/* nextHop must be the neighbor object held in the neighbors list (not a per-datagram copy)
+   so that forwarding can send to it directly without resolving the address again
+*/
+void Router::addRoutingNextHop(QString origin, Peer *nextHop) {
+
+    QHash<QString, Route>::iterator it = routes->find(origin);
+    bool newOrigin = (it == routes->end());
+    if (newOrigin) {
+        it = routes->insert(origin, Route());
+    }
+    it.value().nextHop = nextHop;
+    it.value().lastUpdated = QDateTime::currentMSecsSinceEpoch();
+
+    // Only the set of origins is shown in the UI .. no need to refresh it on next hop updates
+    if (newOrigin) {
+        emit originAdded(origin);
+    }
+
+    //qDebug() << "New routing entry: " << origin + ", " << nextHop->getIpAddress().toString() + ", " << nextHop->getPort();
+}
 
-    QHostAddress senderIp = sender->getIpAddress();
-    quint16 senderPort = sender->getPort();
-    QPair<QHostAddress, quint16>* senderAddr = new QPair<QHostAddress, quint16>(senderIp, senderPort);
-    routingTable->insert(origin, senderAddr);
+/* The destination of a forwarded message arrives as a string, so the origin itself is
+   the key .. one hash lookup gives the neighbor to send to, without allocating
+*/
+Peer *Router::lookupNextHop(const QString &origin) {
 
-    emit originsListChanged(routingTable->keys());
+    QHash<QString, Route>::const_iterator it = routes->constFind(origin);
+    if (it == routes->constEnd()) return NULL;
 
-    //qDebug() << "New routing entry: " << origin + ", " << senderIp.toString() + ", " << senderPort;
+    return it.value().nextHop;
 }
 
-QPair<QHostAddress, quint16> *Router::lookupOrigin(QString origin) {
+/* a slot function that's executed periodically
+   Every origin sends a route rumor each minute, so a route that hasn't been refreshed
+   for ROUTE_EXPIRY_TIMEOUT most likely leads to a node that has left the network
+*/
+void Router::expireStaleRoutes() {
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QHash<QString, Route>::iterator it = routes->begin();
+    while (it != routes->end()) {
+
+        if (now - it.value().lastUpdated < ROUTE_EXPIRY_TIMEOUT) {
+            ++it;
+            continue;
+        }
+
+        QString origin = it.key();
+        qDebug() << "Route to" << origin << "expired";
 
-    return routingTable->value(origin);
+        it = routes->erase(it);
+        emit originRemoved(origin);
+    }
 }
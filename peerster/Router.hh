@@ -2,23 +2,38 @@
 #define ROUTER_HH
 
 #include <QHash>
+#include <QTimer>
 #include <QVariantMap>
 #include "Peer.hh"
 
+#define ROUTE_EXPIRY_TIMEOUT (180000)   // 3 missed route rumors (sent every 60 seconds)
+#define ROUTE_SWEEP_INTERVAL (15000)
+
+// Forwarding state for one origin, found with a single hash lookup
+struct Route {
+    Peer *nextHop;          // neighbor object held in the neighbors list
+    qint64 lastUpdated;     // time of the last route rumor
+};
+
 class Router : public QObject
 {
     Q_OBJECT
 
 public:
     Router();
-    void addRoutingNextHop(QString origin, Peer *sender);
-    QPair<QHostAddress, quint16> *lookupOrigin(QString origin);
+    void addRoutingNextHop(QString origin, Peer *nextHop);
+    Peer *lookupNextHop(const QString &origin);
 
 private:
-    QHash<QString, QPair<QHostAddress,quint16>* > *routingTable;
+    QHash<QString, Route> *routes;     // < origin, route >
+    QTimer *sweepTimer;
+
+public slots:
+    void expireStaleRoutes();
 
 signals:
-    void originsListChanged(QList<QString> originsList);
+    void originAdded(QString origin);
+    void originRemoved(QString origin);
 };
 
 #endif // ROUTER_HH
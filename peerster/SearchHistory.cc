@@ -0,0 +1,34 @@
+#include "SearchHistory.hh"
+
+SearchHistory::SearchHistory() {
+    maxBudgets = new QHash<QString, quint32>();
+    seenOrder = new QQueue<QPair<qint64, QString> >();
+}
+
+/* Records a copy of a search and tells what to do with it */
+SearchHistory::SearchStatus SearchHistory::record(QString origin, QString searchId, quint32 budget, qint64 now) {
+
+    expire(now);
+
+    QString key = origin + "\n" + searchId;
+    QHash<QString, quint32>::iterator it = maxBudgets->find(key);
+    if (it == maxBudgets->end()) {
+        maxBudgets->insert(key, budget);
+        seenOrder->enqueue(qMakePair(now, key));
+        return NewSearch;
+    }
+
+    if (budget <= it.value()) return Duplicate;
+
+    it.value() = budget;
+    return BiggerBudget;
+}
+
+/* Forgets searches older than the window, and the oldest ones while there are too many */
+void SearchHistory::expire(qint64 now) {
+
+    while (!seenOrder->isEmpty() && (now - seenOrder->head().first > SEARCH_HISTORY_WINDOW ||
+                                     seenOrder->size() >= SEARCH_HISTORY_MAX_ENTRIES)) {
+        maxBudgets->remove(seenOrder->dequeue().second);
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef SEARCHHISTORY_HH
+#define SEARCHHISTORY_HH
+
+#include <QString>
+#include <QHash>
+#include <QQueue>
+#include <QPair>
+
+#define SEARCH_HISTORY_WINDOW (60000)       // ms a search is remembered after it was first seen
+#define SEARCH_HISTORY_MAX_ENTRIES (16384)  // oldest searches are forgotten first beyond this
+
+/* Searches seen recently, keyed by (origin, search id), with the largest budget each came with.
+ * The same search reaches a node over several paths and again on every budget expansion
+ * round: only the first copy is answered, and a later copy is only forwarded if it carries
+ * a bigger budget than any copy before it.
+ */
+
+class SearchHistory
+{
+
+public:
+    enum SearchStatus {
+        NewSearch,                          // answer and forward
+        BiggerBudget,                       // answered already .. forward only
+        Duplicate                           // drop
+    };
+
+    SearchHistory();
+
+    SearchStatus record(QString origin, QString searchId, quint32 budget, qint64 now);
+
+private:
+    QHash<QString, quint32> *maxBudgets;        // < origin and search id, largest budget seen >
+    QQueue<QPair<qint64, QString> > *seenOrder; // < time first seen, origin and search id >, oldest first
+
+    void expire(qint64 now);
+};
+
+#endif // SEARCHHISTORY_HH
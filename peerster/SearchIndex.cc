@@ -0,0 +1,128 @@
+#include "SearchIndex.hh"
+
+#include <QSet>
+#include <QPair>
+#include <QtAlgorithms>
+
+SearchIndex::SearchIndex() {
+    fileNames = new QVector<QString>();
+    foldedNames = new QVector<QString>();
+    fileIds = new QHash<QString, int>();
+    postings = new QHash<quint64, QVector<int> >();
+}
+
+/* Indexes a shared file name .. names are only indexed once */
+void SearchIndex::addFile(QString fileName) {
+
+    if (fileIds->contains(fileName)) return;
+
+    int fileId = fileNames->size();
+    QString foldedName = fileName.toCaseFolded();
+    fileNames->append(fileName);
+    foldedNames->append(foldedName);
+    fileIds->insert(fileName, fileId);
+
+    // Ids only grow, so appending keeps every posting list sorted
+    QSet<quint64> ngrams = QSet<quint64>::fromList(getNgrams(foldedName));
+    QSet<quint64>::const_iterator ngramIt;
+    for (ngramIt = ngrams.constBegin(); ngramIt != ngrams.constEnd(); ++ngramIt) {
+        (*postings)[*ngramIt].append(fileId);
+    }
+}
+
+int SearchIndex::getNumberOfFiles() {
+    return fileIds->size();
+}
+
+/* Returns the names of the files matching any of the white space separated keywords
+   (case insensitive substring match), each once. Names matching more keywords come first.
+*/
+QStringList SearchIndex::search(QString keywords, int maxResults) {
+
+    QStringList keywordsList = keywords.toCaseFolded().split(" ", QString::SkipEmptyParts);
+    keywordsList.removeDuplicates();
+
+    QHash<int, int> matchCounts;                // < file id, keywords matched >
+    for (int i = 0; i < keywordsList.size(); i++) {
+
+        const QString &keyword = keywordsList.at(i);
+        QVector<int> candidates = findCandidates(keyword);
+        for (int j = 0; j < candidates.size(); j++) {
+
+            int fileId = candidates.at(j);
+            if (!foldedNames->at(fileId).contains(keyword)) continue;
+            matchCounts[fileId]++;
+        }
+    }
+
+    // Most keywords matched first, then in the order files were shared .. only the best maxResults are kept
+    QList<QPair<int, int> > ranked;
+    QHash<int, int>::const_iterator it;
+    for (it = matchCounts.constBegin(); it != matchCounts.constEnd() && maxResults > 0; ++it) {
+
+        QPair<int, int> entry = qMakePair(-it.value(), it.key());
+        if (ranked.size() == maxResults && !(entry < ranked.last())) continue;
+
+        ranked.insert(qLowerBound(ranked.begin(), ranked.end(), entry) - ranked.begin(), entry);
+        if (ranked.size() > maxResults) ranked.removeLast();
+    }
+
+    QStringList results;
+    for (int i = 0; i < ranked.size(); i++) {
+        results.append(fileNames->at(ranked.at(i).second));
+    }
+    return results;
+}
+
+/* Ids of the names that may contain the keyword: those holding all of its trigrams.
+   Every name for a keyword without trigrams.
+*/
+QVector<int> SearchIndex::findCandidates(const QString &foldedKeyword) {
+
+    QList<quint64> ngrams = getNgrams(foldedKeyword);
+    if (ngrams.isEmpty()) {
+        QVector<int> allIds(fileNames->size());
+        for (int i = 0; i < allIds.size(); i++) {
+            allIds[i] = i;
+        }
+        return allIds;
+    }
+
+    // Start from the rarest trigram .. the intersection can only shrink
+    QList<QPair<int, quint64> > bySize;
+    for (int i = 0; i < ngrams.size(); i++) {
+        QHash<quint64, QVector<int> >::const_iterator it = postings->constFind(ngrams.at(i));
+        if (it == postings->constEnd()) return QVector<int>();
+        bySize.append(qMakePair(it.value().size(), ngrams.at(i)));
+    }
+    qSort(bySize);
+
+    QVector<int> candidates = postings->value(bySize.first().second);
+    for (int i = 1; i < bySize.size() && !candidates.isEmpty(); i++) {
+
+        const QVector<int> &list = (*postings)[bySize.at(i).second];
+        QVector<int> intersection;
+        int j = 0;
+        for (int k = 0; k < candidates.size(); k++) {
+            while (j < list.size() && list.at(j) < candidates.at(k)) j++;
+            if (j == list.size()) break;
+            if (list.at(j) == candidates.at(k)) intersection.append(candidates.at(k));
+        }
+        candidates = intersection;
+    }
+    return candidates;
+}
+
+/* Overlapping trigrams of the text, each packed in 48 bits */
+QList<quint64> SearchIndex::getNgrams(const QString &foldedText) {
+
+    QList<quint64> ngrams;
+    for (int i = 0; i + SEARCH_NGRAM_LENGTH <= foldedText.size(); i++) {
+        quint64 ngram = 0;
+        for (int j = 0; j < SEARCH_NGRAM_LENGTH; j++) {
+            ngram = (ngram << 16) | foldedText.at(i + j).unicode();
+        }
+        ngrams.append(ngram);
+    }
+    return ngrams;
+}
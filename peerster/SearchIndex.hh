@@ -0,0 +1,41 @@
+#ifndef SEARCHINDEX_HH
+#define SEARCHINDEX_HH
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QVector>
+
+#define SEARCH_MAX_RESULTS (64)             // file names returned for one search, best matches first
+#define SEARCH_NGRAM_LENGTH (3)
+
+/* Inverted trigram index over the names of the files we share.
+ * Every case folded name is broken into its overlapping trigrams and each trigram maps to
+ * the (sorted) ids of the names containing it. A keyword can only be a substring of names
+ * holding all of its trigrams, so only the intersection of those lists is checked against
+ * the keyword. Keywords too short to have a trigram are checked against every name.
+ * Names are added as files are shared.
+ */
+
+class SearchIndex
+{
+
+public:
+    SearchIndex();
+
+    void addFile(QString fileName);
+    QStringList search(QString keywords, int maxResults);
+    int getNumberOfFiles();
+
+    static QList<quint64> getNgrams(const QString &foldedText);
+
+private:
+    QVector<QString> *fileNames;                // file names by id
+    QVector<QString> *foldedNames;              // case folded file names by id
+    QHash<QString, int> *fileIds;               // < file name, id >
+    QHash<quint64, QVector<int> > *postings;    // < trigram, ids of the names containing it, ascending >
+
+    QVector<int> findCandidates(const QString &foldedKeyword);
+};
+
+#endif // SEARCHINDEX_HH
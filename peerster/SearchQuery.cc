@@ -0,0 +1,72 @@
+#include "SearchQuery.hh"
+
+SearchQuery::SearchQuery(quint32 searchId, QString keywords, quint32 initialBudget, qint64 now) {
+
+    this->searchId = searchId;
+    this->keywords = keywords;
+    this->budget = initialBudget;
+    startTime = now;
+    nextRoundTime = now + SEARCH_INTERVAL;
+    expanding = true;
+}
+
+quint32 SearchQuery::getSearchId() {
+    return searchId;
+}
+
+QString SearchQuery::getKeywords() {
+    return keywords;
+}
+
+quint32 SearchQuery::getBudget() {
+    return budget;
+}
+
+bool SearchQuery::isExpanding() {
+    return expanding;
+}
+
+bool SearchQuery::isDue(qint64 now) {
+    return expanding && now >= nextRoundTime;
+}
+
+bool SearchQuery::isExpired(qint64 now) {
+    return now - startTime > SEARCH_QUERY_LIFETIME;
+}
+
+/* Doubles the budget for the next round .. the search stops expanding past the budget limit */
+void SearchQuery::expandBudget(qint64 now) {
+
+    budget *= 2;
+    nextRoundTime = now + SEARCH_INTERVAL;
+    if (budget >= SEARCH_BUDGET_LIMIT) expanding = false;
+}
+
+/* Adds the files of a search reply and returns those not seen before for this search, < file hash, file name > */
+QMap<QByteArray, QString> SearchQuery::addResults(QVariantList fileNames, QVariantList fileHashes) {
+
+    QMap<QByteArray, QString> newResults;
+    for (int i = 0; i < fileNames.length() && i < fileHashes.length(); i++) {
+
+        // Get the last part of filename after slash from the absolute path
+        QString fileName = fileNames.at(i).toString().split("/").last();
+        QByteArray fileHash = fileHashes.at(i).toByteArray();
+        if (results.contains(fileHash)) continue;
+
+        results.insert(fileHash, fileName);
+        newResults.insert(fileHash, fileName);
+    }
+
+    // Enough results .. stop flooding the network with this search
+    if (results.size() >= SEARCH_MATCH_THRESHOLD) expanding = false;
+
+    return newResults;
+}
+
+bool SearchQuery::hasResult(QByteArray fileHash) {
+    return results.contains(fileHash);
+}
+
+QList<QByteArray> SearchQuery::getResultHashes() {
+    return results.keys();
+}
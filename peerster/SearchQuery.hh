@@ -0,0 +1,48 @@
+#ifndef SEARCHQUERY_HH
+#define SEARCHQUERY_HH
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QMap>
+#include <QVariantList>
+
+#define SEARCH_INTERVAL (1000)              // ms between two budget expansion rounds
+#define SEARCH_BUDGET_LIMIT (100)
+#define SEARCH_MATCH_THRESHOLD (10)         // a search stops expanding once it has this many results
+#define SEARCH_QUERY_LIFETIME (60000)       // ms replies are still accepted after a search started
+
+/* One search started from this node. Its budget doubles every SEARCH_INTERVAL until enough
+ * results came in or the budget limit is reached. Replies are collected in the search's own
+ * result set, so several searches can run side by side. A search that stopped expanding
+ * still takes late replies until its lifetime is over.
+ */
+
+class SearchQuery
+{
+
+public:
+    SearchQuery(quint32 searchId, QString keywords, quint32 initialBudget, qint64 now);
+
+    quint32 getSearchId();
+    QString getKeywords();
+    quint32 getBudget();
+    bool isExpanding();
+    bool isDue(qint64 now);
+    bool isExpired(qint64 now);
+    void expandBudget(qint64 now);
+    QMap<QByteArray, QString> addResults(QVariantList fileNames, QVariantList fileHashes);
+    bool hasResult(QByteArray fileHash);
+    QList<QByteArray> getResultHashes();
+
+private:
+    quint32 searchId;
+    QString keywords;
+    quint32 budget;
+    qint64 startTime;
+    qint64 nextRoundTime;
+    bool expanding;
+    QMap<QByteArray, QString> results;      // < file hash, file name > .. files may share a name
+};
+
+#endif // SEARCHQUERY_HH
@@ -0,0 +1,148 @@
+#include "ShareIndex.hh"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+
+ShareIndex::ShareIndex(QString indexFilePath) {
+    this->indexFilePath = indexFilePath;
+    entries = new QMap<QString, IndexEntry>();
+    savePool = new QThreadPool();
+    savePool->setMaxThreadCount(1);
+
+    load();
+}
+
+/* Returns true and fills in the stored hashes if the file is indexed and has not changed since */
+bool ShareIndex::lookup(QString filePath, bool contentDefined, qint64 *fileSize, QByteArray *blockListMeta,
+                        QByteArray *fileHash) {
+
+    QMap<QString, IndexEntry>::const_iterator it = entries->constFind(filePath);
+    if (it == entries->constEnd()) return false;
+
+    qint64 size, modifiedTime;
+    quint64 inode;
+    if (!statFile(filePath, &size, &modifiedTime, &inode)) return false;
+
+    const IndexEntry &entry = it.value();
+    if (entry.contentDefined != contentDefined) return false;
+    if (entry.fileSize != size || entry.modifiedTime != modifiedTime || entry.inode != inode) return false;
+
+    *fileSize = entry.fileSize;
+    *blockListMeta = entry.blockListMeta;
+    *fileHash = entry.fileHash;
+    return true;
+}
+
+/* fileSize, modifiedTime and inode are those of the file before it was read for hashing */
+void ShareIndex::update(QString filePath, qint64 fileSize, qint64 modifiedTime, quint64 inode, bool contentDefined,
+                        QByteArray blockListMeta, QByteArray fileHash) {
+
+    IndexEntry entry;
+    if (!statFile(filePath, &entry.fileSize, &entry.modifiedTime, &entry.inode)) return;
+
+    // The file changed while it was being hashed .. don't trust these hashes after a restart
+    if (entry.fileSize != fileSize || entry.modifiedTime != modifiedTime || entry.inode != inode) {
+        qDebug() << "Not indexing" << filePath << ".. it changed while it was being hashed";
+        entries->remove(filePath);
+        return;
+    }
+
+    entry.contentDefined = contentDefined;
+    entry.blockListMeta = blockListMeta;
+    entry.fileHash = fileHash;
+    entries->insert(filePath, entry);
+}
+
+void ShareIndex::remove(QString filePath) {
+
+    entries->remove(filePath);
+}
+
+QStringList ShareIndex::getIndexedFiles() {
+
+    return entries->keys();
+}
+
+void ShareIndex::save() {
+
+    savePool->start(new ShareIndexWriter(indexFilePath, *entries));
+}
+
+ShareIndexWriter::ShareIndexWriter(QString indexFilePath, QMap<QString, ShareIndex::IndexEntry> entries) {
+    this->indexFilePath = indexFilePath;
+    this->entries = entries;
+}
+
+void ShareIndexWriter::run() {
+
+    QDir().mkpath(QFileInfo(indexFilePath).absolutePath());
+
+    QString tempFilePath = indexFilePath + ".tmp";
+    QFile file(tempFilePath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qDebug() << "Cannot write share index" << tempFilePath;
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << (quint32) SHARE_INDEX_MAGIC << (quint32) SHARE_INDEX_VERSION;
+    stream << (quint32) entries.size();
+
+    QMap<QString, ShareIndex::IndexEntry>::const_iterator it;
+    for (it = entries.constBegin(); it != entries.constEnd(); it++) {
+        const ShareIndex::IndexEntry &entry = it.value();
+        stream << it.key() << entry.fileSize << entry.modifiedTime << entry.inode
+               << entry.contentDefined << entry.blockListMeta << entry.fileHash;
+    }
+
+    file.close();
+
+    if (rename(QFile::encodeName(tempFilePath).constData(), QFile::encodeName(indexFilePath).constData()) != 0) {
+        qDebug() << "Cannot replace share index" << indexFilePath;
+    }
+}
+
+void ShareIndex::load() {
+
+    QFile file(indexFilePath);
+    if (!file.open(QIODevice::ReadOnly)) return;    // no index yet
+
+    QDataStream stream(&file);
+    quint32 magic, version, numEntries;
+    stream >> magic >> version >> numEntries;
+    if (magic != SHARE_INDEX_MAGIC || version != SHARE_INDEX_VERSION) {
+        qDebug() << "Ignoring share index with unknown format" << indexFilePath;
+        return;
+    }
+
+    for (quint32 i = 0; i < numEntries; i++) {
+        QString filePath;
+        IndexEntry entry;
+        stream >> filePath >> entry.fileSize >> entry.modifiedTime >> entry.inode
+               >> entry.contentDefined >> entry.blockListMeta >> entry.fileHash;
+
+        if (stream.status() != QDataStream::Ok) {
+            qDebug() << "Share index is truncated" << indexFilePath;
+            break;
+        }
+        entries->insert(filePath, entry);
+    }
+
+    qDebug() << "Loaded share index with" << entries->size() << "files";
+}
+
+bool ShareIndex::statFile(QString filePath, qint64 *fileSize, qint64 *modifiedTime, quint64 *inode) {
+
+    struct stat fileStat;
+    if (stat(QFile::encodeName(filePath).constData(), &fileStat) != 0) return false;
+
+    *fileSize = fileStat.st_size;
+    *modifiedTime = (qint64) fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    *inode = fileStat.st_ino;
+    return true;
+}
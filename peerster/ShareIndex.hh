@@ -0,0 +1,71 @@
+#ifndef SHAREINDEX_HH
+#define SHAREINDEX_HH
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QMap>
+#include <QRunnable>
+#include <QThreadPool>
+
+#define SHARE_INDEX_MAGIC (0x50534958) // "PSIX"
+#define SHARE_INDEX_VERSION (3)     // 2: hash tree file hashes for big files, 3: content-defined blocks
+
+/* On-disk index of the files we share, so that they can be served again after a restart
+ * without being re-hashed. Each entry holds the metafile and file hash computed for a file,
+ * together with the (size, mtime, inode) of the file when it was hashed: an entry is only
+ * used while the file on disk still matches them, and only for the same kind of blocks
+ * (fixed size or content-defined) as requested.
+ * The index is written in the background, from a snapshot taken when save is called
+ * (the entries are implicitly shared, so that is cheap). Saves are written one at a time, in order.
+ */
+
+class ShareIndex
+{
+
+public:
+    ShareIndex(QString indexFilePath);
+
+    bool lookup(QString filePath, bool contentDefined, qint64 *fileSize, QByteArray *blockListMeta,
+                QByteArray *fileHash);
+    void update(QString filePath, qint64 fileSize, qint64 modifiedTime, quint64 inode, bool contentDefined,
+                QByteArray blockListMeta, QByteArray fileHash);
+    void remove(QString filePath);
+    QStringList getIndexedFiles();
+    void save();
+
+    static bool statFile(QString filePath, qint64 *fileSize, qint64 *modifiedTime, quint64 *inode);
+
+    struct IndexEntry {
+        qint64 fileSize;
+        qint64 modifiedTime;    // nanoseconds since epoch
+        quint64 inode;
+        bool contentDefined;
+        QByteArray blockListMeta;
+        QByteArray fileHash;
+    };
+
+private:
+    QString indexFilePath;
+    QMap<QString, IndexEntry> *entries;     // < file path, index entry >
+    QThreadPool *savePool;                  // a single thread, so saves don't overlap
+
+    void load();
+};
+
+/* Writes a snapshot of the index to a temporary file and renames it over the old one,
+ * so a crash while saving never leaves a truncated index behind
+ */
+class ShareIndexWriter : public QRunnable
+{
+
+public:
+    ShareIndexWriter(QString indexFilePath, QMap<QString, ShareIndex::IndexEntry> entries);
+    void run();
+
+private:
+    QString indexFilePath;
+    QMap<QString, ShareIndex::IndexEntry> entries;
+};
+
+#endif // SHAREINDEX_HH
@@ -1,6 +1,6 @@
 #include "SharedFile.hh"
 
-SharedFile::SharedFile(QString name, int size, QByteArray hash) {
+SharedFile::SharedFile(QString name, qint64 size, QByteArray hash) {
 
     this->fileName = name;
     this->fileSize = size;
@@ -11,7 +11,7 @@ QString SharedFile::getFileName() {
     return this->fileName;
 }
 
-int SharedFile::getFileSize() {
+qint64 SharedFile::getFileSize() {
     return this->fileSize;
 }
 
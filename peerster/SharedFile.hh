@@ -10,14 +10,14 @@ class SharedFile : public QObject {
 
 public:
     SharedFile();
-    SharedFile(QString name, int size, QByteArray hash);
+    SharedFile(QString name, qint64 size, QByteArray hash);
     QString getFileName();
-    int getFileSize();
+    qint64 getFileSize();
     QByteArray getFileHash();
 
 private:
     QString fileName;
-    int fileSize;
+    qint64 fileSize;
     QByteArray fileHash;
 };
 
@@ -0,0 +1,104 @@
+#include "UploadScheduler.hh"
+
+UploadScheduler::UploadScheduler(qint64 rateLimit) {
+    this->rateLimit = rateLimit;
+    tokens = UPLOAD_BURST_SIZE;
+    queuedBytes = 0;
+    lastRefill = -1;
+    queues = new QHash<QString, OriginQueue>();
+    activeOrigins = new QList<QString>();
+
+    stats.sentBytes = 0;
+    stats.refused = 0;
+    stats.queued = 0;
+}
+
+/* Queues a block reply owed to origin. Returns false if the origin (or everyone) has too many waiting. */
+bool UploadScheduler::enqueue(QString origin, UploadRequest request) {
+
+    QHash<QString, OriginQueue>::iterator it = queues->find(origin);
+    if (stats.queued >= UPLOAD_MAX_QUEUED ||
+            (it != queues->end() && it.value().requests.size() >= UPLOAD_MAX_QUEUED_PER_ORIGIN)) {
+        stats.refused++;
+        return false;
+    }
+
+    if (it == queues->end()) {
+        OriginQueue queue;
+        queue.deficit = 0;
+        queue.visiting = false;
+        it = queues->insert(origin, queue);
+        activeOrigins->append(origin);
+    }
+
+    it.value().requests.enqueue(request);
+    stats.queued++;
+    queuedBytes += request.cost;
+    return true;
+}
+
+void UploadScheduler::refill(qint64 now) {
+
+    if (lastRefill >= 0 && now > lastRefill) {
+        tokens = qMin((double) UPLOAD_BURST_SIZE, tokens + (double) rateLimit * (now - lastRefill) / 1000);
+    }
+    lastRefill = now;
+}
+
+/* Returns the requests to answer now, taking turns between origins, as far as the rate limit allows.
+   The last request may overdraw the bucket: it is paid back before anything else goes out.
+*/
+QList<UploadScheduler::UploadRequest> UploadScheduler::takeReady(qint64 now) {
+
+    refill(now);
+
+    QList<UploadRequest> ready;
+    while (!activeOrigins->isEmpty() && (rateLimit <= 0 || tokens > 0)) {
+
+        QString origin = activeOrigins->first();
+        OriginQueue &queue = (*queues)[origin];
+        if (!queue.visiting) {
+            queue.deficit += UPLOAD_QUANTUM;
+            queue.visiting = true;
+        }
+
+        while (!queue.requests.isEmpty() && queue.requests.head().cost <= queue.deficit &&
+               (rateLimit <= 0 || tokens > 0)) {
+            UploadRequest request = queue.requests.dequeue();
+            queue.deficit -= request.cost;
+            if (rateLimit > 0) tokens -= request.cost;
+            stats.sentBytes += request.cost;
+            stats.queued--;
+            queuedBytes -= request.cost;
+            ready.append(request);
+        }
+
+        // Out of tokens in the middle of the origin's turn .. it goes on from here next time
+        if (!queue.requests.isEmpty() && queue.requests.head().cost <= queue.deficit) break;
+
+        queue.visiting = false;
+        activeOrigins->removeFirst();
+        if (queue.requests.isEmpty()) {
+            queues->remove(origin);         // an idle origin doesn't keep its deficit
+        } else {
+            activeOrigins->append(origin);
+        }
+    }
+
+    return ready;
+}
+
+/* ms a refused requester should wait before asking again: roughly until the queued replies are sent */
+int UploadScheduler::getRetryDelay() {
+
+    if (rateLimit <= 0) return UPLOAD_MIN_RETRY_DELAY;
+    return (int) qBound((qint64) UPLOAD_MIN_RETRY_DELAY, queuedBytes * 1000 / rateLimit, (qint64) UPLOAD_MAX_RETRY_DELAY);
+}
+
+bool UploadScheduler::hasQueuedRequests() {
+    return !activeOrigins->isEmpty();
+}
+
+UploadScheduler::Stats UploadScheduler::getStats() {
+    return stats;
+}
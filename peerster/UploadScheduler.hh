@@ -0,0 +1,72 @@
+#ifndef UPLOADSCHEDULER_HH
+#define UPLOADSCHEDULER_HH
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QQueue>
+#include <QVariantMap>
+
+#include "Peer.hh"
+
+#define UPLOAD_RATE_LIMIT (2 * 1024 * 1024)     // bytes/s of block replies .. 0 for no limit
+#define UPLOAD_BURST_SIZE (32 * 8192)           // bytes that may go out at once after an idle period
+#define UPLOAD_QUANTUM (8192)                   // bytes each requester may send per round
+#define UPLOAD_MAX_QUEUED_PER_ORIGIN (64)       // block requests waiting per requester
+#define UPLOAD_MAX_QUEUED (4096)                // block requests waiting overall
+#define UPLOAD_MIN_RETRY_DELAY (100)            // ms, bounds of the delay refused requesters are told to wait
+#define UPLOAD_MAX_RETRY_DELAY (5000)
+
+/* Decides when the block replies we owe go out. Each requesting origin gets its own queue and
+ * the queues are served by deficit round-robin: every round an origin may send UPLOAD_QUANTUM
+ * bytes more, so requesters get the same bandwidth however many requests each of them sends.
+ * All replies together are held to UPLOAD_RATE_LIMIT by a token bucket, which leaves room on
+ * the uplink for chat and gossip (never scheduled). Requests beyond an origin's quota are refused
+ * and the requester is told how long to wait (about the time it takes to send what is queued).
+ */
+
+class UploadScheduler
+{
+
+public:
+    struct UploadRequest {
+        QVariantMap request;
+        Peer *sender;                       // neighbor to send the reply to
+        QByteArray data;                    // relayed block, empty for our own blocks (read when sent)
+        int cost;                           // bytes of the reply's block
+    };
+
+    struct Stats {
+        qint64 sentBytes;
+        qint64 refused;                     // requests over quota
+        int queued;
+    };
+
+    UploadScheduler(qint64 rateLimit);
+
+    bool enqueue(QString origin, UploadRequest request);
+    QList<UploadRequest> takeReady(qint64 now);
+    bool hasQueuedRequests();
+    int getRetryDelay();
+    Stats getStats();
+
+private:
+    struct OriginQueue {
+        QQueue<UploadRequest> requests;
+        int deficit;                        // bytes the origin may still send this round
+        bool visiting;                      // the origin's turn was interrupted by the rate limit
+    };
+
+    qint64 rateLimit;
+    double tokens;                          // bytes that may be sent now
+    qint64 queuedBytes;
+    qint64 lastRefill;
+    QHash<QString, OriginQueue> *queues;    // < origin, requests waiting >
+    QList<QString> *activeOrigins;          // origins with waiting requests, in round-robin order
+    Stats stats;
+
+    void refill(qint64 now);
+};
+
+#endif // UPLOADSCHEDULER_HH
@@ -16,13 +16,13 @@ int main(int argc, char **argv)
     QStringList argsList = QCoreApplication::arguments();
     // argsList.at(0) = ./peerster
 
-    bool noForward = false;
-    if (argsList.size() > 1 && argsList.at(1) == "noforward") {
-        noForward = true;
-    }
+    // Flags may come in any order .. everything else is a neighbor
+    bool noForward = argsList.contains("noforward");
+    bool contentDefinedChunking = argsList.contains("cdc");
+    bool relayCache = argsList.contains("relaycache");
 
     // Create a UDP network socket
-    NetSocket *sock = new NetSocket(noForward);
+    NetSocket *sock = new NetSocket(noForward, contentDefinedChunking, relayCache);
     if (!(sock->bind()))
 		exit(1);
 
@@ -32,6 +32,7 @@ int main(int argc, char **argv)
 
 
 	for (int i = 1; i < argsList.size(); i++) {
+        if (argsList.at(i) == "noforward" || argsList.at(i) == "cdc" || argsList.at(i) == "relaycache") continue;
         sock->addNewNeighbor(argsList.at(i));
 	}
 
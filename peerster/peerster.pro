@@ -8,13 +8,33 @@ DEPENDPATH += .
 INCLUDEPATH += .
 QT += network
 CONFIG += crypto
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
+
+# Disk I/O through io_uring when liburing is installed, a thread pool otherwise
+unix:packagesExist(liburing) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += liburing
+    DEFINES += HAVE_LIBURING
+}
 
 # Input
 HEADERS += main.hh \
     Peer.hh \
     Router.hh \
-    FileBlock.hh \
+    BlockStore.hh \
+    BlockCache.hh \
+    FileHasher.hh \
+    HashTree.hh \
+    ShareIndex.hh \
+    SearchIndex.hh \
+    SearchHistory.hh \
+    SearchQuery.hh \
+    ContentSummary.hh \
+    DhtRoutingTable.hh \
+    DhtLookup.hh \
+    Dht.hh \
+    UploadScheduler.hh \
+    AsyncBlockIO.hh \
     SharedFile.hh \
     OngoingDownload.hh \
     ImageProcessor.hh \
@@ -27,7 +47,20 @@ HEADERS += FileShareManager.hh
 SOURCES += main.cc \
     Peer.cc \
     Router.cc \
-    FileBlock.cc \
+    BlockStore.cc \
+    BlockCache.cc \
+    FileHasher.cc \
+    HashTree.cc \
+    ShareIndex.cc \
+    SearchIndex.cc \
+    SearchHistory.cc \
+    SearchQuery.cc \
+    ContentSummary.cc \
+    DhtRoutingTable.cc \
+    DhtLookup.cc \
+    Dht.cc \
+    UploadScheduler.cc \
+    AsyncBlockIO.cc \
     SharedFile.cc \
     OngoingDownload.cc \
     ImageProcessor.cc \